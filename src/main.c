@@ -3,12 +3,28 @@
 int main(int argc, char **argv) {
     //already test ok
     //ni_malloc_test(argc, argv);
+    //ni_malloc_bench(argc, argv);
 
     //already test ok
     ni_list_test();
 
     //ni_string_test();
 
+    //ni_arena_test();
+
+    //ni_lazyfree_test();
+
+    //ni_defrag_test();
+
+    //ni_sync_test();
+    //ni_sync_bench(argc, argv);
+
+    //ni_epoch_test();
+
+    //ni_ilist_test();
+    //ni_ulist_test();
+    //ni_listpack_test();
+
     getchar();
     return 0;
 }
@@ -0,0 +1,165 @@
+/* ni_arena.c - Region allocator for short lived objects
+ *
+ * An arena groups the allocations of a unit of work, for instance a
+ * request, so that all of them can be released at once with
+ * ni_arena_reset() instead of being freed one by one. Objects allocated
+ * from an arena can't be freed or reallocated individually.
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "ni_arena.h"
+#include "ni_malloc.h"
+#include "ni_atomic.h"
+
+/* Bytes held by all the arenas. They are part of ni_malloc_used_memory()
+ * as well, since chunks are obtained from ni_malloc() charged to the
+ * NI_MEM_ARENA tag. */
+static ni_atomic size_t arena_memory = 0;
+pthread_mutex_t arena_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t arena_info_once = PTHREAD_ONCE_INIT;
+
+/* Report arena_memory as the "arena" source of ni_malloc_get_info(). */
+static void ni_arena_register_info(void) {
+    ni_malloc_register_info_source("arena", ni_arena_memory, NULL);
+}
+
+#define ni_arena_align(n) (((n) + NI_ARENA_ALIGN - 1) & ~(NI_ARENA_ALIGN - 1))
+
+static ni_arena_chunk *ni_arena_chunk_create(ni_arena *a, size_t size) {
+    ni_arena_chunk *chunk;
+    if ((chunk = ni_malloc_tagged(sizeof(*chunk) + size, NI_MEM_ARENA)) == NULL)
+        return NULL;
+    /* Use all the usable space, so that the arena accounting matches the
+     * one of ni_malloc. */
+    chunk->next = NULL;
+    chunk->size = ni_malloc_size(chunk) - sizeof(*chunk);
+    size = chunk->size;
+    a->allocated += sizeof(*chunk) + size;
+    atomicIncr(arena_memory, sizeof(*chunk) + size);
+    return chunk;
+}
+
+static void ni_arena_chunk_release(ni_arena *a, ni_arena_chunk *chunk) {
+    a->allocated -= sizeof(*chunk) + chunk->size;
+    atomicDecr(arena_memory, sizeof(*chunk) + chunk->size);
+    ni_free_tagged(chunk, NI_MEM_ARENA);
+}
+
+/* Create a new arena allocating 'chunk_size' bytes at a time, or
+ * NI_ARENA_CHUNK_SIZE bytes if zero is passed. No chunk is allocated until
+ * the first allocation.
+ *
+ * On error, NULL is returned. Otherwise the pointer to the new arena. */
+ni_arena *ni_arena_create(size_t chunk_size) {
+    ni_arena *a;
+    pthread_once(&arena_info_once, ni_arena_register_info);
+    if ((a = ni_malloc_tagged(sizeof(*a), NI_MEM_ARENA)) == NULL)
+        return NULL;
+    a->first = a->current = a->large = NULL;
+    a->pos = a->end = NULL;
+    a->chunk_size = chunk_size ? chunk_size : NI_ARENA_CHUNK_SIZE;
+    a->used = 0;
+    a->allocated = 0;
+    return a;
+}
+
+/* Allocate 'size' bytes aligned to NI_ARENA_ALIGN from the arena.
+ *
+ * On error, NULL is returned and the arena is left unaltered. */
+void *ni_arena_alloc(ni_arena *a, size_t size) {
+    ni_arena_chunk *chunk;
+    void *ptr;
+
+    size = size ? ni_arena_align(size) : NI_ARENA_ALIGN;
+    if ((size_t)(a->end - a->pos) >= size) {
+        ptr = a->pos;
+        a->pos += size;
+        a->used += size;
+        return ptr;
+    }
+
+    /* Large requests get a dedicated chunk, so that the current one is not
+     * abandoned while it is still mostly free. */
+    if (size > a->chunk_size / 4) {
+        if ((chunk = ni_arena_chunk_create(a, size)) == NULL)
+            return NULL;
+        chunk->next = a->large;
+        a->large = chunk;
+        a->used += size;
+        return chunk->data;
+    }
+
+    /* Move to the next chunk, reusing the ones kept by the last reset. */
+    if (a->current && a->current->next) {
+        chunk = a->current->next;
+    } else {
+        if ((chunk = ni_arena_chunk_create(a, a->chunk_size)) == NULL)
+            return NULL;
+        if (a->current)
+            a->current->next = chunk;
+        else
+            a->first = chunk;
+    }
+    a->current = chunk;
+    a->pos = chunk->data + size;
+    a->end = chunk->data + chunk->size;
+    a->used += size;
+    return chunk->data;
+}
+
+/* Like ni_arena_alloc() but the memory is set to zero. */
+void *ni_arena_calloc(ni_arena *a, size_t size) {
+    void *ptr = ni_arena_alloc(a, size);
+    if (ptr) memset(ptr, 0, size);
+    return ptr;
+}
+
+/* Release at once everything allocated from the arena. The regular chunks
+ * are kept to serve the next allocations, only the dedicated chunks of
+ * large requests are freed.
+ *
+ * This function can't fail. */
+void ni_arena_reset(ni_arena *a) {
+    ni_arena_chunk *chunk, *next;
+
+    for (chunk = a->large; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        ni_arena_chunk_release(a, chunk);
+    }
+    a->large = NULL;
+    a->current = a->first;
+    if (a->first) {
+        a->pos = a->first->data;
+        a->end = a->first->data + a->first->size;
+    }
+    a->used = 0;
+}
+
+/* Free the arena and all the memory allocated from it.
+ *
+ * This function can't fail. */
+void ni_arena_destroy(ni_arena *a) {
+    ni_arena_chunk *chunk, *next;
+
+    if (a == NULL) return;
+    ni_arena_reset(a);
+    for (chunk = a->first; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        ni_arena_chunk_release(a, chunk);
+    }
+    ni_free_tagged(a, NI_MEM_ARENA);
+}
+
+/* Return the amount of memory held by all the arenas, including the space
+ * not yet handed out in their chunks. */
+size_t ni_arena_memory(void) {
+    size_t am;
+    atomicGet(arena_memory, am);
+    return am;
+}
@@ -0,0 +1,50 @@
+/* ni_arena.h - Region allocator for short lived objects
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#ifndef _NI_ARENA_H_
+#define _NI_ARENA_H_
+
+#include <stddef.h>
+
+#define NI_ARENA_CHUNK_SIZE     (16*1024)
+#define NI_ARENA_ALIGN          (sizeof(void*))
+
+/* Memory is handed out bumping a pointer inside the current chunk. Chunks
+ * are kept across resets, so a reset is O(1) and the next request served
+ * by the arena does not need to allocate them again. Requests that do not
+ * fit in the current chunk and are larger than a quarter of the chunk size
+ * get a dedicated chunk, released by the next reset. */
+typedef struct ni_arena_chunk {
+    struct ni_arena_chunk   *next;
+    size_t                  size;   /* Bytes in data[]. */
+    char                    data[];
+} ni_arena_chunk;
+
+typedef struct ni_arena {
+    ni_arena_chunk  *first;     /* Chunks of 'chunk_size' bytes. */
+    ni_arena_chunk  *current;   /* Chunk we are allocating from. */
+    ni_arena_chunk  *large;     /* Dedicated chunks of large requests. */
+    char            *pos;       /* Next free byte of 'current'. */
+    char            *end;       /* End of 'current'. */
+    size_t          chunk_size;
+    size_t          used;       /* Bytes handed out since the last reset. */
+    size_t          allocated;  /* Bytes of all the chunks. */
+} ni_arena;
+
+/* Functions implemented as macros */
+#define arenaUsed(a)            ((a)->used)
+#define arenaAllocated(a)       ((a)->allocated)
+
+/* Prototypes */
+ni_arena *ni_arena_create(size_t chunk_size);
+void *ni_arena_alloc(ni_arena *a, size_t size);
+void *ni_arena_calloc(ni_arena *a, size_t size);
+void ni_arena_reset(ni_arena *a);
+void ni_arena_destroy(ni_arena *a);
+size_t ni_arena_memory(void);
+
+#endif /* _NI_ARENA_H_ */
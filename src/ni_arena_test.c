@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ni_test.h"
+
+int ni_arena_test() {
+    {
+        size_t initial = ni_malloc_used_memory(), allocated;
+        ni_arena *a = ni_arena_create(1024);
+        ni_malloc_info info;
+        char *p, *q;
+        int j, aligned = 1;
+
+        test_cond("Create an arena without chunks",
+            a != NULL && arenaAllocated(a) == 0)
+
+        for (j = 0; j < 100; j++) {
+            p = ni_arena_alloc(a, j + 1);
+            if ((size_t)p & (NI_ARENA_ALIGN - 1)) aligned = 0;
+            memset(p, 'x', j + 1);
+        }
+        test_cond("Arena allocations are aligned", aligned)
+        test_cond("Arena chunks are accounted separately",
+            ni_arena_memory() == arenaAllocated(a) && arenaAllocated(a) > 0)
+        ni_malloc_get_info(&info);
+        test_cond("Arena memory is part of the allocator info",
+            ni_malloc_info_source_bytes(&info, "arena") == ni_arena_memory())
+
+        allocated = arenaAllocated(a);
+        p = ni_arena_alloc(a, 4096);
+        test_cond("Large requests get a dedicated chunk",
+            arenaAllocated(a) > allocated + 4096)
+
+        ni_arena_reset(a);
+        test_cond("Reset releases large chunks and keeps the others",
+            arenaUsed(a) == 0 && arenaAllocated(a) == allocated)
+        q = ni_arena_alloc(a, 16);
+        test_cond("Reset rewinds to the first chunk",
+            q == a->first->data)
+
+        for (j = 0; j < 100; j++) ni_arena_alloc(a, j + 1);
+        test_cond("Chunks kept by reset are reused",
+            arenaAllocated(a) == allocated)
+
+        ni_arena_destroy(a);
+        test_cond("Destroy releases all the memory",
+            ni_malloc_used_memory() == initial && ni_arena_memory() == 0)
+    }
+
+    {
+        ni_arena *a = ni_arena_create(0);
+        size_t initial = ni_malloc_used_memory();
+        ni_string x, y, *tokens;
+        int count;
+
+        x = ni_string_new_arena(a, "foo");
+        test_cond("Create an arena string",
+            ni_string_len(x) == 3 && memcmp(x, "foo\0", 4) == 0 &&
+            (x[-1] & NI_STRING_TYPE_MASK) == NI_STRING_TYPE_8)
+
+        y = ni_string_cat(ni_string_dup_arena(a, x), "bar");
+        test_cond("Growing an arena string moves it to the heap",
+            ni_string_len(y) == 6 && memcmp(y, "foobar\0", 7) == 0 &&
+            !(y[-1] & NI_STRING_ARENA) && ni_malloc_used_memory() > initial)
+        ni_string_obj_free(y);
+        ni_string_obj_free(x);
+
+        tokens = ni_string_split_len_arena(a, "a,bb,ccc", 8, ",", 1, &count);
+        test_cond("ni_string_split_len_arena()",
+            count == 3 && memcmp(tokens[0], "a\0", 2) == 0 &&
+            memcmp(tokens[2], "ccc\0", 4) == 0)
+
+        tokens = ni_string_split_args_arena(a,
+            "set key \"hello world\" 'x' 1 2 3 4 5 6 7 8 9", &count);
+        test_cond("ni_string_split_args_arena()",
+            count == 13 && memcmp(tokens[2], "hello world\0", 12) == 0 &&
+            memcmp(tokens[12], "9\0", 2) == 0)
+
+        ni_arena_reset(a);
+        test_cond("Request temporaries go away with a single reset",
+            arenaUsed(a) == 0 &&
+            ni_malloc_used_memory() == initial + ni_arena_memory())
+
+        ni_arena_destroy(a);
+    }
+
+    {
+        ni_arena *a = ni_arena_create(0);
+        ni_list *lst = ni_list_create_arena(a);
+        ni_list_node *nd;
+        size_t used;
+        long j;
+
+        for (j = 0; j < 1000; j++)
+            ni_list_add_node_tail(lst, (void*)j);
+        nd = ni_list_index(lst, 500);
+        test_cond("Arena list nodes", lstLen(lst) == 1000 &&
+            lstNodeVal(nd) == (void*)500)
+
+        used = arenaUsed(a);
+        ni_list_del_node(lst, nd);
+        ni_list_insert_node(lst, ni_list_index(lst, 10), (void*)-1, 1);
+        test_cond("Deleting arena nodes does not free them",
+            lstLen(lst) == 1000 && arenaUsed(a) > used &&
+            lstNodeVal(ni_list_index(lst, 11)) == (void*)-1)
+
+        ni_list_release(lst);
+        ni_arena_destroy(a);
+    }
+    test_report()
+    return 0;
+}
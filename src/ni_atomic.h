@@ -1,23 +1,40 @@
-/* This file implements atomic counters using __atomic or __sync macros if
- * available, otherwise synchronizing different threads using a mutex.
+/* This file implements atomic counters using C11 <stdatomic.h>, the
+ * __atomic or __sync macros if available, otherwise synchronizing different
+ * threads using a mutex.
  *
- * The exported interface is composed of three macros:
+ * The exported interface is composed of the following macros:
  *
  * atomicIncr(var,count) -- Increment the atomic counter
  * atomicGetIncr(var,oldvalue_var,count) -- Get and increment the atomic counter
  * atomicDecr(var,count) -- Decrement the atomic counter
  * atomicGet(var,dstvar) -- Fetch the atomic counter value
  * atomicSet(var,value)  -- Set the atomic counter value
+ * atomicGetWithSync(var,dstvar) -- Fetch the value with acquire semantics
+ * atomicSetWithSync(var,value)  -- Set the value with release semantics
  *
- * The variable 'var' should also have a declared mutex with the same
- * name and the "_mutex" postfix, for instance:
+ * The plain counter macros use relaxed memory ordering: they only guarantee
+ * that the counter itself is updated atomically, which is all that memory
+ * accounting and statistics need. When the counter is used to publish other
+ * data (a flag guarding a structure, a ready index, ...) use the *WithSync
+ * variants, that pair an acquire load with a release store.
  *
- *  long myvar;
+ * The variable 'var' should be declared with the 'ni_atomic' qualifier and
+ * should also have a declared mutex with the same name and the "_mutex"
+ * postfix, for instance:
+ *
+ *  static ni_atomic long myvar;
  *  pthread_mutex_t myvar_mutex;
  *  atomicSet(myvar,12345);
  *
- * If atomic primitives are available (tested in config.h) the mutex
- * is not used.
+ * If atomic primitives are available the mutex is not used. The backend is
+ * selected at compile time in this order: C11 atomics, __atomic builtins,
+ * __sync builtins and finally the mutex. Defining NI_ATOMIC_FORCE_SYNC or
+ * NI_ATOMIC_FORCE_MUTEX before including this file skips the preferred
+ * backends, which is useful to benchmark them against each other. The name
+ * of the selected backend is available as the NI_ATOMIC_API string.
+ *
+ * NI_CACHE_ALIGNED and NI_CACHE_PAD() keep counters written by different
+ * threads on different cache lines, see the end of this file.
  *
  * Never use return value from the macros, instead use the AtomicGetIncr()
  * if you need to get the current value and increment it atomically, like
@@ -39,6 +56,78 @@
 #ifndef _NI_ATOMIC_H_
 #define _NI_ATOMIC_H_
 
+#if !defined(NI_ATOMIC_FORCE_MUTEX) && !defined(NI_ATOMIC_FORCE_SYNC) && \
+    !defined(__STDC_NO_ATOMICS__) && defined(__STDC_VERSION__) && \
+    (__STDC_VERSION__ >= 201112L)
+/* Implementation using C11 <stdatomic.h>. */
+#include <stdatomic.h>
+#define ni_atomic _Atomic
+
+#define atomicIncr(var,count) \
+    atomic_fetch_add_explicit(&var,(count),memory_order_relaxed)
+#define atomicGetIncr(var,oldvalue_var,count) do { \
+    oldvalue_var = atomic_fetch_add_explicit(&var,(count),memory_order_relaxed); \
+} while(0)
+#define atomicDecr(var,count) \
+    atomic_fetch_sub_explicit(&var,(count),memory_order_relaxed)
+#define atomicGet(var,dstvar) do { \
+    dstvar = atomic_load_explicit(&var,memory_order_relaxed); \
+} while(0)
+#define atomicSet(var,value) \
+    atomic_store_explicit(&var,value,memory_order_relaxed)
+#define atomicGetWithSync(var,dstvar) do { \
+    dstvar = atomic_load_explicit(&var,memory_order_acquire); \
+} while(0)
+#define atomicSetWithSync(var,value) \
+    atomic_store_explicit(&var,value,memory_order_release)
+#define NI_ATOMIC_API "c11-builtin"
+
+#elif !defined(NI_ATOMIC_FORCE_MUTEX) && !defined(NI_ATOMIC_FORCE_SYNC) && \
+    defined(__ATOMIC_RELAXED) && !defined(__sun) && \
+    (!defined(__clang__) || !defined(__APPLE__) || __apple_build_version__ > 4210057)
+/* Implementation using __atomic macros. */
+#define ni_atomic
+
+#define atomicIncr(var,count) __atomic_add_fetch(&var,(count),__ATOMIC_RELAXED)
+#define atomicGetIncr(var,oldvalue_var,count) do { \
+    oldvalue_var = __atomic_fetch_add(&var,(count),__ATOMIC_RELAXED); \
+} while(0)
+#define atomicDecr(var,count) __atomic_sub_fetch(&var,(count),__ATOMIC_RELAXED)
+#define atomicGet(var,dstvar) do { \
+    dstvar = __atomic_load_n(&var,__ATOMIC_RELAXED); \
+} while(0)
+#define atomicSet(var,value) __atomic_store_n(&var,value,__ATOMIC_RELAXED)
+#define atomicGetWithSync(var,dstvar) do { \
+    dstvar = __atomic_load_n(&var,__ATOMIC_ACQUIRE); \
+} while(0)
+#define atomicSetWithSync(var,value) \
+    __atomic_store_n(&var,value,__ATOMIC_RELEASE)
+#define NI_ATOMIC_API "atomic-builtin"
+
+#elif !defined(NI_ATOMIC_FORCE_MUTEX) && defined(__GNUC__)
+/* Implementation using __sync macros. These are full barriers, so the
+ * *WithSync variants are the same as the plain ones. */
+#define ni_atomic
+
+#define atomicIncr(var,count) __sync_add_and_fetch(&var,(count))
+#define atomicGetIncr(var,oldvalue_var,count) do { \
+    oldvalue_var = __sync_fetch_and_add(&var,(count)); \
+} while(0)
+#define atomicDecr(var,count) __sync_sub_and_fetch(&var,(count))
+#define atomicGet(var,dstvar) do { \
+    dstvar = __sync_sub_and_fetch(&var,0); \
+} while(0)
+#define atomicSet(var,value) do { \
+    while(!__sync_bool_compare_and_swap(&var,var,value)); \
+} while(0)
+#define atomicGetWithSync(var,dstvar) atomicGet(var,dstvar)
+#define atomicSetWithSync(var,value) atomicSet(var,value)
+#define NI_ATOMIC_API "sync-builtin"
+
+#else
+/* Implementation using pthread mutex. */
+#define ni_atomic
+
 #define atomicIncr(var,count) do { \
     pthread_mutex_lock(&var ## _mutex); \
     var += (count); \
@@ -65,5 +154,30 @@
     var = value; \
     pthread_mutex_unlock(&var ## _mutex); \
 } while(0)
+#define atomicGetWithSync(var,dstvar) atomicGet(var,dstvar)
+#define atomicSetWithSync(var,value) atomicSet(var,value)
+#define NI_ATOMIC_API "pthread-mutex"
+
+#endif
+
+/* Counters written by different threads are much slower when they share a
+ * cache line, since every write steals the line from the other CPUs. Give
+ * such a variable or structure its own line with NI_CACHE_ALIGNED, and end
+ * the structures that are allocated in arrays with NI_CACHE_PAD so that the
+ * next field does not end up on the line of the hot ones, for instance:
+ *
+ *  typedef struct ring {
+ *      ni_atomic size_t head;      Written by the consumer.
+ *      NI_CACHE_PAD(pad1, sizeof(size_t));
+ *      ni_atomic size_t tail;      Written by the producer.
+ *  } NI_CACHE_ALIGNED ring;
+ *
+ * Allocate them with ni_malloc_aligned(sizeof(ring), NI_CACHE_LINE). */
+#ifndef NI_CACHE_LINE
+#define NI_CACHE_LINE 64
+#endif
+#define NI_CACHE_ALIGNED __attribute__ ((aligned(NI_CACHE_LINE)))
+#define NI_CACHE_PAD(name,used) \
+    char name[NI_CACHE_LINE - (used) % NI_CACHE_LINE]
 
 #endif /* _NI_ATOMIC_H_ */
@@ -0,0 +1,74 @@
+/* ni_defrag.c - Incremental active defragmentation
+ *
+ * Data structures defragment themselves moving their blocks that sit in
+ * sparsely used slabs into fresh allocations (see ni_malloc_defrag()) and
+ * fixing up the pointers to them, see ni_string_defrag() and
+ * ni_list_defrag(). The work is split in cycles: a cycle is given a time
+ * budget and data structures scan their blocks until it expires, so that a
+ * program can defragment a large data set a few milliseconds at a time,
+ * for instance spending a given percentage of the CPU from its timer.
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#include <time.h>
+#include "ni_defrag.h"
+#include "ni_malloc.h"
+
+static long long ni_defrag_ustime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Start a defrag cycle that can run for 'budget_us' microseconds. */
+void ni_defrag_begin(ni_defrag *d, long long budget_us) {
+    d->deadline = ni_defrag_ustime() + budget_us;
+    d->ticks = 0;
+    d->expired = 0;
+    d->scanned = 0;
+    d->moved = 0;
+}
+
+/* Start a defrag cycle using 'cpu_pct' percent of the CPU of a program
+ * that runs a cycle every 'period_ms' milliseconds. */
+void ni_defrag_begin_cpu(ni_defrag *d, int cpu_pct, int period_ms) {
+    ni_defrag_begin(d, (long long)period_ms * 1000 * cpu_pct / 100);
+}
+
+/* Count an object scanned by the cycle, returning 1 if its budget is over.
+ * The clock is read every NI_DEFRAG_CHECK_EVERY objects only, once the
+ * budget is over it stays over. */
+int ni_defrag_expired(ni_defrag *d) {
+    d->scanned++;
+    if (d->expired) return 1;
+    if (++d->ticks < NI_DEFRAG_CHECK_EVERY) return 0;
+    d->ticks = 0;
+    d->expired = ni_defrag_ustime() >= d->deadline;
+    return d->expired;
+}
+
+/* Move the block 'ptr' with ni_malloc_defrag(), counting it in the cycle
+ * 'd' if it was moved.
+ *
+ * Returns the new pointer, or NULL if 'ptr' was not moved. */
+void *ni_defrag_move(ni_defrag *d, void *ptr) {
+    void *newptr = ni_malloc_defrag(ptr);
+    if (newptr) d->moved++;
+    return newptr;
+}
+
+/* Return 1 if the slabs hold at least 'min_bytes' bytes more than the
+ * objects allocated from them, and their ratio exceeds 'min_ratio', so
+ * that a defrag cycle is worth its cost. */
+int ni_defrag_needed(float min_ratio, size_t min_bytes) {
+    ni_malloc_info info;
+
+    ni_malloc_get_info(&info);
+    if (info.slab_allocated == 0 ||
+        info.slab_active - info.slab_allocated < min_bytes)
+        return 0;
+    return (float)info.slab_active / info.slab_allocated > min_ratio;
+}
@@ -0,0 +1,36 @@
+/* ni_defrag.h - Incremental active defragmentation
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#ifndef _NI_DEFRAG_H_
+#define _NI_DEFRAG_H_
+
+#include <stddef.h>
+
+/* Objects scanned between two reads of the clock. */
+#define NI_DEFRAG_CHECK_EVERY   64
+
+/* State of a defrag cycle: the time it must end at, and what it did. */
+typedef struct ni_defrag {
+    long long   deadline;   /* Monotonic time in microseconds. */
+    int         ticks;      /* Objects scanned since the last clock read. */
+    int         expired;
+    size_t      scanned;
+    size_t      moved;
+} ni_defrag;
+
+/* Move a value of a data structure, returning its new pointer or NULL if it
+ * was not moved. */
+typedef void *(*ni_defrag_proc)(void *ptr);
+
+/* Prototypes */
+void ni_defrag_begin(ni_defrag *d, long long budget_us);
+void ni_defrag_begin_cpu(ni_defrag *d, int cpu_pct, int period_ms);
+int ni_defrag_expired(ni_defrag *d);
+void *ni_defrag_move(ni_defrag *d, void *ptr);
+int ni_defrag_needed(float min_ratio, size_t min_bytes);
+
+#endif /* _NI_DEFRAG_H_ */
@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ni_test.h"
+
+#define NI_DEFRAG_TEST_NODES    200000
+
+static void ni_defrag_test_free(void *ptr) {
+    ni_string_obj_free(ptr);
+}
+
+static void *ni_defrag_test_move(void *ptr) {
+    return ni_string_defrag(ptr);
+}
+
+int ni_defrag_test() {
+    ni_malloc_enable_slab(1);
+
+    {
+        void *libc = malloc(16);
+        void *ptr = ni_malloc(300);
+
+        test_cond("Only slab objects get a defrag hint",
+            ni_malloc_defrag_hint(libc) == 0 && ni_malloc_defrag_hint(ptr) == 0 &&
+            ni_malloc_defrag(ptr) == NULL)
+        free(libc);
+        ni_free(ptr);
+    }
+
+    {
+        ni_list *lst = ni_list_create();
+        ni_list_node *node, *next, *cursor = NULL;
+        ni_malloc_info before, after;
+        size_t used;
+        ni_defrag d;
+        int j, cycles = 0, done = 0, ok = 1;
+        char buf[32];
+
+        lstSetFreeMethod(lst, ni_defrag_test_free);
+        for (j = 0; j < NI_DEFRAG_TEST_NODES; j++) {
+            snprintf(buf, sizeof(buf), "value %d", j);
+            ni_list_add_node_tail(lst, ni_string_new(buf));
+        }
+        /* Keep one node every ten, leaving the slabs sparsely used. */
+        for (j = 0, node = lstFirst(lst); node != NULL; j++, node = next) {
+            next = lstNextNode(node);
+            if (j % 10) ni_list_del_node(lst, node);
+        }
+        ni_malloc_tcache_flush();
+        used = ni_malloc_used_memory();
+        ni_malloc_get_info(&before);
+        test_cond("Sparse slabs need a defrag",
+            ni_defrag_needed(2.0, 1024*1024) && !ni_defrag_needed(1000.0, 0))
+
+        ni_defrag_begin(&d, 0);
+        test_cond("A cycle stops when its budget expires",
+            ni_list_defrag(&lst, ni_defrag_test_move, &cursor, &d) == 0 &&
+            cursor != NULL && d.scanned == NI_DEFRAG_CHECK_EVERY)
+        while (!done) {
+            ni_defrag_begin(&d, 1000);
+            done = ni_list_defrag(&lst, ni_defrag_test_move, &cursor, &d);
+            cycles++;
+        }
+        ni_malloc_tcache_flush();
+        ni_malloc_get_info(&after);
+        for (j = 0, node = lstFirst(lst); node != NULL; j += 10, node = lstNextNode(node)) {
+            snprintf(buf, sizeof(buf), "value %d", j);
+            if (strcmp(lstNodeVal(node), buf) != 0) ok = 0;
+            if (lstNextNode(node) && lstPrevNode(lstNextNode(node)) != node) ok = 0;
+        }
+        test_cond("Defragmented lists keep their nodes and values",
+            ok && lstLen(lst) == NI_DEFRAG_TEST_NODES / 10 &&
+            j == NI_DEFRAG_TEST_NODES && lstPrevNode(lstFirst(lst)) == NULL)
+        test_cond("Defrag moves objects without changing the used memory",
+            cycles > 0 && ni_malloc_used_memory() == used)
+        test_cond("Defrag releases the sparse slabs",
+            after.slab_active < before.slab_active / 2)
+        ni_list_release(lst);
+    }
+    test_report()
+    return 0;
+}
@@ -0,0 +1,292 @@
+/* ni_epoch.c - Epoch based memory reclamation
+ *
+ * A lock-free structure can't free a node it unlinked while other threads
+ * may still be reading it. Readers wrap their accesses between
+ * ni_epoch_enter() and ni_epoch_exit(), and writers hand the nodes they
+ * unlinked to ni_epoch_retire() instead of freeing them.
+ *
+ * A global epoch counter only advances when every thread inside a read
+ * section has seen its current value. A node retired during epoch 'e' was
+ * unlinked before, so once the epoch reached e+2 every reader that could
+ * have found it left its read section, and the node can be freed. Threads
+ * keep the nodes they retire in a list, oldest first, and reclaim it every
+ * NI_EPOCH_BATCH nodes, so the cost of scanning the threads is paid once
+ * per batch. The nodes a thread leaves behind when it exits are reclaimed
+ * by the others.
+ *
+ * The memory held by the retired nodes is reported apart by
+ * ni_epoch_retired_memory(), and by the "epoch" source of
+ * ni_malloc_get_info(), until they are freed.
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ni_epoch.h"
+#include "ni_malloc.h"
+#include "ni_atomic.h"
+#include "ni_sync.h"
+
+typedef struct ni_epoch_retired {
+    struct ni_epoch_retired *next;
+    void                    *ptr;
+    ni_epoch_free_proc      proc;
+    size_t                  bytes;
+    unsigned long           epoch;  /* Global epoch when it was retired. */
+} ni_epoch_retired;
+
+/* Per thread state. 'epoch' and 'active' are read by the threads that try
+ * to advance the epoch, the rest only by the owner. Records are never
+ * freed, the ones of exited threads are reused. */
+typedef struct ni_epoch_thread {
+    unsigned long           epoch;  /* Global epoch seen entering. */
+    int                     active; /* Inside a read section. */
+    int                     nesting;
+    int                     in_use;
+    ni_epoch_retired        *head;  /* Retired nodes, oldest first. */
+    ni_epoch_retired        *tail;
+    size_t                  pending;
+    struct ni_epoch_thread  *next;
+} NI_CACHE_ALIGNED ni_epoch_thread;
+
+static unsigned long epoch_global = 0;
+static ni_epoch_thread *epoch_threads = NULL;
+static ni_epoch_retired *epoch_orphans = NULL;  /* Left by exited threads. */
+static pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t epoch_key;
+static pthread_once_t epoch_key_once = PTHREAD_ONCE_INIT;
+static __thread ni_epoch_thread *tls_epoch = NULL;
+
+static ni_atomic size_t epoch_retired_memory = 0;
+pthread_mutex_t epoch_retired_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ni_atomic size_t epoch_retired_objects = 0;
+pthread_mutex_t epoch_retired_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called when a thread exits: its retired nodes become orphans. */
+static void ni_epoch_thread_release(void *ptr) {
+    ni_epoch_thread *t = ptr;
+
+    pthread_mutex_lock(&epoch_lock);
+    if (t->tail) {
+        t->tail->next = epoch_orphans;
+        epoch_orphans = t->head;
+    }
+    t->head = t->tail = NULL;
+    t->pending = 0;
+    t->nesting = 0;
+    ni_sync_store(&t->active, 0);
+    t->in_use = 0;
+    pthread_mutex_unlock(&epoch_lock);
+    tls_epoch = NULL;
+}
+
+/* Run once by the first thread using the module. */
+static void ni_epoch_key_create(void) {
+    pthread_key_create(&epoch_key, ni_epoch_thread_release);
+    ni_malloc_register_info_source("epoch", ni_epoch_retired_memory,
+                                   ni_epoch_retired_objects);
+}
+
+/* Bind a record to the calling thread, reusing the one of an exited thread
+ * if possible. */
+static ni_epoch_thread *ni_epoch_thread_create(void) {
+    ni_epoch_thread *t;
+
+    pthread_once(&epoch_key_once, ni_epoch_key_create);
+    pthread_mutex_lock(&epoch_lock);
+    for (t = epoch_threads; t != NULL; t = t->next)
+        if (!t->in_use) break;
+    if (t == NULL) {
+        if ((t = ni_malloc_aligned(sizeof(*t), NI_CACHE_LINE)) == NULL) {
+            pthread_mutex_unlock(&epoch_lock);
+            fprintf(stderr, "ni_epoch: Out of memory creating the thread record.\n");
+            abort();
+        }
+        memset(t, 0, sizeof(*t));
+        t->next = epoch_threads;
+        epoch_threads = t;
+    }
+    t->in_use = 1;
+    pthread_mutex_unlock(&epoch_lock);
+    pthread_setspecific(epoch_key, t);
+    tls_epoch = t;
+    return t;
+}
+
+/* Enter a read section: the nodes retired from now on are not freed until
+ * the thread calls ni_epoch_exit(). Sections can be nested. */
+void ni_epoch_enter(void) {
+    ni_epoch_thread *t = tls_epoch;
+
+    if (t == NULL) t = ni_epoch_thread_create();
+    if (t->nesting++) return;
+    ni_sync_store_relaxed(&t->epoch, ni_sync_load(&epoch_global));
+    ni_sync_store_relaxed(&t->active, 1);
+    /* The section must be visible before the thread reads any node. */
+    ni_sync_fence();
+}
+
+void ni_epoch_exit(void) {
+    ni_epoch_thread *t = tls_epoch;
+
+    if (--t->nesting) return;
+    ni_sync_store(&t->active, 0);
+}
+
+/* Advance the global epoch if every thread in a read section saw it.
+ * Returns the global epoch. */
+static unsigned long ni_epoch_try_advance(void) {
+    unsigned long epoch;
+    ni_epoch_thread *t;
+
+    ni_sync_fence();
+    epoch = ni_sync_load(&epoch_global);
+    pthread_mutex_lock(&epoch_lock);
+    for (t = epoch_threads; t != NULL; t = t->next) {
+        if (ni_sync_load(&t->active) && ni_sync_load(&t->epoch) != epoch) {
+            pthread_mutex_unlock(&epoch_lock);
+            return epoch;
+        }
+    }
+    pthread_mutex_unlock(&epoch_lock);
+    if (ni_sync_cas(&epoch_global, epoch, epoch + 1)) return epoch + 1;
+    return ni_sync_load(&epoch_global);
+}
+
+/* Free the nodes of the list 'r' and return how many they were. */
+static size_t ni_epoch_free_list(ni_epoch_retired *r) {
+    ni_epoch_retired *next;
+    size_t freed = 0, bytes = 0;
+
+    for (; r != NULL; r = next) {
+        next = r->next;
+        if (r->proc)
+            r->proc(r->ptr);
+        else
+            ni_free(r->ptr);
+        bytes += r->bytes;
+        freed++;
+        ni_free(r);
+    }
+    atomicDecr(epoch_retired_memory, bytes);
+    atomicDecr(epoch_retired_objects, freed);
+    return freed;
+}
+
+/* Unlink from the list '*head' the nodes that are safe to free during the
+ * epoch 'epoch', returning them as a list. If 'ordered' is true the list is
+ * the oldest first one of a thread, so the scan stops at the first node
+ * that is not safe yet. */
+static ni_epoch_retired *ni_epoch_collect(ni_epoch_retired **head,
+                                          ni_epoch_retired **tail,
+                                          unsigned long epoch, int ordered) {
+    ni_epoch_retired *safe = NULL, **link = head, *r;
+
+    while ((r = *link) != NULL) {
+        if (r->epoch + 2 <= epoch) {
+            *link = r->next;
+            r->next = safe;
+            safe = r;
+        } else if (ordered) {
+            break;
+        } else {
+            link = &r->next;
+        }
+    }
+    if (tail && *head == NULL) *tail = NULL;
+    return safe;
+}
+
+/* Free the nodes retired by the calling thread, and the ones of exited
+ * threads, that no reader can hold anymore.
+ *
+ * Returns the number of nodes freed. */
+size_t ni_epoch_reclaim(void) {
+    ni_epoch_thread *t = tls_epoch;
+    ni_epoch_retired *safe;
+    unsigned long epoch = ni_epoch_try_advance();
+    size_t freed = 0;
+
+    if (t != NULL) {
+        safe = ni_epoch_collect(&t->head, &t->tail, epoch, 1);
+        freed = ni_epoch_free_list(safe);
+        t->pending -= freed;
+    }
+    pthread_mutex_lock(&epoch_lock);
+    safe = epoch_orphans ? ni_epoch_collect(&epoch_orphans, NULL, epoch, 0) : NULL;
+    pthread_mutex_unlock(&epoch_lock);
+    return freed + ni_epoch_free_list(safe);
+}
+
+/* Free 'ptr', a block allocated with ni_malloc, calling 'proc' (or ni_free()
+ * if NULL) once no thread in a read section can reach it anymore. The
+ * caller must have unlinked it from the shared structure already.
+ *
+ * If the node remembering 'ptr' can't be allocated the function waits for
+ * the readers and frees it right away, or aborts if called from a read
+ * section. */
+void ni_epoch_retire(void *ptr, ni_epoch_free_proc proc) {
+    ni_epoch_thread *t = tls_epoch;
+    ni_epoch_retired *r;
+
+    if (ptr == NULL) return;
+    if (t == NULL) t = ni_epoch_thread_create();
+    if ((r = ni_malloc(sizeof(*r))) == NULL) {
+        /* No room to remember it: wait for the readers and free it now.
+         * Inside a read section the wait would never end, so give up like
+         * when the thread record can't be allocated. */
+        if (t->nesting) {
+            fprintf(stderr, "ni_epoch: Out of memory retiring a block in a read section.\n");
+            abort();
+        }
+        ni_epoch_synchronize();
+        if (proc) proc(ptr); else ni_free(ptr);
+        return;
+    }
+    r->next = NULL;
+    r->ptr = ptr;
+    r->proc = proc;
+    r->bytes = ni_malloc_size(ptr);
+    ni_sync_fence();
+    r->epoch = ni_sync_load(&epoch_global);
+    if (t->tail)
+        t->tail->next = r;
+    else
+        t->head = r;
+    t->tail = r;
+    atomicIncr(epoch_retired_memory, r->bytes);
+    atomicIncr(epoch_retired_objects, 1);
+    /* While a slow reader holds the epoch the list only grows, so try again
+     * every batch rather than on every node. */
+    if (++t->pending % NI_EPOCH_BATCH == 0) ni_epoch_reclaim();
+}
+
+/* Wait until every thread that is in a read section now has left it, then
+ * free all the nodes retired so far by the calling thread and the exited
+ * ones. Must not be called from a read section, that would wait forever. */
+void ni_epoch_synchronize(void) {
+    unsigned long target = ni_sync_load(&epoch_global) + 2;
+    int backoff = 1;
+
+    while (ni_epoch_try_advance() < target) ni_spin_backoff(&backoff);
+    ni_epoch_reclaim();
+}
+
+/* Return the memory held by the nodes retired and not yet freed. */
+size_t ni_epoch_retired_memory(void) {
+    size_t bytes;
+    atomicGet(epoch_retired_memory, bytes);
+    return bytes;
+}
+
+/* Return the number of nodes retired and not yet freed. */
+size_t ni_epoch_retired_objects(void) {
+    size_t objects;
+    atomicGet(epoch_retired_objects, objects);
+    return objects;
+}
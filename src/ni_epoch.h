@@ -0,0 +1,28 @@
+/* ni_epoch.h - Epoch based memory reclamation
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#ifndef _NI_EPOCH_H_
+#define _NI_EPOCH_H_
+
+#include <stddef.h>
+
+/* Blocks a thread retires before it tries to reclaim them. */
+#define NI_EPOCH_BATCH  64
+
+/* Release a retired block, NULL meaning ni_free(). */
+typedef void (*ni_epoch_free_proc)(void *ptr);
+
+/* Prototypes */
+void ni_epoch_enter(void);
+void ni_epoch_exit(void);
+void ni_epoch_retire(void *ptr, ni_epoch_free_proc proc);
+size_t ni_epoch_reclaim(void);
+void ni_epoch_synchronize(void);
+size_t ni_epoch_retired_memory(void);
+size_t ni_epoch_retired_objects(void);
+
+#endif /* _NI_EPOCH_H_ */
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ni_test.h"
+
+#define NI_EPOCH_TEST_READERS   4
+#define NI_EPOCH_TEST_SWAPS     200000
+#define NI_EPOCH_TEST_LIVE      0x11223344
+#define NI_EPOCH_TEST_DEAD      0xdeadbeef
+
+/* A shared pointer the main thread keeps replacing while the readers check
+ * that the node they read was not freed under them. */
+typedef struct ni_epoch_test_node {
+    unsigned    magic;
+    long        value;
+} ni_epoch_test_node;
+
+static ni_epoch_test_node *test_shared = NULL;
+static volatile int test_running = 0;
+static volatile int test_inside = 0;
+static volatile int test_leave = 0;
+static int test_use_after_free = 0;
+static long test_freed = 0;
+
+static void ni_epoch_test_free(void *ptr) {
+    ni_epoch_test_node *node = ptr;
+    node->magic = NI_EPOCH_TEST_DEAD;
+    __sync_add_and_fetch(&test_freed, 1);
+    ni_free(node);
+}
+
+static void *ni_epoch_test_reader(void *arg) {
+    ni_epoch_test_node *node;
+    int j;
+    ((void) arg);
+
+    while (test_running) {
+        ni_epoch_enter();
+        node = ni_sync_load(&test_shared);
+        for (j = 0; j < 100; j++)
+            if (ni_sync_load_relaxed(&node->magic) != NI_EPOCH_TEST_LIVE)
+                test_use_after_free = 1;
+        ni_epoch_exit();
+    }
+    return NULL;
+}
+
+/* Stay in a read section until told to leave. */
+static void *ni_epoch_test_slow_reader(void *arg) {
+    ((void) arg);
+    ni_epoch_enter();
+    test_inside = 1;
+    while (!test_leave) sched_yield();
+    ni_epoch_exit();
+    return NULL;
+}
+
+static ni_epoch_test_node *ni_epoch_test_node_new(long value) {
+    ni_epoch_test_node *node = ni_malloc(sizeof(*node));
+    node->magic = NI_EPOCH_TEST_LIVE;
+    node->value = value;
+    return node;
+}
+
+/* Create the records of the threads of the test up front, so that they
+ * don't count in the used memory figures the test compares. */
+static long test_warm = 0;
+
+static void *ni_epoch_test_warmup(void *arg) {
+    ((void) arg);
+    ni_epoch_enter();
+    __sync_add_and_fetch(&test_warm, 1);
+    while (ni_sync_load(&test_warm) < NI_EPOCH_TEST_READERS + 1) sched_yield();
+    ni_epoch_exit();
+    return NULL;
+}
+
+int ni_epoch_test() {
+    {
+        pthread_t tids[NI_EPOCH_TEST_READERS];
+        int j;
+
+        for (j = 0; j < NI_EPOCH_TEST_READERS; j++)
+            pthread_create(&tids[j], NULL, ni_epoch_test_warmup, NULL);
+        ni_epoch_test_warmup(NULL);
+        for (j = 0; j < NI_EPOCH_TEST_READERS; j++)
+            pthread_join(tids[j], NULL);
+    }
+
+    {
+        size_t used = ni_malloc_used_memory();
+        ni_malloc_info info;
+        pthread_t tid;
+        void *ptr;
+
+        pthread_create(&tid, NULL, ni_epoch_test_slow_reader, NULL);
+        while (!test_inside) sched_yield();
+        ptr = ni_malloc(1000);
+        ni_epoch_retire(ptr, NULL);
+        ni_epoch_reclaim();
+        ni_epoch_reclaim();
+        ni_malloc_get_info(&info);
+        test_cond("Retired blocks wait for the readers",
+            ni_epoch_retired_objects() == 1 &&
+            ni_epoch_retired_memory() == ni_malloc_size(ptr) &&
+            ni_malloc_info_source_bytes(&info, "epoch") == ni_epoch_retired_memory())
+        test_leave = 1;
+        pthread_join(tid, NULL);
+        ni_epoch_synchronize();
+        test_cond("Retired blocks are freed once the readers leave",
+            ni_epoch_retired_objects() == 0 && ni_epoch_retired_memory() == 0 &&
+            ni_malloc_used_memory() == used)
+    }
+
+    {
+        pthread_t tids[NI_EPOCH_TEST_READERS];
+        size_t used = ni_malloc_used_memory();
+        ni_epoch_test_node *old;
+        long j;
+
+        test_shared = ni_epoch_test_node_new(0);
+        test_running = 1;
+        for (j = 0; j < NI_EPOCH_TEST_READERS; j++)
+            pthread_create(&tids[j], NULL, ni_epoch_test_reader, NULL);
+        for (j = 1; j <= NI_EPOCH_TEST_SWAPS; j++) {
+            old = test_shared;
+            ni_sync_store(&test_shared, ni_epoch_test_node_new(j));
+            ni_epoch_retire(old, ni_epoch_test_free);
+        }
+        test_running = 0;
+        for (j = 0; j < NI_EPOCH_TEST_READERS; j++)
+            pthread_join(tids[j], NULL);
+        test_cond("Readers never see a freed node", test_use_after_free == 0)
+        test_cond("Retired nodes are reclaimed in batches",
+            test_freed > NI_EPOCH_TEST_SWAPS / 2)
+        ni_epoch_retire(test_shared, ni_epoch_test_free);
+        ni_epoch_synchronize();
+        test_cond("Synchronize frees all the retired nodes",
+            test_freed == NI_EPOCH_TEST_SWAPS + 1 &&
+            ni_epoch_retired_objects() == 0 && ni_malloc_used_memory() == used)
+    }
+    test_report()
+    return 0;
+}
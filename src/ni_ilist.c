@@ -0,0 +1,192 @@
+/* ni_ilist.c - An intrusive doubly linked list
+ *
+ * The same operations of ni_list on nodes embedded in the elements, see
+ * ni_ilist.h. No function of this file allocates or frees memory.
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include "ni_ilist.h"
+
+/* Initialize 'lst' as an empty list. */
+void ni_ilist_init(ni_ilist *lst) {
+    lst->head = lst->tail = NULL;
+    lst->len = 0;
+}
+
+/* Remove all the elements from the list, calling 'proc' on each of them if
+ * not NULL, for instance to free them. 'proc' is called once the node is
+ * unlinked, so it can release the element. */
+void ni_ilist_empty(ni_ilist *lst, ni_ilist_proc proc) {
+    ni_ilist_node *current, *next;
+
+    current = lst->head;
+    while (current) {
+        next = current->next;
+        current->prev = current->next = NULL;
+        if (proc) proc(current);
+        current = next;
+    }
+    lst->head = lst->tail = NULL;
+    lst->len = 0;
+}
+
+/* Add 'node', that must not be in a list already, to the head of 'lst'. */
+void ni_ilist_add_node_head(ni_ilist *lst, ni_ilist_node *node) {
+    if (lst->len == 0) {
+        lst->head = lst->tail = node;
+        node->prev = node->next = NULL;
+    } else {
+        node->prev = NULL;
+        node->next = lst->head;
+        lst->head->prev = node;
+        lst->head = node;
+    }
+    lst->len++;
+}
+
+/* Add 'node', that must not be in a list already, to the tail of 'lst'. */
+void ni_ilist_add_node_tail(ni_ilist *lst, ni_ilist_node *node) {
+    if (lst->len == 0) {
+        lst->head = lst->tail = node;
+        node->prev = node->next = NULL;
+    } else {
+        node->prev = lst->tail;
+        node->next = NULL;
+        lst->tail->next = node;
+        lst->tail = node;
+    }
+    lst->len++;
+}
+
+/* Insert 'node' after 'old_nd' if 'after' is true, before it otherwise. */
+void ni_ilist_insert_node(ni_ilist *lst, ni_ilist_node *old_nd, ni_ilist_node *node, int after) {
+    if (after) {
+        node->prev = old_nd;
+        node->next = old_nd->next;
+        if (lst->tail == old_nd)
+            lst->tail = node;
+    } else {
+        node->next = old_nd;
+        node->prev = old_nd->prev;
+        if (lst->head == old_nd)
+            lst->head = node;
+    }
+    if (node->prev != NULL) {
+        node->prev->next = node;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node;
+    }
+    lst->len++;
+}
+
+/* Unlink 'nd' from the list. The element is left alone, it is up to the
+ * caller to release it if needed. */
+void ni_ilist_del_node(ni_ilist *lst, ni_ilist_node *nd) {
+    if (nd->prev)
+        nd->prev->next = nd->next;
+    else
+        lst->head = nd->next;
+    if (nd->next)
+        nd->next->prev = nd->prev;
+    else
+        lst->tail = nd->prev;
+    nd->prev = nd->next = NULL;
+    lst->len--;
+}
+
+/* Iterators live in the caller, usually on the stack. */
+void ni_ilist_rewind(ni_ilist *lst, ni_ilist_iter *iter) {
+    iter->next = lst->head;
+    iter->direction = IL_START_HEAD;
+}
+
+void ni_ilist_rewind_tail(ni_ilist *lst, ni_ilist_iter *iter) {
+    iter->next = lst->tail;
+    iter->direction = IL_START_TAIL;
+}
+
+/* Return the next node of an iterator, or NULL if there are no more nodes.
+ * It's valid to remove the currently returned node using
+ * ni_ilist_del_node(), but not to remove other nodes:
+ *
+ * ni_ilist_rewind(lst, &iter);
+ * while ((node = ni_ilist_next(&iter)) != NULL) {
+ *     doSomethingWith(ilstEntry(node, type, member));
+ * }
+ */
+ni_ilist_node *ni_ilist_next(ni_ilist_iter *iter) {
+    ni_ilist_node *current = iter->next;
+    if (current != NULL) {
+        if (iter->direction == IL_START_HEAD)
+            iter->next = current->next;
+        else
+            iter->next = current->prev;
+    }
+    return current;
+}
+
+/* Return the first node, starting from the head, whose element 'match'
+ * says matches 'key', or NULL if there is none. */
+ni_ilist_node *ni_ilist_search_key(ni_ilist *lst, ni_ilist_match_proc match, void *key) {
+    ni_ilist_node *node;
+
+    for (node = lst->head; node != NULL; node = node->next)
+        if (match(node, key))
+            return node;
+    return NULL;
+}
+
+/* Return the node at the zero-based index 'idx', negative integers counting
+ * from the tail like ni_list_index(). If the index is out of range NULL is
+ * returned. */
+ni_ilist_node *ni_ilist_index(ni_ilist *lst, long idx) {
+    ni_ilist_node *nd;
+    if (idx < 0) {
+        idx = (-idx)-1;
+        nd = lst->tail;
+        while(idx-- && nd)
+            nd = nd->prev;
+    } else {
+        nd = lst->head;
+        while(idx-- && nd)
+            nd = nd->next;
+    }
+    return nd;
+}
+
+/* Rotate the list removing the tail node and inserting it to the head. */
+void ni_ilist_rotate(ni_ilist *lst) {
+    ni_ilist_node *tail = lst->tail;
+    if (ilstLen(lst) <= 1)
+        return;
+    /* Detach current tail */
+    lst->tail = tail->prev;
+    lst->tail->next = NULL;
+    /* Move it as head */
+    lst->head->prev = tail;
+    tail->prev = NULL;
+    tail->next = lst->head;
+    lst->head = tail;
+}
+
+/* Add all the elements of the list 'o' at the end of the list 'l'. The
+ * list 'o' remains empty but otherwise valid. */
+void ni_ilist_join(ni_ilist *l, ni_ilist *o) {
+    if (o->head)
+        o->head->prev = l->tail;
+    if (l->tail)
+        l->tail->next = o->head;
+    else
+        l->head = o->head;
+    if (o->tail)
+        l->tail = o->tail;
+    l->len += o->len;
+    /* Setup other as an empty list. */
+    o->head = o->tail = NULL;
+    o->len = 0;
+}
@@ -0,0 +1,82 @@
+/* ni_ilist.h - An intrusive doubly linked list
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#ifndef _NI_ILIST_H_
+#define _NI_ILIST_H_
+
+#include <stddef.h>
+
+/* Unlike ni_list, the links live inside the elements: a structure embeds a
+ * ni_ilist_node and the list links these nodes, so adding an element needs
+ * no allocation and reaching it from its node needs no pointer chase:
+ *
+ *  typedef struct person {
+ *      int             age;
+ *      ni_ilist_node   link;
+ *  } person;
+ *
+ *  ni_ilist_add_node_tail(&lst, &p->link);
+ *  p = ilstEntry(ilstFirst(&lst), person, link);
+ *
+ * The list never allocates nor frees anything: the elements belong to the
+ * caller, and an element can be in as many lists as the nodes it embeds. */
+typedef struct ni_ilist_node {
+    struct ni_ilist_node    *prev;
+    struct ni_ilist_node    *next;
+} ni_ilist_node;
+
+typedef struct ni_ilist_iter {
+    ni_ilist_node   *next;
+    int             direction;
+} ni_ilist_iter;
+
+typedef struct ni_ilist {
+    ni_ilist_node   *head;
+    ni_ilist_node   *tail;
+    unsigned long   len;
+} ni_ilist;
+
+#define NI_ILIST_INIT { NULL, NULL, 0 }
+
+/* Return the structure of type 'type' embedding 'ptr' as its 'member'. */
+#define ni_container_of(ptr, type, member) \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
+
+/* Functions implemented as macros */
+#define ilstLen(l)                  ((l)->len)
+#define ilstFirst(l)                ((l)->head)
+#define ilstLast(l)                 ((l)->tail)
+#define ilstPrevNode(n)             ((n)->prev)
+#define ilstNextNode(n)             ((n)->next)
+#define ilstEntry(n, type, member)  ni_container_of(n, type, member)
+
+/* Called on every element by ni_ilist_empty(). */
+typedef void (*ni_ilist_proc)(ni_ilist_node *node);
+
+/* Returns non zero if the element of 'node' matches 'key'. */
+typedef int (*ni_ilist_match_proc)(ni_ilist_node *node, void *key);
+
+/* Prototypes */
+void ni_ilist_init(ni_ilist *lst);
+void ni_ilist_empty(ni_ilist *lst, ni_ilist_proc proc);
+void ni_ilist_add_node_head(ni_ilist *lst, ni_ilist_node *node);
+void ni_ilist_add_node_tail(ni_ilist *lst, ni_ilist_node *node);
+void ni_ilist_insert_node(ni_ilist *lst, ni_ilist_node *old_nd, ni_ilist_node *node, int after);
+void ni_ilist_del_node(ni_ilist *lst, ni_ilist_node *nd);
+void ni_ilist_rewind(ni_ilist *lst, ni_ilist_iter *iter);
+void ni_ilist_rewind_tail(ni_ilist *lst, ni_ilist_iter *iter);
+ni_ilist_node *ni_ilist_next(ni_ilist_iter *iter);
+ni_ilist_node *ni_ilist_search_key(ni_ilist *lst, ni_ilist_match_proc match, void *key);
+ni_ilist_node *ni_ilist_index(ni_ilist *lst, long idx);
+void ni_ilist_rotate(ni_ilist *lst);
+void ni_ilist_join(ni_ilist *l, ni_ilist *o);
+
+/* Directions for iterators, the same of ni_list */
+#define IL_START_HEAD 0
+#define IL_START_TAIL 1
+
+#endif /* _NI_ILIST_H_ */
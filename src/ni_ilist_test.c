@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "ni_test.h"
+
+#define NI_ILIST_TEST_PERSONS   1000000
+
+typedef struct ni_iperson {
+    int             ni_age;
+    char            ni_name[30];
+    ni_ilist_node   ni_link;
+} ni_iperson;
+
+static long long ni_ilist_test_ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static int ni_ilist_test_age(ni_ilist *lst, long idx) {
+    return ilstEntry(ni_ilist_index(lst, idx), ni_iperson, ni_link)->ni_age;
+}
+
+static int ni_ilist_test_match(ni_ilist_node *node, void *key) {
+    return ilstEntry(node, ni_iperson, ni_link)->ni_age == *(int*)key;
+}
+
+static int ni_ilist_test_emptied = 0;
+
+static void ni_ilist_test_empty(ni_ilist_node *node) {
+    if (node->prev == NULL && node->next == NULL) ni_ilist_test_emptied++;
+}
+
+int ni_ilist_test() {
+    {
+        ni_iperson persons[8];
+        ni_ilist lst = NI_ILIST_INIT, other;
+        ni_ilist_iter iter;
+        ni_ilist_node *node;
+        ni_malloc_scope_stats stats;
+        int j, key = 5, ordered = 1, backwards[] = {7, 6, 5, 1, 0, 2};
+
+        for (j = 0; j < 8; j++) persons[j].ni_age = j;
+        ni_ilist_test_emptied = 0;
+        ni_malloc_scope_begin();
+        ni_ilist_add_node_tail(&lst, &persons[1].ni_link);
+        ni_ilist_add_node_tail(&lst, &persons[3].ni_link);
+        ni_ilist_add_node_head(&lst, &persons[0].ni_link);
+        ni_ilist_insert_node(&lst, &persons[1].ni_link, &persons[2].ni_link, 1);
+        ni_ilist_insert_node(&lst, &persons[0].ni_link, &persons[4].ni_link, 0);
+        test_cond("Add and insert elements", ilstLen(&lst) == 5 &&
+            ni_ilist_test_age(&lst, 0) == 4 && ni_ilist_test_age(&lst, 1) == 0 &&
+            ni_ilist_test_age(&lst, 3) == 2 && ni_ilist_test_age(&lst, -1) == 3)
+
+        ni_ilist_del_node(&lst, &persons[4].ni_link);
+        ni_ilist_del_node(&lst, &persons[3].ni_link);
+        test_cond("Delete the head and the tail", ilstLen(&lst) == 3 &&
+            ilstEntry(ilstFirst(&lst), ni_iperson, ni_link) == &persons[0] &&
+            ilstEntry(ilstLast(&lst), ni_iperson, ni_link) == &persons[2] &&
+            ilstPrevNode(ilstFirst(&lst)) == NULL && ilstNextNode(ilstLast(&lst)) == NULL)
+
+        ni_ilist_rotate(&lst);
+        test_cond("Rotate moves the tail to the head",
+            ni_ilist_test_age(&lst, 0) == 2 && ni_ilist_test_age(&lst, -1) == 1)
+
+        ni_ilist_init(&other);
+        for (j = 5; j < 8; j++) ni_ilist_add_node_tail(&other, &persons[j].ni_link);
+        ni_ilist_join(&lst, &other);
+        test_cond("Join appends the other list and empties it",
+            ilstLen(&lst) == 6 && ilstLen(&other) == 0 && ilstFirst(&other) == NULL &&
+            ni_ilist_test_age(&lst, 3) == 5 && ni_ilist_test_age(&lst, -1) == 7)
+        test_cond("Search by key",
+            ni_ilist_search_key(&lst, ni_ilist_test_match, &key) == &persons[5].ni_link)
+
+        ni_ilist_rewind_tail(&lst, &iter);
+        for (j = 0; (node = ni_ilist_next(&iter)) != NULL; j++) {
+            if (ilstEntry(node, ni_iperson, ni_link)->ni_age != backwards[j])
+                ordered = 0;
+            if (j % 2 == 0) ni_ilist_del_node(&lst, node);
+        }
+        test_cond("Iterate backwards deleting the returned nodes",
+            ordered && ilstLen(&lst) == 3 && ni_ilist_test_age(&lst, 0) == 2 &&
+            ni_ilist_test_age(&lst, 1) == 1 && ni_ilist_test_age(&lst, 2) == 6)
+        ni_ilist_empty(&lst, ni_ilist_test_empty);
+        ni_malloc_scope_end(&stats);
+        test_cond("Empty calls the proc on unlinked nodes",
+            ni_ilist_test_emptied == 3 && ilstLen(&lst) == 0 && ilstFirst(&lst) == NULL)
+        test_cond("No operation allocates", stats.allocs == 0 && stats.frees == 0)
+    }
+
+    /* Build and walk a list of persons with ni_list, that allocates a node
+     * per person, then with ni_ilist, that links the persons themselves. */
+    {
+        ni_iperson *persons = ni_malloc(sizeof(*persons) * NI_ILIST_TEST_PERSONS);
+        ni_list *lst = ni_list_create();
+        ni_ilist ilst = NI_ILIST_INIT;
+        ni_list_iter iter;
+        ni_ilist_iter iiter;
+        ni_list_node *node;
+        ni_ilist_node *inode;
+        long long start, elapsed, ielapsed;
+        long sum = 0, isum = 0;
+        int j;
+
+        for (j = 0; j < NI_ILIST_TEST_PERSONS; j++) {
+            persons[j].ni_age = j % 100;
+            strcpy(persons[j].ni_name, "Richard Wang");
+        }
+        start = ni_ilist_test_ustime();
+        for (j = 0; j < NI_ILIST_TEST_PERSONS; j++)
+            ni_list_add_node_tail(lst, &persons[j]);
+        ni_list_rewind(lst, &iter);
+        while ((node = ni_list_next(&iter)) != NULL)
+            sum += ((ni_iperson*)lstNodeVal(node))->ni_age;
+        elapsed = ni_ilist_test_ustime() - start;
+
+        start = ni_ilist_test_ustime();
+        for (j = 0; j < NI_ILIST_TEST_PERSONS; j++)
+            ni_ilist_add_node_tail(&ilst, &persons[j].ni_link);
+        ni_ilist_rewind(&ilst, &iiter);
+        while ((inode = ni_ilist_next(&iiter)) != NULL)
+            isum += ilstEntry(inode, ni_iperson, ni_link)->ni_age;
+        ielapsed = ni_ilist_test_ustime() - start;
+
+        printf("%d persons, build and walk: ni_list %lld us, ni_ilist %lld us\n",
+            NI_ILIST_TEST_PERSONS, elapsed, ielapsed);
+        test_cond("Intrusive and regular lists hold the same persons",
+            sum == isum && ilstLen(&ilst) == lstLen(lst))
+        ni_list_release(lst);
+        ni_free(persons);
+    }
+    test_report()
+    return 0;
+}
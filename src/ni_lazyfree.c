@@ -0,0 +1,198 @@
+/* ni_lazyfree.c - Background release of large objects
+ *
+ * Releasing a list of millions of nodes walks and frees every node, which
+ * stalls the caller for seconds. The functions of this file estimate the
+ * effort of releasing an object and, when it is large, hand the object to
+ * a background thread that releases it, so the caller returns right away.
+ * Small objects are released inline, since queueing them would cost more
+ * than freeing them.
+ *
+ * The thread is started by the first object queued. The memory held by the
+ * queued objects is reported by ni_lazyfree_pending_memory(), and by the
+ * "lazyfree" source of ni_malloc_get_info(), until they are released.
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include "ni_lazyfree.h"
+#include "ni_malloc.h"
+#include "ni_atomic.h"
+
+typedef struct ni_lazyfree_job {
+    struct ni_lazyfree_job  *next;
+    ni_lazyfree_proc        proc;
+    void                    *obj;
+    size_t                  bytes;
+} ni_lazyfree_job;
+
+static ni_atomic size_t lazyfree_pending_memory = 0;
+pthread_mutex_t lazyfree_pending_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ni_atomic size_t lazyfree_pending_objects = 0;
+pthread_mutex_t lazyfree_pending_objects_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Jobs are queued at the tail and released from the head. 'busy' is set
+ * while the thread releases a job it already removed from the queue. */
+static pthread_mutex_t lazyfree_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lazyfree_newjob = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t lazyfree_done = PTHREAD_COND_INITIALIZER;
+static ni_lazyfree_job *lazyfree_head = NULL;
+static ni_lazyfree_job *lazyfree_tail = NULL;
+static pthread_t lazyfree_thread;
+static int lazyfree_running = 0;
+static int lazyfree_busy = 0;
+static pthread_once_t lazyfree_info_once = PTHREAD_ONCE_INIT;
+
+static void ni_lazyfree_register_info(void) {
+    ni_malloc_register_info_source("lazyfree", ni_lazyfree_pending_memory,
+                                   ni_lazyfree_pending_objects);
+}
+
+static void *ni_lazyfree_main(void *arg) {
+    ni_lazyfree_job *job;
+    ((void) arg);
+
+    pthread_mutex_lock(&lazyfree_lock);
+    while (1) {
+        while (lazyfree_running && lazyfree_head == NULL)
+            pthread_cond_wait(&lazyfree_newjob, &lazyfree_lock);
+        if ((job = lazyfree_head) == NULL) break;
+        if ((lazyfree_head = job->next) == NULL) lazyfree_tail = NULL;
+        lazyfree_busy = 1;
+        pthread_mutex_unlock(&lazyfree_lock);
+
+        job->proc(job->obj);
+        atomicDecr(lazyfree_pending_memory, job->bytes);
+        atomicDecr(lazyfree_pending_objects, 1);
+        ni_free(job);
+
+        pthread_mutex_lock(&lazyfree_lock);
+        lazyfree_busy = 0;
+        if (lazyfree_head == NULL) pthread_cond_broadcast(&lazyfree_done);
+    }
+    pthread_mutex_unlock(&lazyfree_lock);
+    return NULL;
+}
+
+/* Release 'obj' calling 'proc' from the background thread. 'bytes' is the
+ * memory the object holds, or an estimate, reported as pending until the
+ * object is released. If the job can't be queued the object is released
+ * inline, so this function can't fail. */
+void ni_lazyfree_submit(ni_lazyfree_proc proc, void *obj, size_t bytes) {
+    ni_lazyfree_job *job;
+
+    pthread_once(&lazyfree_info_once, ni_lazyfree_register_info);
+    if ((job = ni_malloc(sizeof(*job))) == NULL) {
+        proc(obj);
+        return;
+    }
+    job->next = NULL;
+    job->proc = proc;
+    job->obj = obj;
+    job->bytes = bytes;
+
+    pthread_mutex_lock(&lazyfree_lock);
+    if (!lazyfree_running) {
+        lazyfree_running = 1;
+        if (pthread_create(&lazyfree_thread, NULL, ni_lazyfree_main, NULL)) {
+            lazyfree_running = 0;
+            pthread_mutex_unlock(&lazyfree_lock);
+            fprintf(stderr, "ni_lazyfree: Can't create the thread, releasing inline.\n");
+            ni_free(job);
+            proc(obj);
+            return;
+        }
+    }
+    atomicIncr(lazyfree_pending_memory, bytes);
+    atomicIncr(lazyfree_pending_objects, 1);
+    if (lazyfree_tail)
+        lazyfree_tail->next = job;
+    else
+        lazyfree_head = job;
+    lazyfree_tail = job;
+    pthread_cond_signal(&lazyfree_newjob);
+    pthread_mutex_unlock(&lazyfree_lock);
+}
+
+static void ni_lazyfree_list_proc(void *obj) {
+    ni_list_release(obj);
+}
+
+/* Release the list 'lst', in background if it has more than
+ * NI_LAZYFREE_THRESHOLD nodes. Lists allocated from an arena only give
+ * their memory back with the arena, so they are always released inline.
+ * The pending memory is estimated from the nodes, the values freed by the
+ * free method of the list are not known.
+ *
+ * Returns 1 if the list was queued, 0 if it was released inline. */
+int ni_lazyfree_list(ni_list *lst) {
+    if (lst->arena || lstLen(lst) <= NI_LAZYFREE_THRESHOLD) {
+        ni_list_release(lst);
+        return 0;
+    }
+    ni_lazyfree_submit(ni_lazyfree_list_proc, lst,
+        sizeof(*lst) + lstLen(lst) * sizeof(ni_list_node));
+    return 1;
+}
+
+static void ni_lazyfree_string_proc(void *obj) {
+    ni_string_obj_free(obj);
+}
+
+/* Release the ni_string 's', in background if its allocation is at least
+ * NI_LAZYFREE_STRING_THRESHOLD bytes. No operation is performed if 's' is
+ * NULL or if it was allocated from an arena.
+ *
+ * Returns 1 if the string was queued, 0 otherwise. */
+int ni_lazyfree_string(ni_string s) {
+    size_t size;
+
+    if (s == NULL || ni_string_is_arena(s)) return 0;
+    size = ni_string_alloc_size(s);
+    if (size < NI_LAZYFREE_STRING_THRESHOLD) {
+        ni_string_obj_free(s);
+        return 0;
+    }
+    ni_lazyfree_submit(ni_lazyfree_string_proc, s, size);
+    return 1;
+}
+
+/* Return the memory held by the objects waiting to be released. */
+size_t ni_lazyfree_pending_memory(void) {
+    size_t bytes;
+    atomicGet(lazyfree_pending_memory, bytes);
+    return bytes;
+}
+
+/* Return the number of objects waiting to be released. */
+size_t ni_lazyfree_pending_objects(void) {
+    size_t objects;
+    atomicGet(lazyfree_pending_objects, objects);
+    return objects;
+}
+
+/* Block until all the objects queued so far are released. */
+void ni_lazyfree_wait(void) {
+    pthread_mutex_lock(&lazyfree_lock);
+    while (lazyfree_head != NULL || lazyfree_busy)
+        pthread_cond_wait(&lazyfree_done, &lazyfree_lock);
+    pthread_mutex_unlock(&lazyfree_lock);
+}
+
+/* Release the objects still queued and stop the background thread. It is
+ * started again by the next object queued, so no object must be queued
+ * while this function runs. */
+void ni_lazyfree_stop(void) {
+    pthread_mutex_lock(&lazyfree_lock);
+    if (!lazyfree_running) {
+        pthread_mutex_unlock(&lazyfree_lock);
+        return;
+    }
+    lazyfree_running = 0;
+    pthread_cond_signal(&lazyfree_newjob);
+    pthread_mutex_unlock(&lazyfree_lock);
+    pthread_join(lazyfree_thread, NULL);
+}
@@ -0,0 +1,33 @@
+/* ni_lazyfree.h - Background release of large objects
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#ifndef _NI_LAZYFREE_H_
+#define _NI_LAZYFREE_H_
+
+#include <stddef.h>
+#include "ni_list.h"
+#include "ni_string.h"
+
+/* Objects whose release costs more than NI_LAZYFREE_THRESHOLD allocations
+ * are released by the background thread, the others inline. Strings are a
+ * single allocation, but releasing a large one returns all its pages to
+ * the system, so they are released in background from this size on. */
+#define NI_LAZYFREE_THRESHOLD           64
+#define NI_LAZYFREE_STRING_THRESHOLD    (1024*1024)
+
+typedef void (*ni_lazyfree_proc)(void *obj);
+
+/* Prototypes */
+void ni_lazyfree_submit(ni_lazyfree_proc proc, void *obj, size_t bytes);
+int ni_lazyfree_list(ni_list *lst);
+int ni_lazyfree_string(ni_string s);
+size_t ni_lazyfree_pending_memory(void);
+size_t ni_lazyfree_pending_objects(void);
+void ni_lazyfree_wait(void);
+void ni_lazyfree_stop(void);
+
+#endif /* _NI_LAZYFREE_H_ */
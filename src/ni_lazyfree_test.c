@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ni_test.h"
+
+int ni_lazyfree_test() {
+    {
+        size_t used = ni_malloc_used_memory();
+        ni_list *lst = ni_list_create();
+        long j;
+
+        for (j = 0; j < NI_LAZYFREE_THRESHOLD; j++)
+            ni_list_add_node_tail(lst, (void*)j);
+        test_cond("Small lists are released inline",
+            ni_lazyfree_list(lst) == 0 && ni_lazyfree_pending_objects() == 0 &&
+            ni_malloc_used_memory() == used)
+
+        lst = ni_list_create();
+        lstSetFreeMethod(lst, ni_free);
+        for (j = 0; j < 100000; j++)
+            ni_list_add_node_tail(lst, ni_malloc(16));
+        test_cond("Large lists are queued", ni_lazyfree_list(lst) == 1)
+        ni_lazyfree_wait();
+        test_cond("Queued lists are released",
+            ni_lazyfree_pending_objects() == 0 &&
+            ni_lazyfree_pending_memory() == 0 &&
+            ni_malloc_used_memory() == used)
+    }
+
+    {
+        size_t used = ni_malloc_used_memory();
+        ni_string s = ni_string_new("small");
+        ni_string big = ni_string_new_len(NULL, NI_LAZYFREE_STRING_THRESHOLD);
+
+        test_cond("Small strings are released inline", ni_lazyfree_string(s) == 0)
+        test_cond("Large strings are queued", ni_lazyfree_string(big) == 1)
+        ni_lazyfree_wait();
+        test_cond("Queued strings are released",
+            ni_lazyfree_pending_memory() == 0 && ni_malloc_used_memory() == used)
+    }
+
+    {
+        ni_arena *a = ni_arena_create(1024);
+        ni_string big = ni_string_new_len_arena(a, NULL, NI_LAZYFREE_STRING_THRESHOLD);
+
+        test_cond("Arena strings are left to their arena",
+            ni_lazyfree_string(big) == 0 && ni_lazyfree_pending_objects() == 0)
+        ni_arena_destroy(a);
+    }
+
+    {
+        ni_malloc_info info;
+        ni_list *lst = ni_list_create();
+        long j;
+
+        /* Keep the thread busy releasing a large list, so that the next
+         * one is still pending. */
+        for (j = 0; j < 1000000; j++)
+            ni_list_add_node_tail(lst, (void*)j);
+        ni_lazyfree_list(lst);
+        lst = ni_list_create();
+        for (j = 0; j < 1000; j++)
+            ni_list_add_node_tail(lst, (void*)j);
+        ni_lazyfree_list(lst);
+        ni_malloc_get_info(&info);
+        test_cond("Pending memory is part of the allocator info",
+            ni_malloc_info_source_bytes(&info, "lazyfree") >=
+            sizeof(ni_list) + 1000 * sizeof(ni_list_node))
+        ni_lazyfree_stop();
+        test_cond("Stopping releases the queued objects",
+            ni_lazyfree_pending_objects() == 0 && ni_lazyfree_pending_memory() == 0)
+    }
+    test_report()
+    return 0;
+}
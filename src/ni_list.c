@@ -16,29 +16,73 @@
  * On error, NULL is returned. Otherwise the pointer to the new list. */
 ni_list *ni_list_create(void) {
     struct ni_list *lst;
-    if ((lst = ni_malloc(sizeof(*lst))) == NULL)
+    if ((lst = ni_malloc_sized_tagged(sizeof(*lst), NI_MEM_LIST)) == NULL)
         return NULL;
     lst->head = lst->tail = NULL;
     lst->len = 0;
     lst->dup = NULL;
     lst->free = NULL;
     lst->match = NULL;
+    lst->arena = NULL;
     return lst;
 }
 
+/* Create a new list whose header and nodes are allocated from the arena 'a'.
+ * Nodes are never freed one by one: deleting nodes or releasing the list
+ * only calls the free method on the values, the memory itself is returned
+ * by the next ni_arena_reset() of 'a', after which the list must not be
+ * used anymore.
+ *
+ * On error, NULL is returned. Otherwise the pointer to the new list. */
+ni_list *ni_list_create_arena(ni_arena *a) {
+    struct ni_list *lst;
+    if ((lst = ni_arena_alloc(a, sizeof(*lst))) == NULL)
+        return NULL;
+    lst->head = lst->tail = NULL;
+    lst->len = 0;
+    lst->dup = NULL;
+    lst->free = NULL;
+    lst->match = NULL;
+    lst->arena = a;
+    return lst;
+}
+
+static inline ni_list_node *ni_list_node_alloc(ni_list *lst) {
+    if (lst->arena)
+        return ni_arena_alloc(lst->arena, sizeof(ni_list_node));
+    return ni_malloc_sized_tagged(sizeof(ni_list_node), NI_MEM_LIST);
+}
+
+static inline void ni_list_node_free(ni_list *lst, ni_list_node *node) {
+    if (!lst->arena)
+        ni_free_sized_tagged(node, sizeof(*node), NI_MEM_LIST);
+}
+
 /* Remove all the elements from the list without destroying the list itself. */
 void ni_list_empty(ni_list *lst) {
     unsigned long   len;
     ni_list_node    *current, *next;
+    ni_list_node    *batch[NI_LIST_BATCH];
+    int             count = 0;
     current = lst->head;
     len = lst->len;
     while(len--) {
         next = current->next;
         if (lst->free)
             lst->free(current->value);
-        ni_free(current);
+        /* Heap nodes are given back NI_LIST_BATCH at a time. */
+        if (!lst->arena) {
+            batch[count++] = current;
+            if (count == NI_LIST_BATCH) {
+                ni_free_batch_sized_tagged((void **)batch, count,
+                                           sizeof(ni_list_node), NI_MEM_LIST);
+                count = 0;
+            }
+        }
         current = next;
     }
+    if (count) ni_free_batch_sized_tagged((void **)batch, count,
+                                          sizeof(ni_list_node), NI_MEM_LIST);
     lst->head = lst->tail = NULL;
     lst->len = 0;
 }
@@ -48,7 +92,8 @@ void ni_list_empty(ni_list *lst) {
  * This function can't fail. */
 void ni_list_release(ni_list *lst) {
     ni_list_empty(lst);
-    ni_free(lst);
+    if (!lst->arena)
+        ni_free_sized_tagged(lst, sizeof(*lst), NI_MEM_LIST);
 }
 
 /* Add a new node to the list, to head, containing the specified 'value'
@@ -59,7 +104,7 @@ void ni_list_release(ni_list *lst) {
  * On success the 'list' pointer you pass to the function is returned. */
 ni_list *ni_list_add_node_head(ni_list *lst, void *val) {
     ni_list_node *node;
-    if ((node = ni_malloc(sizeof(*node))) == NULL)
+    if ((node = ni_list_node_alloc(lst)) == NULL)
         return NULL;
     node->value = val;
     if (lst->len == 0) {
@@ -83,7 +128,7 @@ ni_list *ni_list_add_node_head(ni_list *lst, void *val) {
  * On success the 'list' pointer you pass to the function is returned. */
 ni_list *ni_list_add_node_tail(ni_list *lst, void *val) {
     ni_list_node *node;
-    if ((node = ni_malloc(sizeof(*node))) == NULL)
+    if ((node = ni_list_node_alloc(lst)) == NULL)
         return NULL;
     node->value = val;
     if (lst->len == 0) {
@@ -99,9 +144,47 @@ ni_list *ni_list_add_node_tail(ni_list *lst, void *val) {
     return lst;
 }
 
+/* Append 'count' nodes to the tail of the list, containing the pointers in
+ * 'vals' as values. Nodes are allocated NI_LIST_BATCH at a time, with a
+ * single ni_malloc_batch() call or a single arena allocation, which is much
+ * cheaper than calling ni_list_add_node_tail() in a loop.
+ *
+ * On error, NULL is returned and only the values preceding the batch that
+ * could not be allocated are appended.
+ * On success the 'list' pointer you pass to the function is returned. */
+ni_list *ni_list_add_nodes_tail(ni_list *lst, void **vals, unsigned long count) {
+    ni_list_node *nodes[NI_LIST_BATCH];
+    unsigned long i;
+    int n, j;
+
+    for (i = 0; i < count; i += n) {
+        n = count - i < NI_LIST_BATCH ? (int)(count - i) : NI_LIST_BATCH;
+        if (lst->arena) {
+            ni_list_node *block = ni_arena_alloc(lst->arena, sizeof(ni_list_node) * n);
+            if (block == NULL) return NULL;
+            for (j = 0; j < n; j++) nodes[j] = block + j;
+        } else if (ni_malloc_batch_tagged(sizeof(ni_list_node), n, (void **)nodes,
+                                          NI_MEM_LIST) == 0) {
+            return NULL;
+        }
+        for (j = 0; j < n; j++) {
+            nodes[j]->value = vals[i + j];
+            nodes[j]->prev = lst->tail;
+            nodes[j]->next = NULL;
+            if (lst->tail)
+                lst->tail->next = nodes[j];
+            else
+                lst->head = nodes[j];
+            lst->tail = nodes[j];
+        }
+        lst->len += n;
+    }
+    return lst;
+}
+
 ni_list *ni_list_insert_node(ni_list *lst, ni_list_node *old_nd, void *val, int after) {
     ni_list_node *node;
-    if ((node = ni_malloc(sizeof(*node))) == NULL)
+    if ((node = ni_list_node_alloc(lst)) == NULL)
         return NULL;
     node->value = val;
     if (after) {
@@ -140,7 +223,7 @@ void ni_list_del_node(ni_list *lst, ni_list_node *nd) {
         lst->tail = nd->prev;
     if (lst->free)
         lst->free(nd->value);
-    ni_free(nd);
+    ni_list_node_free(lst, nd);
     lst->len--;
 }
 
@@ -150,7 +233,7 @@ void ni_list_del_node(ni_list *lst, ni_list_node *nd) {
  * This function can't fail. */
 ni_list_iter *ni_list_get_iterator(ni_list *lst, int direction) {
     ni_list_iter *iter;
-    if ((iter = ni_malloc(sizeof(*iter))) == NULL)
+    if ((iter = ni_malloc_sized_tagged(sizeof(*iter), NI_MEM_LIST)) == NULL)
         return NULL;
     if (direction == AL_START_HEAD)
         iter->next = lst->head;
@@ -162,7 +245,7 @@ ni_list_iter *ni_list_get_iterator(ni_list *lst, int direction) {
 
 /* Release the iterator memory */
 void ni_list_release_iterator(ni_list_iter *iter) {
-    ni_free(iter);
+    ni_free_sized_tagged(iter, sizeof(*iter), NI_MEM_LIST);
 }
 
 /* Create an iterator in the list private iterator structure */
@@ -298,7 +381,9 @@ void ni_list_rotate(ni_list *lst) {
 }
 
 /* Add all the elements of the list 'o' at the end of the
- * list 'l'. The list 'other' remains empty but otherwise valid. */
+ * list 'l'. The list 'other' remains empty but otherwise valid.
+ * Both lists must allocate their nodes from the same place, that is
+ * the heap or the same arena. */
 void ni_list_join(ni_list *l, ni_list *o) {
     if (o->head)
         o->head->prev = l->tail;
@@ -313,3 +398,54 @@ void ni_list_join(ni_list *l, ni_list *o) {
     o->head = o->tail = NULL;
     o->len = 0;
 }
+
+/* Defragment the list '*lstp' within the budget of the defrag cycle 'd':
+ * the list header and the nodes sitting in sparsely used slabs are moved
+ * to fresh allocations, see ni_malloc_defrag(), and the values are passed
+ * to 'valproc', if not NULL, to be moved as well. If the header is moved
+ * '*lstp' is updated.
+ *
+ * '*cursor' must be NULL to start from the head. When the budget expires
+ * first, it is set to the node to resume from and 0 is returned: the list
+ * must not be modified, nor iterated, until the next call resumes. Arena
+ * lists are never moved.
+ *
+ * Returns 1 when the whole list was defragmented. */
+int ni_list_defrag(ni_list **lstp, ni_defrag_proc valproc, ni_list_node **cursor, ni_defrag *d) {
+    ni_list         *lst = *lstp, *newlst;
+    ni_list_node    *node, *newnode;
+    void            *newval;
+
+    if (lst->arena) return 1;
+    if (*cursor == NULL) {
+        if ((newlst = ni_defrag_move(d, lst)) != NULL)
+            *lstp = lst = newlst;
+        node = lst->head;
+    } else {
+        node = *cursor;
+    }
+    while (node) {
+        if (ni_defrag_expired(d)) {
+            *cursor = node;
+            return 0;
+        }
+        if ((newnode = ni_defrag_move(d, node)) != NULL) {
+            if (newnode->prev)
+                newnode->prev->next = newnode;
+            else
+                lst->head = newnode;
+            if (newnode->next)
+                newnode->next->prev = newnode;
+            else
+                lst->tail = newnode;
+            node = newnode;
+        }
+        if (valproc && (newval = valproc(node->value)) != NULL) {
+            node->value = newval;
+            d->moved++;
+        }
+        node = node->next;
+    }
+    *cursor = NULL;
+    return 1;
+}
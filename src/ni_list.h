@@ -8,6 +8,12 @@
 #ifndef _NI_LIST_H_
 #define _NI_LIST_H_
 
+#include "ni_arena.h"
+#include "ni_defrag.h"
+
+/* Nodes allocated or freed at a time by the bulk operations. */
+#define NI_LIST_BATCH   64
+
 /* Node, List, and Iterator are the only data structures used currently. */
 
 typedef struct ni_list_node {
@@ -28,6 +34,7 @@ typedef struct ni_list {
     void            (*free)(void *ptr);
     int             (*match)(void *ptr, void *key);
     unsigned long   len;
+    ni_arena        *arena;     /* Nodes are allocated here if not NULL. */
 } ni_list;
 
 /* Functions implemented as macros */
@@ -46,10 +53,12 @@ typedef struct ni_list {
 
 /* Prototypes */
 ni_list *ni_list_create(void);
+ni_list *ni_list_create_arena(ni_arena *a);
 void ni_list_release(ni_list *lst);
 void ni_list_empty(ni_list *lst);
 ni_list *ni_list_add_node_head(ni_list *lst, void *val);
 ni_list *ni_list_add_node_tail(ni_list *lst, void *val);
+ni_list *ni_list_add_nodes_tail(ni_list *lst, void **vals, unsigned long count);
 ni_list *ni_list_insert_node(ni_list *lst, ni_list_node *old_nd, void *val, int after);
 void ni_list_del_node(ni_list *lst, ni_list_node *nd);
 ni_list_iter *ni_list_get_iterator(ni_list *lst, int direction);
@@ -62,6 +71,7 @@ void ni_list_rewind(ni_list *lst, ni_list_iter *iter);
 void ni_list_rewind_tail(ni_list *lst, ni_list_iter *iter);
 void ni_list_rotate(ni_list *lst);
 void ni_list_join(ni_list *l, ni_list *o);
+int ni_list_defrag(ni_list **lstp, ni_defrag_proc valproc, ni_list_node **cursor, ni_defrag *d);
 
 /* Directions for iterators */
 #define AL_START_HEAD 0
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <sys/time.h>
 #include "ni_test.h"
 
 typedef struct ni_person {
@@ -7,25 +8,47 @@ typedef struct ni_person {
     char    ni_male;
 } ni_person;
 
+static long long ni_list_test_mstime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
 int ni_list_test() {
+    //nodes and persons are small fixed-size objects, serve them from slabs
+    ni_malloc_enable_slab(1);
+
     //create person list
     ni_list *lst = NULL;
+    long long start;
     printf("person list used memory: %zu\n", ni_malloc_used_memory());
     lst = ni_list_create();
     if (!lst) return -1;
     lstSetFreeMethod(lst, ni_free);
 
-    //insert person node value
-    ni_person *person = NULL;
-    for (int i = 0; i < 20000000; i++) {
-        person = (ni_person *)ni_malloc(sizeof(ni_person));
-        person->ni_age = i;
-        strcpy(person->ni_name, "Richard Wang");
-        person->ni_male = 0;
-        if (person)
-            lst = ni_list_add_node_tail(lst, (void *)person);
+    //insert person node value, persons and nodes are allocated in batches
+    ni_person *persons[NI_LIST_BATCH];
+    start = ni_list_test_mstime();
+    for (int i = 0; i < 20000000; i += NI_LIST_BATCH) {
+        //the batch fails as a whole under the hard memory limit
+        if (ni_malloc_batch(sizeof(ni_person), NI_LIST_BATCH, (void **)persons) != NI_LIST_BATCH) {
+            printf("person list out of memory after %d persons.\n", i);
+            break;
+        }
+        for (int j = 0; j < NI_LIST_BATCH; j++) {
+            persons[j]->ni_age = i + j;
+            strcpy(persons[j]->ni_name, "Richard Wang");
+            persons[j]->ni_male = 0;
+        }
+        if (ni_list_add_nodes_tail(lst, (void **)persons, NI_LIST_BATCH) == NULL) {
+            ni_free_batch((void **)persons, NI_LIST_BATCH);
+            printf("person list out of memory after %d persons.\n", i);
+            break;
+        }
     }
 
+    printf("person list insert time: %lld ms\n", ni_list_test_mstime() - start);
+
     //output to stdin
     ni_list_iter *lst_iter = ni_list_get_iterator(lst, AL_START_HEAD);
     size_t lst_len = lstLen(lst);
@@ -40,13 +63,14 @@ int ni_list_test() {
                 ((ni_person *)nd->value)->ni_male);
     }
 
-    //release
+    //release in background, freeing 20M nodes inline stalls for seconds
     printf("person list total used memory: %zu\n", ni_malloc_used_memory());
-    ni_list_empty(lst);
-    printf("person empty list used memory: %zu\n", ni_malloc_used_memory());
-    ni_list_release(lst);
-    printf("person list iterator used memory: %zu\n", ni_malloc_used_memory());
     ni_list_release_iterator(lst_iter);
+    start = ni_list_test_mstime();
+    ni_lazyfree_list(lst);
+    printf("person list release time: %lld ms\n", ni_list_test_mstime() - start);
+    printf("person list pending free memory: %zu\n", ni_lazyfree_pending_memory());
+    ni_lazyfree_wait();
     printf("person list left memory: %zu\n", ni_malloc_used_memory());
     return 0;
 }
@@ -0,0 +1,644 @@
+/* ni_listpack.c - A list of strings and integers serialized in one buffer
+ *
+ * The listpack encoding is described in ni_listpack.h. The buffer is kept
+ * as large as its content: inserting grows it and deleting shrinks it,
+ * charged to NI_MEM_LIST. A shrink that fails leaves the buffer larger than
+ * the total of its header, so the buffer is reallocated and freed without
+ * passing its size and the allocator looks it up. The header fields are
+ * stored in host byte order, the listpack is an in memory representation
+ * and is never written out as is.
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "ni_listpack.h"
+#include "ni_malloc.h"
+
+/* Bytes of the longest encoding of an integer, longer than any string
+ * header. */
+#define NI_LISTPACK_MAX_INT_SIZE    9
+
+static uint32_t ni_listpack_get_u32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void ni_listpack_set_u32(unsigned char *p, uint32_t v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+#define ni_listpack_total(lp)           ni_listpack_get_u32(lp)
+#define ni_listpack_count(lp)           ni_listpack_get_u32((lp) + 4)
+#define ni_listpack_set_total(lp, v)    ni_listpack_set_u32(lp, v)
+#define ni_listpack_set_count(lp, v)    ni_listpack_set_u32((lp) + 4, v)
+
+/* Store the 'n' low bytes of 'v' in 'p', least significant first. */
+static void ni_listpack_store(unsigned char *p, uint64_t v, int n) {
+    int j;
+    for (j = 0; j < n; j++) p[j] = (v >> (j * 8)) & 0xFF;
+}
+
+/* Load a signed integer of 'n' bytes stored by ni_listpack_store(). */
+static long long ni_listpack_load(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    int j;
+
+    for (j = 0; j < n; j++) v |= (uint64_t)p[j] << (j * 8);
+    if (n < 8 && (v & ((uint64_t)1 << (n * 8 - 1))))
+        v |= ~(uint64_t)0 << (n * 8);
+    return (long long)v;
+}
+
+/* If the 'len' bytes at 's' are the canonical form of a 64 bit integer, so
+ * that converting it back gives the same string, set '*value' and return 1.
+ * Otherwise return 0: "007", "-0", "+1" or " 1" are kept as strings. */
+static int ni_listpack_string2ll(const unsigned char *s, uint32_t len, long long *value) {
+    const unsigned char *p = s, *end = s + len;
+    unsigned long long v = 0, limit;
+    int negative = 0;
+
+    if (len == 0 || len > 20) return 0;
+    if (*p == '-') {
+        negative = 1;
+        if (++p == end) return 0;
+    }
+    if (*p == '0') {
+        if (negative || p + 1 != end) return 0;
+        *value = 0;
+        return 1;
+    }
+    limit = negative ? (unsigned long long)LLONG_MAX + 1 : LLONG_MAX;
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9') return 0;
+        if (v > (limit - (*p - '0')) / 10) return 0;
+        v = v * 10 + (*p - '0');
+    }
+    *value = negative ? -(long long)(v - 1) - 1 : (long long)v;
+    return 1;
+}
+
+/* Encode the integer 'v' in 'buf' in the smallest width that fits it,
+ * returning the bytes used. */
+static uint32_t ni_listpack_encode_int(unsigned char *buf, long long v) {
+    if (v >= 0 && v <= 127) {
+        buf[0] = (unsigned char)v;
+        return 1;
+    } else if (v >= -4096 && v <= 4095) {
+        if (v < 0) v += 8192;
+        buf[0] = 0xC0 | (v >> 8);
+        buf[1] = v & 0xFF;
+        return 2;
+    } else if (v >= INT16_MIN && v <= INT16_MAX) {
+        buf[0] = 0xF1;
+        ni_listpack_store(buf + 1, (uint64_t)v, 2);
+        return 3;
+    } else if (v >= -8388608 && v <= 8388607) {
+        buf[0] = 0xF2;
+        ni_listpack_store(buf + 1, (uint64_t)v, 3);
+        return 4;
+    } else if (v >= INT32_MIN && v <= INT32_MAX) {
+        buf[0] = 0xF3;
+        ni_listpack_store(buf + 1, (uint64_t)v, 4);
+        return 5;
+    }
+    buf[0] = 0xF4;
+    ni_listpack_store(buf + 1, (uint64_t)v, 8);
+    return 9;
+}
+
+/* Encode the header of a string of 'len' bytes, returning the bytes used. */
+static uint32_t ni_listpack_encode_str_hdr(unsigned char *buf, uint32_t len) {
+    if (len < 64) {
+        buf[0] = 0x80 | len;
+        return 1;
+    } else if (len < 4096) {
+        buf[0] = 0xE0 | (len >> 8);
+        buf[1] = len & 0xFF;
+        return 2;
+    }
+    buf[0] = 0xF0;
+    ni_listpack_store(buf + 1, len, 4);
+    return 5;
+}
+
+/* Return the bytes of the encoding and the data of the entry at 'p'. */
+static uint32_t ni_listpack_encoded_size(const unsigned char *p) {
+    if ((p[0] & 0x80) == 0) return 1;
+    if ((p[0] & 0xC0) == 0x80) return 1 + (p[0] & 0x3F);
+    if ((p[0] & 0xE0) == 0xC0) return 2;
+    if ((p[0] & 0xF0) == 0xE0) return 2 + (((p[0] & 0x0F) << 8) | p[1]);
+    switch (p[0]) {
+    case 0xF0: return 5 + ni_listpack_get_u32(p + 1);
+    case 0xF1: return 3;
+    case 0xF2: return 4;
+    case 0xF3: return 5;
+    case 0xF4: return 9;
+    }
+    return 1;
+}
+
+/* The back length is the encoded size in 7 bit groups, most significant
+ * first, where every byte but the first has the high bit set. Read from
+ * its last byte, right before the next entry, it tells where it ends. */
+static uint32_t ni_listpack_backlen_size(uint32_t l) {
+    if (l < 128) return 1;
+    if (l < 16384) return 2;
+    if (l < 2097152) return 3;
+    if (l < 268435456) return 4;
+    return 5;
+}
+
+static void ni_listpack_encode_backlen(unsigned char *buf, uint32_t l) {
+    uint32_t n = ni_listpack_backlen_size(l), j;
+
+    for (j = 0; j < n; j++)
+        buf[n - 1 - j] = ((l >> (7 * j)) & 127) | (j < n - 1 ? 128 : 0);
+}
+
+/* Decode the back length whose last byte is at 'p'. */
+static uint32_t ni_listpack_decode_backlen(const unsigned char *p) {
+    uint32_t v = 0;
+    int shift = 0;
+
+    do {
+        v |= (uint32_t)(p[0] & 127) << shift;
+        shift += 7;
+    } while (*p-- & 128);
+    return v;
+}
+
+/* Return the bytes of the whole entry at 'p'. */
+static uint32_t ni_listpack_entry_size(const unsigned char *p) {
+    uint32_t l = ni_listpack_encoded_size(p);
+    return l + ni_listpack_backlen_size(l);
+}
+
+/* Create a new empty listpack.
+ *
+ * On error, NULL is returned. Otherwise the new listpack. */
+unsigned char *ni_listpack_new(void) {
+    unsigned char *lp;
+
+    if ((lp = ni_malloc_tagged(NI_LISTPACK_HDR_SIZE + 1, NI_MEM_LIST)) == NULL)
+        return NULL;
+    ni_listpack_set_total(lp, NI_LISTPACK_HDR_SIZE + 1);
+    ni_listpack_set_count(lp, 0);
+    lp[NI_LISTPACK_HDR_SIZE] = NI_LISTPACK_EOF;
+    return lp;
+}
+
+void ni_listpack_free(unsigned char *lp) {
+    ni_free_tagged(lp, NI_MEM_LIST);
+}
+
+/* Return the size of the listpack in bytes. */
+uint32_t ni_listpack_bytes(unsigned char *lp) {
+    return ni_listpack_total(lp);
+}
+
+/* Return the number of entries. */
+uint32_t ni_listpack_length(unsigned char *lp) {
+    return ni_listpack_count(lp);
+}
+
+/* Return the first entry, or NULL if the listpack is empty. */
+unsigned char *ni_listpack_first(unsigned char *lp) {
+    unsigned char *p = lp + NI_LISTPACK_HDR_SIZE;
+    return *p == NI_LISTPACK_EOF ? NULL : p;
+}
+
+/* Return the last entry, or NULL if the listpack is empty. */
+unsigned char *ni_listpack_last(unsigned char *lp) {
+    return ni_listpack_prev(lp, lp + ni_listpack_total(lp) - 1);
+}
+
+/* Return the entry after 'p', or NULL if 'p' is the last one. */
+unsigned char *ni_listpack_next(unsigned char *lp, unsigned char *p) {
+    (void)lp;
+    p += ni_listpack_entry_size(p);
+    return *p == NI_LISTPACK_EOF ? NULL : p;
+}
+
+/* Return the entry before 'p', that can also be the end of the listpack, or
+ * NULL if 'p' is the first one. */
+unsigned char *ni_listpack_prev(unsigned char *lp, unsigned char *p) {
+    uint32_t l;
+
+    if (p == lp + NI_LISTPACK_HDR_SIZE) return NULL;
+    l = ni_listpack_decode_backlen(p - 1);
+    return p - l - ni_listpack_backlen_size(l);
+}
+
+/* Return the entry at the zero-based index 'idx', negative integers counting
+ * from the tail like ni_list_index(), walking from the nearest end. If the
+ * index is out of range NULL is returned. */
+unsigned char *ni_listpack_seek(unsigned char *lp, long idx) {
+    long count = ni_listpack_count(lp);
+    unsigned char *p;
+
+    if (idx < 0) idx += count;
+    if (idx < 0 || idx >= count) return NULL;
+    if (idx < count / 2) {
+        p = ni_listpack_first(lp);
+        while (idx--) p = ni_listpack_next(lp, p);
+    } else {
+        p = ni_listpack_last(lp);
+        for (idx = count - 1 - idx; idx > 0; idx--) p = ni_listpack_prev(lp, p);
+    }
+    return p;
+}
+
+/* Read the entry at 'p'. If it is a string, return a pointer to its bytes
+ * and set '*len' to its length. If it is an integer, set '*lval' to it and
+ * return NULL. */
+unsigned char *ni_listpack_get(unsigned char *p, uint32_t *len, long long *lval) {
+    if ((p[0] & 0x80) == 0) {
+        *lval = p[0];
+        return NULL;
+    } else if ((p[0] & 0xC0) == 0x80) {
+        *len = p[0] & 0x3F;
+        return p + 1;
+    } else if ((p[0] & 0xE0) == 0xC0) {
+        *lval = ((p[0] & 0x1F) << 8) | p[1];
+        if (*lval >= 4096) *lval -= 8192;
+        return NULL;
+    } else if ((p[0] & 0xF0) == 0xE0) {
+        *len = ((p[0] & 0x0F) << 8) | p[1];
+        return p + 2;
+    }
+    switch (p[0]) {
+    case 0xF0: *len = ni_listpack_get_u32(p + 1); return p + 5;
+    case 0xF1: *lval = ni_listpack_load(p + 1, 2); break;
+    case 0xF2: *lval = ni_listpack_load(p + 1, 3); break;
+    case 0xF3: *lval = ni_listpack_load(p + 1, 4); break;
+    default: *lval = ni_listpack_load(p + 1, 8); break;
+    }
+    return NULL;
+}
+
+/* Insert the string 's' of 'len' bytes before or after the entry 'p',
+ * according to 'where'. 'p' can also point to the end of the listpack to
+ * append. If 'newp' is not NULL it is set to the new entry.
+ *
+ * On error, NULL is returned and the listpack is left untouched.
+ * On success the listpack is returned: it may have been moved, so the old
+ * pointer and the entries pointing inside it are no longer valid. */
+unsigned char *ni_listpack_insert(unsigned char *lp, const void *s, uint32_t len,
+                                  unsigned char *p, int where, unsigned char **newp) {
+    unsigned char hdr[NI_LISTPACK_MAX_INT_SIZE], *dst;
+    uint32_t total = ni_listpack_total(lp), offset, hdrlen, datalen, enclen, entrylen;
+    long long v;
+
+    if (where == NI_LISTPACK_AFTER && *p != NI_LISTPACK_EOF)
+        p += ni_listpack_entry_size(p);
+    offset = p - lp;
+    if (ni_listpack_string2ll(s, len, &v)) {
+        hdrlen = ni_listpack_encode_int(hdr, v);
+        datalen = 0;
+    } else {
+        hdrlen = ni_listpack_encode_str_hdr(hdr, len);
+        datalen = len;
+    }
+    enclen = hdrlen + datalen;
+    if (enclen < datalen) return NULL;
+    entrylen = enclen + ni_listpack_backlen_size(enclen);
+    if ((uint64_t)total + entrylen > UINT32_MAX) return NULL;
+
+    if ((lp = ni_realloc_tagged(lp, total + entrylen, NI_MEM_LIST)) == NULL)
+        return NULL;
+    dst = lp + offset;
+    memmove(dst + entrylen, dst, total - offset);
+    memcpy(dst, hdr, hdrlen);
+    if (datalen) memcpy(dst + hdrlen, s, datalen);
+    ni_listpack_encode_backlen(dst + enclen, enclen);
+    ni_listpack_set_total(lp, total + entrylen);
+    ni_listpack_set_count(lp, ni_listpack_count(lp) + 1);
+    if (newp) *newp = dst;
+    return lp;
+}
+
+/* Add the string 's' of 'len' bytes at the end of the listpack, like
+ * ni_listpack_insert(). */
+unsigned char *ni_listpack_append(unsigned char *lp, const void *s, uint32_t len) {
+    return ni_listpack_insert(lp, s, len, lp + ni_listpack_total(lp) - 1,
+                              NI_LISTPACK_BEFORE, NULL);
+}
+
+/* Add the string 's' of 'len' bytes at the start of the listpack, like
+ * ni_listpack_insert(). */
+unsigned char *ni_listpack_prepend(unsigned char *lp, const void *s, uint32_t len) {
+    return ni_listpack_insert(lp, s, len, lp + NI_LISTPACK_HDR_SIZE,
+                              NI_LISTPACK_BEFORE, NULL);
+}
+
+/* Delete the entry 'p'. If 'newp' is not NULL it is set to the entry that
+ * followed the deleted one, or NULL if it was the last.
+ *
+ * The listpack is returned, it may have been moved like for
+ * ni_listpack_insert(). This function can't fail. */
+unsigned char *ni_listpack_delete(unsigned char *lp, unsigned char *p, unsigned char **newp) {
+    uint32_t total = ni_listpack_total(lp), offset = p - lp;
+    uint32_t entrylen = ni_listpack_entry_size(p);
+    unsigned char *shrunk;
+
+    memmove(p, p + entrylen, total - offset - entrylen);
+    ni_listpack_set_total(lp, total - entrylen);
+    ni_listpack_set_count(lp, ni_listpack_count(lp) - 1);
+    /* If the allocator can't shrink the buffer it keeps its old size, that
+     * is fine since the size is not passed back to the allocator. */
+    if ((shrunk = ni_realloc_tagged(lp, total - entrylen, NI_MEM_LIST)) != NULL)
+        lp = shrunk;
+    if (newp) *newp = lp[offset] == NI_LISTPACK_EOF ? NULL : lp + offset;
+    return lp;
+}
+
+/* ------------------------------ Packed lists ------------------------------
+ *
+ * An ni_plist starts as a listpack and is converted to an ni_list of
+ * ni_string values the first time it would go over NI_PLIST_MAX_ENTRIES
+ * values or store a value longer than NI_PLIST_MAX_VALUE bytes. Both limits
+ * keep the listpack within a few KB, so that moving its tail on insertion
+ * and deletion costs less than the cache misses of walking list nodes. */
+
+static void ni_plist_free_value(void *ptr) {
+    ni_string_obj_free(ptr);
+}
+
+/* Create a new empty list, encoded as a listpack.
+ *
+ * On error, NULL is returned. Otherwise the pointer to the new list. */
+ni_plist *ni_plist_create(void) {
+    ni_plist *pl;
+
+    if ((pl = ni_malloc_sized_tagged(sizeof(*pl), NI_MEM_LIST)) == NULL)
+        return NULL;
+    if ((pl->lp = ni_listpack_new()) == NULL) {
+        ni_free_sized_tagged(pl, sizeof(*pl), NI_MEM_LIST);
+        return NULL;
+    }
+    pl->encoding = NI_PLIST_LISTPACK;
+    pl->list = NULL;
+    return pl;
+}
+
+/* Free the whole list.
+ *
+ * This function can't fail. */
+void ni_plist_release(ni_plist *pl) {
+    if (pl->encoding == NI_PLIST_LISTPACK)
+        ni_listpack_free(pl->lp);
+    else
+        ni_list_release(pl->list);
+    ni_free_sized_tagged(pl, sizeof(*pl), NI_MEM_LIST);
+}
+
+unsigned long ni_plist_length(ni_plist *pl) {
+    if (pl->encoding == NI_PLIST_LISTPACK)
+        return ni_listpack_length(pl->lp);
+    return lstLen(pl->list);
+}
+
+/* Fill 'e' with the listpack entry 'p'. */
+static void ni_plist_entry_from_listpack(unsigned char *p, ni_plist_entry *e) {
+    uint32_t len = 0;
+    e->s = ni_listpack_get(p, &len, &e->lval);
+    e->len = len;
+}
+
+static void ni_plist_entry_from_node(ni_list_node *node, ni_plist_entry *e) {
+    e->s = (unsigned char*)lstNodeVal(node);
+    e->len = ni_string_len(lstNodeVal(node));
+}
+
+static ni_string ni_plist_entry_to_string(ni_plist_entry *e) {
+    if (e->s) return ni_string_new_len(e->s, e->len);
+    return ni_string_from_longlong(e->lval);
+}
+
+/* Convert the listpack to an ni_list. The values are added with the bulk
+ * node allocation, the list holds at most NI_PLIST_MAX_ENTRIES of them.
+ *
+ * On error, NULL is returned and the list is left untouched. */
+static ni_plist *ni_plist_convert(ni_plist *pl) {
+    ni_string vals[NI_PLIST_MAX_ENTRIES];
+    ni_plist_entry e;
+    ni_list *list;
+    unsigned char *p;
+    unsigned long count = 0, j;
+
+    if ((list = ni_list_create()) == NULL)
+        return NULL;
+    lstSetFreeMethod(list, ni_plist_free_value);
+    for (p = ni_listpack_first(pl->lp); p != NULL; p = ni_listpack_next(pl->lp, p)) {
+        ni_plist_entry_from_listpack(p, &e);
+        if ((vals[count] = ni_plist_entry_to_string(&e)) == NULL)
+            goto err;
+        count++;
+    }
+    if (ni_list_add_nodes_tail(list, (void**)vals, count) == NULL)
+        goto err;
+    ni_listpack_free(pl->lp);
+    pl->lp = NULL;
+    pl->list = list;
+    pl->encoding = NI_PLIST_LIST;
+    return pl;
+
+err:
+    /* Part of the values may be in the list already. */
+    lstSetFreeMethod(list, NULL);
+    ni_list_release(list);
+    for (j = 0; j < count; j++) ni_string_obj_free(vals[j]);
+    return NULL;
+}
+
+/* Convert the list if adding a value of 'len' bytes would cross the limits
+ * of the listpack encoding.
+ *
+ * On error, NULL is returned. Otherwise 'pl'. */
+static ni_plist *ni_plist_grow(ni_plist *pl, size_t len) {
+    if (pl->encoding == NI_PLIST_LISTPACK &&
+        (len > NI_PLIST_MAX_VALUE || ni_listpack_length(pl->lp) >= NI_PLIST_MAX_ENTRIES))
+        return ni_plist_convert(pl);
+    return pl;
+}
+
+/* Add the string 's' of 'len' bytes at the head or at the tail of the list,
+ * according to 'where'.
+ *
+ * On error, NULL is returned and no operation is performed.
+ * On success the 'pl' pointer you pass to the function is returned. */
+ni_plist *ni_plist_push(ni_plist *pl, const void *s, size_t len, int where) {
+    unsigned char *lp;
+    ni_string val;
+
+    if (ni_plist_grow(pl, len) == NULL)
+        return NULL;
+    if (pl->encoding == NI_PLIST_LISTPACK) {
+        if (where == NI_PLIST_HEAD)
+            lp = ni_listpack_prepend(pl->lp, s, len);
+        else
+            lp = ni_listpack_append(pl->lp, s, len);
+        if (lp == NULL) return NULL;
+        pl->lp = lp;
+        return pl;
+    }
+    if ((val = ni_string_new_len(s, len)) == NULL)
+        return NULL;
+    if ((where == NI_PLIST_HEAD ? ni_list_add_node_head(pl->list, val) :
+                                  ni_list_add_node_tail(pl->list, val)) == NULL) {
+        ni_string_obj_free(val);
+        return NULL;
+    }
+    return pl;
+}
+
+/* Remove the value at the head or at the tail of the list, according to
+ * 'where', and store it in '*val' as a new ni_string owned by the caller.
+ *
+ * Returns 1 if a value was removed, 0 if the list is empty or we are out of
+ * memory. */
+int ni_plist_pop(ni_plist *pl, int where, ni_string *val) {
+    ni_plist_entry e;
+    ni_list_node *node;
+    unsigned char *p;
+
+    if (pl->encoding == NI_PLIST_LISTPACK) {
+        p = where == NI_PLIST_HEAD ? ni_listpack_first(pl->lp) : ni_listpack_last(pl->lp);
+        if (p == NULL) return 0;
+        ni_plist_entry_from_listpack(p, &e);
+        if ((*val = ni_plist_entry_to_string(&e)) == NULL)
+            return 0;
+        pl->lp = ni_listpack_delete(pl->lp, p, NULL);
+        return 1;
+    }
+    node = where == NI_PLIST_HEAD ? lstFirst(pl->list) : lstLast(pl->list);
+    if (node == NULL) return 0;
+    /* Take the string from the node, so that deleting it frees nothing. */
+    *val = lstNodeVal(node);
+    node->value = NULL;
+    ni_list_del_node(pl->list, node);
+    return 1;
+}
+
+/* Insert the string 's' of 'len' bytes so that it ends up at the index
+ * 'idx', like ni_ulist_insert(). 'idx' can be the length of the list to
+ * append, negative integers count from the tail.
+ *
+ * On error, NULL is returned and no operation is performed, that is the
+ * index is out of range or we are out of memory.
+ * On success the 'pl' pointer you pass to the function is returned. */
+ni_plist *ni_plist_insert(ni_plist *pl, long idx, const void *s, size_t len) {
+    long count = (long)ni_plist_length(pl);
+    unsigned char *lp;
+    ni_string val;
+
+    if (idx < 0) idx += count;
+    if (idx < 0 || idx > count) return NULL;
+    if (idx == 0 || idx == count)
+        return ni_plist_push(pl, s, len, idx == 0 ? NI_PLIST_HEAD : NI_PLIST_TAIL);
+    if (ni_plist_grow(pl, len) == NULL)
+        return NULL;
+    if (pl->encoding == NI_PLIST_LISTPACK) {
+        lp = ni_listpack_insert(pl->lp, s, len, ni_listpack_seek(pl->lp, idx),
+                                NI_LISTPACK_BEFORE, NULL);
+        if (lp == NULL) return NULL;
+        pl->lp = lp;
+        return pl;
+    }
+    if ((val = ni_string_new_len(s, len)) == NULL)
+        return NULL;
+    if (ni_list_insert_node(pl->list, ni_list_index(pl->list, idx), val, 0) == NULL) {
+        ni_string_obj_free(val);
+        return NULL;
+    }
+    return pl;
+}
+
+/* Delete the value at the index 'idx', negative integers counting from the
+ * tail.
+ *
+ * Returns 1 if the value was deleted, 0 if the index is out of range. */
+int ni_plist_delete(ni_plist *pl, long idx) {
+    unsigned char *p;
+    ni_list_node *node;
+
+    if (pl->encoding == NI_PLIST_LISTPACK) {
+        if ((p = ni_listpack_seek(pl->lp, idx)) == NULL) return 0;
+        pl->lp = ni_listpack_delete(pl->lp, p, NULL);
+        return 1;
+    }
+    if ((node = ni_list_index(pl->list, idx)) == NULL) return 0;
+    ni_list_del_node(pl->list, node);
+    return 1;
+}
+
+/* Read the value at the index 'idx', negative integers counting from the
+ * tail, in 'e'.
+ *
+ * Returns 1 if the value was read, 0 if the index is out of range. */
+int ni_plist_index(ni_plist *pl, long idx, ni_plist_entry *e) {
+    unsigned char *p;
+    ni_list_node *node;
+
+    if (pl->encoding == NI_PLIST_LISTPACK) {
+        if ((p = ni_listpack_seek(pl->lp, idx)) == NULL) return 0;
+        ni_plist_entry_from_listpack(p, e);
+        return 1;
+    }
+    if ((node = ni_list_index(pl->list, idx)) == NULL) return 0;
+    ni_plist_entry_from_node(node, e);
+    return 1;
+}
+
+/* Iterators live in the caller, usually on the stack. The list must not be
+ * modified while iterating. */
+void ni_plist_rewind(ni_plist *pl, ni_plist_iter *iter) {
+    iter->pl = pl;
+    iter->direction = AL_START_HEAD;
+    if (pl->encoding == NI_PLIST_LISTPACK)
+        iter->p = ni_listpack_first(pl->lp);
+    else
+        ni_list_rewind(pl->list, &iter->li);
+}
+
+void ni_plist_rewind_tail(ni_plist *pl, ni_plist_iter *iter) {
+    iter->pl = pl;
+    iter->direction = AL_START_TAIL;
+    if (pl->encoding == NI_PLIST_LISTPACK)
+        iter->p = ni_listpack_last(pl->lp);
+    else
+        ni_list_rewind_tail(pl->list, &iter->li);
+}
+
+/* Read the next value of an iterator in 'e'.
+ *
+ * Returns 1 if a value was read, 0 if there are no more values:
+ *
+ * ni_plist_rewind(pl, &iter);
+ * while (ni_plist_next(&iter, &e)) {
+ *     doSomethingWith(&e);
+ * }
+ */
+int ni_plist_next(ni_plist_iter *iter, ni_plist_entry *e) {
+    unsigned char *lp = iter->pl->lp;
+    ni_list_node *node;
+
+    if (iter->pl->encoding == NI_PLIST_LISTPACK) {
+        if (iter->p == NULL) return 0;
+        ni_plist_entry_from_listpack(iter->p, e);
+        if (iter->direction == AL_START_HEAD)
+            iter->p = ni_listpack_next(lp, iter->p);
+        else
+            iter->p = ni_listpack_prev(lp, iter->p);
+        return 1;
+    }
+    if ((node = ni_list_next(&iter->li)) == NULL) return 0;
+    ni_plist_entry_from_node(node, e);
+    return 1;
+}
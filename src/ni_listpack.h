@@ -0,0 +1,112 @@
+/* ni_listpack.h - A list of strings and integers serialized in one buffer
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#ifndef _NI_LISTPACK_H_
+#define _NI_LISTPACK_H_
+
+#include <stdint.h>
+#include "ni_list.h"
+#include "ni_string.h"
+
+/* A listpack is a single allocation holding all its entries back to back:
+ *
+ *  <total bytes:uint32> <count:uint32> <entry> ... <entry> <end:0xFF>
+ *
+ * Every entry is an encoding byte, possibly followed by more length bytes
+ * and the data, then the length of the encoding and the data stored in 1
+ * to 5 bytes, so that the list can be walked backwards too:
+ *
+ *  0xxxxxxx                    7 bit unsigned integer
+ *  10xxxxxx                    string of up to 63 bytes
+ *  110xxxxx yyyyyyyy           13 bit signed integer
+ *  1110xxxx yyyyyyyy           string of up to 4095 bytes
+ *  11110000 <len:4 bytes>      longer string
+ *  11110001 ... 11110100       16, 24, 32 and 64 bit signed integers
+ *
+ * Strings that are the canonical form of a 64 bit integer are stored as
+ * integers of the smallest width that fits. A small integer takes 2 bytes
+ * and a short string its length plus 2 bytes, where ni_list needs a node,
+ * a value and their allocator overhead. The price is that inserting and
+ * deleting move the following entries and reallocate the buffer, so a
+ * listpack is meant for small lists: ni_plist below switches to a regular
+ * ni_list as it grows. */
+#define NI_LISTPACK_HDR_SIZE    8
+#define NI_LISTPACK_EOF         0xFF
+
+/* Where ni_listpack_insert() inserts the new entry. */
+#define NI_LISTPACK_BEFORE      0
+#define NI_LISTPACK_AFTER       1
+
+/* Prototypes */
+unsigned char *ni_listpack_new(void);
+void ni_listpack_free(unsigned char *lp);
+uint32_t ni_listpack_bytes(unsigned char *lp);
+uint32_t ni_listpack_length(unsigned char *lp);
+unsigned char *ni_listpack_first(unsigned char *lp);
+unsigned char *ni_listpack_last(unsigned char *lp);
+unsigned char *ni_listpack_next(unsigned char *lp, unsigned char *p);
+unsigned char *ni_listpack_prev(unsigned char *lp, unsigned char *p);
+unsigned char *ni_listpack_seek(unsigned char *lp, long idx);
+unsigned char *ni_listpack_get(unsigned char *p, uint32_t *len, long long *lval);
+unsigned char *ni_listpack_insert(unsigned char *lp, const void *s, uint32_t len,
+                                  unsigned char *p, int where, unsigned char **newp);
+unsigned char *ni_listpack_append(unsigned char *lp, const void *s, uint32_t len);
+unsigned char *ni_listpack_prepend(unsigned char *lp, const void *s, uint32_t len);
+unsigned char *ni_listpack_delete(unsigned char *lp, unsigned char *p, unsigned char **newp);
+
+/* A list stored as a listpack while it is small, converted to an ni_list of
+ * ni_string values once it holds more than NI_PLIST_MAX_ENTRIES values or a
+ * value longer than NI_PLIST_MAX_VALUE bytes. A converted list stays an
+ * ni_list even if it shrinks again. */
+#define NI_PLIST_MAX_ENTRIES    128
+#define NI_PLIST_MAX_VALUE      64
+
+#define NI_PLIST_LISTPACK       0
+#define NI_PLIST_LIST           1
+
+/* Ends of the list for push and pop */
+#define NI_PLIST_HEAD           0
+#define NI_PLIST_TAIL           1
+
+typedef struct ni_plist {
+    int             encoding;
+    unsigned char   *lp;        /* Values, if encoding is NI_PLIST_LISTPACK. */
+    ni_list         *list;      /* ni_string values otherwise. */
+} ni_plist;
+
+/* A value read from a list. It points inside the list, so it is valid until
+ * the list is modified. */
+typedef struct ni_plist_entry {
+    unsigned char   *s;         /* NULL if the value is the integer 'lval'. */
+    size_t          len;
+    long long       lval;
+} ni_plist_entry;
+
+typedef struct ni_plist_iter {
+    ni_plist        *pl;
+    unsigned char   *p;
+    ni_list_iter    li;
+    int             direction;
+} ni_plist_iter;
+
+/* Functions implemented as macros */
+#define plstEncoding(pl)        ((pl)->encoding)
+
+/* Prototypes */
+ni_plist *ni_plist_create(void);
+void ni_plist_release(ni_plist *pl);
+unsigned long ni_plist_length(ni_plist *pl);
+ni_plist *ni_plist_push(ni_plist *pl, const void *s, size_t len, int where);
+int ni_plist_pop(ni_plist *pl, int where, ni_string *val);
+ni_plist *ni_plist_insert(ni_plist *pl, long idx, const void *s, size_t len);
+int ni_plist_delete(ni_plist *pl, long idx);
+int ni_plist_index(ni_plist *pl, long idx, ni_plist_entry *e);
+void ni_plist_rewind(ni_plist *pl, ni_plist_iter *iter);
+void ni_plist_rewind_tail(ni_plist *pl, ni_plist_iter *iter);
+int ni_plist_next(ni_plist_iter *iter, ni_plist_entry *e);
+
+#endif /* _NI_LISTPACK_H_ */
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ni_test.h"
+
+#define NI_LISTPACK_TEST_OPS    5000
+#define NI_LISTPACK_TEST_VALUES 100
+
+/* Compare the entry 'p' with the string 'ref'. */
+static int ni_listpack_test_equal(unsigned char *p, ni_string ref) {
+    unsigned char *s;
+    uint32_t len;
+    long long lval;
+    char buf[32];
+
+    if ((s = ni_listpack_get(p, &len, &lval)) == NULL) {
+        len = sprintf(buf, "%lld", lval);
+        s = (unsigned char*)buf;
+    }
+    return len == ni_string_len(ref) && memcmp(s, ref, len) == 0;
+}
+
+/* Check 'lp' holds the 'count' strings of 'ref', walking it forward and
+ * backwards. */
+static int ni_listpack_test_check(unsigned char *lp, ni_string *ref, long count) {
+    unsigned char *p;
+    long j = 0;
+
+    if ((long)ni_listpack_length(lp) != count) return 0;
+    for (p = ni_listpack_first(lp); p != NULL; p = ni_listpack_next(lp, p), j++) {
+        if (j >= count || !ni_listpack_test_equal(p, ref[j])) return 0;
+    }
+    if (j != count) return 0;
+    for (p = ni_listpack_last(lp); p != NULL; p = ni_listpack_prev(lp, p)) {
+        if (--j < 0 || !ni_listpack_test_equal(p, ref[j])) return 0;
+    }
+    return j == 0;
+}
+
+static void ni_listpack_test_free(void *ptr) {
+    ni_string_obj_free(ptr);
+}
+
+/* Compare the entry 'e' with the string 's'. */
+static int ni_listpack_test_entry(ni_plist_entry *e, const char *s) {
+    char buf[32];
+
+    if (e->s) return e->len == strlen(s) && memcmp(e->s, s, e->len) == 0;
+    sprintf(buf, "%lld", e->lval);
+    return strcmp(buf, s) == 0;
+}
+
+int ni_listpack_test() {
+    {
+        const char *ints[] = {"0", "127", "-1", "4095", "-4096", "32767",
+            "-8388608", "2147483647", "-9223372036854775808", "9223372036854775807"};
+        uint32_t sizes[] = {2, 2, 3, 3, 3, 4, 5, 6, 10, 10};
+        const char *strs[] = {"007", "-0", "+1", "9223372036854775808", "hello"};
+        unsigned char *lp = ni_listpack_new(), *p, *next;
+        uint32_t len, j, ok = 1;
+        long long lval;
+        char buf[32];
+
+        for (j = 0; j < 10; j++) lp = ni_listpack_append(lp, ints[j], strlen(ints[j]));
+        for (p = ni_listpack_first(lp), j = 0; p != NULL; p = next, j++) {
+            next = ni_listpack_next(lp, p);
+            len = (next ? next : lp + ni_listpack_bytes(lp) - 1) - p;
+            if (ni_listpack_get(p, &len, &lval) != NULL || len != sizes[j]) ok = 0;
+            sprintf(buf, "%lld", lval);
+            if (strcmp(buf, ints[j])) ok = 0;
+        }
+        test_cond("Integers take the smallest width", ok && j == 10)
+
+        for (j = 0; j < 5; j++) lp = ni_listpack_prepend(lp, strs[j], strlen(strs[j]));
+        for (p = ni_listpack_first(lp), j = 0; j < 5; p = ni_listpack_next(lp, p), j++)
+            if (ni_listpack_get(p, &len, &lval) == NULL) ok = 0;
+        test_cond("Non canonical integers stay strings", ok &&
+            ni_listpack_length(lp) == 15 &&
+            ni_listpack_get(ni_listpack_seek(lp, 0), &len, &lval) != NULL && len == 5 &&
+            memcmp(ni_listpack_get(ni_listpack_seek(lp, -11), &len, &lval), "007", 3) == 0)
+        ni_listpack_free(lp);
+    }
+
+    /* Strings around the header and back length widths, walked forward and
+     * backwards. */
+    {
+        uint32_t lens[] = {0, 63, 64, 125, 126, 4095, 4096, 20000};
+        ni_string ref[8];
+        unsigned char *lp = ni_listpack_new();
+        int j;
+
+        for (j = 0; j < 8; j++) {
+            ref[j] = ni_string_new_len(NULL, lens[j]);
+            memset(ref[j], 'a' + j, lens[j]);
+            lp = ni_listpack_append(lp, ref[j], lens[j]);
+        }
+        test_cond("Strings of every header width", ni_listpack_test_check(lp, ref, 8) &&
+            ni_listpack_bytes(lp) == NI_LISTPACK_HDR_SIZE + 1 + (1+1+0) + (1+63+1) +
+            (2+64+1) + (2+125+1) + (2+126+2) + (2+4095+2) + (5+4096+2) + (5+20000+3))
+        for (j = 0; j < 8; j++) ni_string_obj_free(ref[j]);
+        ni_listpack_free(lp);
+    }
+
+    /* Random inserts and deletes checked against an array of strings. */
+    {
+        ni_string *ref = ni_malloc(sizeof(ni_string) * NI_LISTPACK_TEST_OPS);
+        unsigned char *lp = ni_listpack_new(), *p, *newp;
+        long count = 0, j, idx, ok = 1;
+        ni_string s;
+
+        srand(4321);
+        for (j = 0; j < NI_LISTPACK_TEST_OPS; j++) {
+            if (rand() % 3 == 0 && count > 0) {
+                idx = rand() % count;
+                p = ni_listpack_seek(lp, idx);
+                lp = ni_listpack_delete(lp, p, &newp);
+                ni_string_obj_free(ref[idx]);
+                memmove(ref + idx, ref + idx + 1, sizeof(ni_string) * (count - idx - 1));
+                count--;
+                if (idx < count ? newp != ni_listpack_seek(lp, idx) : newp != NULL) ok = 0;
+                continue;
+            }
+            switch (rand() % 3) {
+            case 0: s = ni_string_from_longlong(rand() - RAND_MAX / 2); break;
+            case 1: s = ni_string_from_longlong(rand() % 200); break;
+            default:
+                s = ni_string_new_len(NULL, rand() % 300);
+                memset(s, 'x', ni_string_len(s));
+            }
+            idx = rand() % (count + 1);
+            if (idx == count)
+                lp = ni_listpack_insert(lp, s, ni_string_len(s),
+                        lp + ni_listpack_bytes(lp) - 1, NI_LISTPACK_BEFORE, &newp);
+            else
+                lp = ni_listpack_insert(lp, s, ni_string_len(s),
+                        ni_listpack_seek(lp, idx), NI_LISTPACK_BEFORE, &newp);
+            if (newp != ni_listpack_seek(lp, idx)) ok = 0;
+            memmove(ref + idx + 1, ref + idx, sizeof(ni_string) * (count - idx));
+            ref[idx] = s;
+            count++;
+            if (j % 500 == 0) ok &= ni_listpack_test_check(lp, ref, count);
+        }
+        test_cond("Random inserts and deletes match an array",
+            ok && ni_listpack_test_check(lp, ref, count))
+        p = ni_listpack_seek(lp, 0);
+        lp = ni_listpack_insert(lp, "after", 5, p, NI_LISTPACK_AFTER, &newp);
+        test_cond("Insert after an entry", newp == ni_listpack_seek(lp, 1) &&
+            ni_listpack_length(lp) == (uint32_t)count + 1)
+        for (j = 0; j < count; j++) ni_string_obj_free(ref[j]);
+        ni_free(ref);
+        ni_listpack_free(lp);
+    }
+
+    {
+        ni_plist *pl = ni_plist_create();
+        ni_plist_iter iter;
+        ni_plist_entry e;
+        ni_string val;
+        char buf[128];
+        long j, ok = 1;
+
+        for (j = 0; j < NI_PLIST_MAX_ENTRIES - 1; j++) {
+            sprintf(buf, j % 2 ? "%ld" : "value %ld", j);
+            ni_plist_push(pl, buf, strlen(buf), NI_PLIST_TAIL);
+        }
+        ni_plist_insert(pl, 1, "inserted", 8);
+        ni_plist_delete(pl, 1);
+        ni_plist_push(pl, "127", 3, NI_PLIST_TAIL);
+        test_cond("Small lists stay listpacks",
+            plstEncoding(pl) == NI_PLIST_LISTPACK && ni_plist_length(pl) == NI_PLIST_MAX_ENTRIES &&
+            ni_plist_index(pl, 1, &e) && e.s == NULL && e.lval == 1 &&
+            ni_plist_index(pl, -2, &e) && ni_listpack_test_entry(&e, "value 126"))
+
+        ni_plist_insert(pl, 2, "one too many", 12);
+        test_cond("Going over the entries converts to ni_list",
+            plstEncoding(pl) == NI_PLIST_LIST && ni_plist_length(pl) == NI_PLIST_MAX_ENTRIES + 1 &&
+            ni_plist_index(pl, 1, &e) && ni_listpack_test_entry(&e, "1") &&
+            ni_plist_index(pl, 2, &e) && ni_listpack_test_entry(&e, "one too many") &&
+            ni_plist_index(pl, -1, &e) && ni_listpack_test_entry(&e, "127"))
+
+        ni_plist_rewind_tail(pl, &iter);
+        for (j = NI_PLIST_MAX_ENTRIES; ni_plist_next(&iter, &e); j--) {
+            /* The value at index 2 is the inserted one, the others moved. */
+            if (j == 2)
+                strcpy(buf, "one too many");
+            else
+                sprintf(buf, (j > 2 ? j - 1 : j) % 2 ? "%ld" : "value %ld", j > 2 ? j - 1 : j);
+            if (!ni_listpack_test_entry(&e, buf)) ok = 0;
+        }
+        test_cond("Iterate backwards over a converted list", ok && j == -1)
+        test_cond("Pop from a converted list",
+            ni_plist_pop(pl, NI_PLIST_HEAD, &val) && strcmp(val, "value 0") == 0 &&
+            ni_plist_length(pl) == NI_PLIST_MAX_ENTRIES)
+        ni_string_obj_free(val);
+        ni_plist_release(pl);
+
+        pl = ni_plist_create();
+        ni_plist_push(pl, "12345", 5, NI_PLIST_HEAD);
+        ni_plist_push(pl, "short", 5, NI_PLIST_TAIL);
+        test_cond("Pop from a listpack",
+            ni_plist_pop(pl, NI_PLIST_HEAD, &val) && strcmp(val, "12345") == 0 &&
+            ni_plist_length(pl) == 1)
+        ni_string_obj_free(val);
+        memset(buf, 'z', NI_PLIST_MAX_VALUE + 1);
+        ni_plist_push(pl, buf, NI_PLIST_MAX_VALUE + 1, NI_PLIST_TAIL);
+        ni_plist_rewind(pl, &iter);
+        test_cond("A long value converts to ni_list", plstEncoding(pl) == NI_PLIST_LIST &&
+            ni_plist_next(&iter, &e) && ni_listpack_test_entry(&e, "short") &&
+            ni_plist_next(&iter, &e) && e.len == NI_PLIST_MAX_VALUE + 1 &&
+            !ni_plist_next(&iter, &e))
+        ni_plist_release(pl);
+    }
+
+    /* Memory of a small list of short values, as a listpack and as an
+     * ni_list of ni_string values. */
+    {
+        ni_plist *pl;
+        ni_list *lst;
+        size_t used, mem, pmem;
+        char buf[32];
+        int j, len;
+
+        used = ni_malloc_used_memory();
+        lst = ni_list_create();
+        lstSetFreeMethod(lst, ni_listpack_test_free);
+        for (j = 0; j < NI_LISTPACK_TEST_VALUES; j++) {
+            len = sprintf(buf, j % 2 ? "%d" : "item:%d", j * 1000);
+            ni_list_add_node_tail(lst, ni_string_new_len(buf, len));
+        }
+        mem = ni_malloc_used_memory() - used;
+        ni_list_release(lst);
+
+        used = ni_malloc_used_memory();
+        pl = ni_plist_create();
+        for (j = 0; j < NI_LISTPACK_TEST_VALUES; j++) {
+            len = sprintf(buf, j % 2 ? "%d" : "item:%d", j * 1000);
+            ni_plist_push(pl, buf, len, NI_PLIST_TAIL);
+        }
+        pmem = ni_malloc_used_memory() - used;
+        ni_plist_release(pl);
+
+        printf("%d short values: ni_list %zu bytes, listpack %zu bytes\n",
+            NI_LISTPACK_TEST_VALUES, mem, pmem);
+        test_cond("Listpack uses less memory", pmem * 4 < mem)
+    }
+    test_report()
+    return 0;
+}
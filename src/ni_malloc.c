@@ -5,13 +5,25 @@
  *
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE     /* mremap() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <sys/mman.h>
+#if defined(__GLIBC__)
+#include <execinfo.h>
+#endif
 #include "ni_malloc.h"
 #include "ni_atomic.h"
+#include "ni_sync.h"
 
 #ifdef HAVE_MALLOC_SIZE
 #define PREFIX_SIZE (0)
@@ -23,125 +35,2224 @@
 #endif
 #endif
 
+/* Memory accounting is sharded per thread: every thread owns a counter,
+ * living on its own cache line, where it adds the bytes it allocates and
+ * subtracts the bytes it frees. The counters are unsigned and wrap around,
+ * so a thread freeing memory allocated by another thread is fine: only the
+ * sum of all the shards is meaningful.
+ *
+ * ni_malloc_used_memory() returns the exact figure summing all the shards,
+ * plus what threads that already exited left behind. Callers that only need
+ * an approximate figure cheaply can use ni_malloc_used_memory_approx(), that
+ * reads the global 'used_memory' counter: every thread folds its delta into
+ * it only once it drifted by more than NI_MALLOC_STAT_FOLD bytes, so the
+ * error is bounded by NI_MALLOC_STAT_FOLD bytes per thread. */
+#ifndef NI_MALLOC_STAT_FOLD
+#define NI_MALLOC_STAT_FOLD (64*1024)
+#endif
+#ifndef NI_MALLOC_TAG_COUNT_FOLD
+#define NI_MALLOC_TAG_COUNT_FOLD 1024
+#endif
+
+/* Per size class counters of a shard, see ni_malloc_get_size_classes(). */
+typedef struct ni_malloc_hist {
+    size_t  live_objects;
+    size_t  live_bytes;
+    size_t  allocs;
+    size_t  requested;
+    size_t  usable;
+} ni_malloc_hist;
+
+typedef struct ni_malloc_shard {
+    ni_atomic size_t        used;       /* Written by the owner thread only. */
+    size_t                  folded;     /* Part of 'used' in used_memory. */
+    ni_atomic int           check_limit;    /* A hard limit is set. */
+    pthread_mutex_t         used_mutex; /* Only used by the mutex backend. */
+    pthread_mutex_t         check_limit_mutex;
+    struct ni_malloc_shard  *next;
+    int                     in_use;
+    /* Unfolded bytes and objects charged to each tag by the owner thread. */
+    size_t                  tag_bytes[NI_MEM_TAGS];
+    size_t                  tag_count[NI_MEM_TAGS];
+    ni_malloc_hist          hist[NI_MALLOC_SIZE_CLASSES];
+} NI_CACHE_ALIGNED ni_malloc_shard;
+
 #define update_ni_malloc_stat_alloc(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicIncr(used_memory, __n); \
+    ni_malloc_stat_update(_n); \
 } while(0)
 
 #define update_ni_malloc_stat_free(__n) do { \
     size_t _n = (__n); \
     if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
-    atomicDecr(used_memory, __n); \
+    ni_malloc_stat_update(-_n); \
+} while(0)
+
+/* Folded into by every thread, so it gets a cache line of its own. */
+static ni_atomic size_t used_memory NI_CACHE_ALIGNED = 0;
+pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Registry of the shards. Shards of exited threads are kept in the list
+ * and reused, their balance is moved to 'exited_memory'. */
+static ni_malloc_shard *shards = NULL;
+static size_t exited_memory = 0;
+static ni_atomic int shards_active = 0;    /* Written with shards_mutex held. */
+pthread_mutex_t shards_active_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread ni_malloc_shard *tls_shard = NULL;
+
+/* Memory charged to the tags. Threads keep the figures of every tag in
+ * their shard and fold them here like they do with used_memory. Threads
+ * fold different tags at the same time, so every tag has its own line. */
+typedef struct ni_malloc_tag {
+    ni_atomic size_t    bytes;
+    pthread_mutex_t     bytes_mutex;    /* Only used by the mutex backend. */
+    ni_atomic size_t    count;
+    pthread_mutex_t     count_mutex;
+    const char          *name;
+} NI_CACHE_ALIGNED ni_malloc_tag;
+
+static ni_malloc_tag mem_tags[NI_MEM_TAGS] = {
+    [NI_MEM_LIST] = { .name = "list" },
+    [NI_MEM_STRING] = { .name = "string" },
+    [NI_MEM_ARENA] = { .name = "arena" },
+};
+static int mem_tags_used = NI_MEM_USER;
+static pthread_mutex_t mem_tags_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mem_tags_once = PTHREAD_ONCE_INIT;
+
+static void ni_malloc_tags_init(void) {
+    int j;
+    for (j = 0; j < NI_MEM_TAGS; j++) {
+        pthread_mutex_init(&mem_tags[j].bytes_mutex, NULL);
+        pthread_mutex_init(&mem_tags[j].count_mutex, NULL);
+    }
+}
+
+/* Move the figures of the tag 'tag' of 'shard' into mem_tags. */
+static void ni_malloc_tag_fold(ni_malloc_shard *shard, int tag) {
+    pthread_once(&mem_tags_once, ni_malloc_tags_init);
+    atomicIncr(mem_tags[tag].bytes, shard->tag_bytes[tag]);
+    atomicIncr(mem_tags[tag].count, shard->tag_count[tag]);
+    shard->tag_bytes[tag] = 0;
+    shard->tag_count[tag] = 0;
+}
+
+/* Move the unfolded part of 'shard' into used_memory and mem_tags,
+ * returning the new value of used_memory. */
+static size_t ni_malloc_shard_fold(ni_malloc_shard *shard) {
+    size_t used, total;
+    int j;
+
+    atomicGet(shard->used, used);
+    atomicGetIncr(used_memory, total, used - shard->folded);
+    total += used - shard->folded;
+    shard->folded = used;
+    for (j = 0; j < NI_MEM_TAGS; j++)
+        if (shard->tag_bytes[j] || shard->tag_count[j])
+            ni_malloc_tag_fold(shard, j);
+    return total;
+}
+
+/* Thread exit destructor: retire the shard of the exiting thread. */
+static void ni_malloc_shard_release(void *ptr) {
+    ni_malloc_shard *shard = ptr;
+    size_t used;
+
+    pthread_mutex_lock(&shards_mutex);
+    ni_malloc_shard_fold(shard);
+    atomicGet(shard->used, used);
+    exited_memory += used;
+    atomicSet(shard->used, 0);
+    shard->folded = 0;
+    shard->in_use = 0;
+    atomicDecr(shards_active, 1);
+    pthread_mutex_unlock(&shards_mutex);
+    tls_shard = NULL;
+}
+
+static void ni_malloc_shard_key_create(void) {
+    pthread_key_create(&shard_key, ni_malloc_shard_release);
+}
+
+static int ni_malloc_hard_limit_set(void);
+
+/* Bind a shard to the calling thread, reusing the one of an exited thread
+ * if possible. Shards are allocated with the libc allocator directly since
+ * they must not be accounted themselves. */
+static ni_malloc_shard *ni_malloc_shard_create(void) {
+    ni_malloc_shard *shard;
+    void *ptr;
+
+    pthread_once(&shard_key_once, ni_malloc_shard_key_create);
+    pthread_mutex_lock(&shards_mutex);
+    for (shard = shards; shard != NULL; shard = shard->next)
+        if (!shard->in_use) break;
+    if (shard == NULL) {
+        if (posix_memalign(&ptr, NI_CACHE_LINE, sizeof(*shard)) != 0) {
+            pthread_mutex_unlock(&shards_mutex);
+            fprintf(stderr, "ni_malloc: Out of memory creating the stats shard.\n");
+            abort();
+        }
+        shard = ptr;
+        memset(shard, 0, sizeof(*shard));
+        pthread_mutex_init(&shard->used_mutex, NULL);
+        pthread_mutex_init(&shard->check_limit_mutex, NULL);
+        shard->next = shards;
+        shards = shard;
+    }
+    shard->in_use = 1;
+    atomicIncr(shards_active, 1);
+    atomicSet(shard->check_limit, ni_malloc_hard_limit_set());
+    pthread_mutex_unlock(&shards_mutex);
+    pthread_setspecific(shard_key, shard);
+    tls_shard = shard;
+    return shard;
+}
+
+/* Add 'delta' (that is a negative number in two's complement when freeing)
+ * to the calling thread shard. Only the owner thread writes its shard, so a
+ * relaxed load plus a relaxed store is enough: no read-modify-write on a
+ * shared cache line is needed. */
+static void ni_malloc_check_soft_limit(size_t used);
+
+static inline void ni_malloc_stat_update(size_t delta) {
+    ni_malloc_shard *shard = tls_shard;
+    size_t used;
+
+    if (shard == NULL) shard = ni_malloc_shard_create();
+    atomicGet(shard->used, used);
+    used += delta;
+    atomicSet(shard->used, used);
+    if (used - shard->folded + NI_MALLOC_STAT_FOLD > 2*NI_MALLOC_STAT_FOLD) {
+        size_t total = ni_malloc_shard_fold(shard);
+        /* Only growing memory can cross the soft limit. */
+        if (delta < (size_t)-1/2) ni_malloc_check_soft_limit(total);
+    }
+}
+
+/* Charge 'bytes' and 'count' objects (negative numbers in two's complement
+ * when freeing) to the tag 'tag' in the calling thread shard, folding them
+ * into mem_tags once they drifted like ni_malloc_stat_update() does. */
+static inline void ni_malloc_tag_update(int tag, size_t bytes, size_t count) {
+    ni_malloc_shard *shard = tls_shard;
+
+    if (shard == NULL) shard = ni_malloc_shard_create();
+    shard->tag_bytes[tag] += bytes;
+    shard->tag_count[tag] += count;
+    if (shard->tag_bytes[tag] + NI_MALLOC_STAT_FOLD > 2*NI_MALLOC_STAT_FOLD ||
+        shard->tag_count[tag] + NI_MALLOC_TAG_COUNT_FOLD > 2*NI_MALLOC_TAG_COUNT_FOLD)
+        ni_malloc_tag_fold(shard, tag);
+}
+
+/* Register a new tag named 'name', that must stay valid as long as the tag
+ * is used.
+ *
+ * On error, -1 is returned since all the NI_MEM_TAGS tags are in use.
+ * Otherwise the new tag. */
+int ni_malloc_register_tag(const char *name) {
+    int tag = -1;
+
+    pthread_mutex_lock(&mem_tags_lock);
+    if (mem_tags_used < NI_MEM_TAGS) {
+        tag = mem_tags_used;
+        mem_tags[tag].name = name;
+        mem_tags_used++;
+    }
+    pthread_mutex_unlock(&mem_tags_lock);
+    return tag;
+}
+
+/* Return the name of 'tag', or NULL if it is not registered. */
+const char *ni_malloc_tag_name(int tag) {
+    const char *name = NULL;
+
+    pthread_mutex_lock(&mem_tags_lock);
+    if (tag >= 0 && tag < mem_tags_used) name = mem_tags[tag].name;
+    pthread_mutex_unlock(&mem_tags_lock);
+    return name;
+}
+
+/* Store in '*bytes' and '*count' the memory and the number of objects
+ * charged to 'tag'. The figures of the calling thread are exact, every
+ * other thread may not have folded up to NI_MALLOC_STAT_FOLD bytes and
+ * NI_MALLOC_TAG_COUNT_FOLD objects yet.
+ *
+ * On error, -1 is returned since 'tag' is not registered. Otherwise 0. */
+int ni_malloc_get_tag_stats(int tag, size_t *bytes, size_t *count) {
+    if (tag < 0 || tag >= NI_MEM_TAGS || ni_malloc_tag_name(tag) == NULL)
+        return -1;
+    if (tls_shard) ni_malloc_tag_fold(tls_shard, tag);
+    pthread_once(&mem_tags_once, ni_malloc_tags_init);
+    atomicGet(mem_tags[tag].bytes, *bytes);
+    atomicGet(mem_tags[tag].count, *count);
+    return 0;
+}
+
+/* ------------------------------ Memory limits ------------------------------
+ *
+ * A soft and a hard limit can be set on used_memory. Every time a thread
+ * folds its shard while growing memory above the soft limit, the registered
+ * reclaim callbacks are called with the amount of bytes above the limit, so
+ * that they can drop caches, trim free space and so forth. Allocations that
+ * would go over the hard limit call the callbacks too, and fail returning
+ * NULL if not enough memory was reclaimed.
+ *
+ * The soft limit is checked with the approximate used memory, so it is
+ * accurate to NI_MALLOC_STAT_FOLD bytes per thread. The hard limit check
+ * adds the bytes the calling thread did not fold yet to the approximate
+ * figure, and only sums the exact one when this is closer to the limit than
+ * NI_MALLOC_STAT_FOLD bytes for every other running thread, so far from the
+ * limit it does not write any shared counter. Whether a hard limit is set is a
+ * flag in the shard of every thread, that ni_malloc_set_limits() updates in
+ * all the shards: without a hard limit the allocation path only reads this
+ * flag from the shard of the thread, and a new hard limit applies to the
+ * next allocation of every thread.
+ *
+ * Callbacks run in the thread crossing the limit, inside the allocation that
+ * crossed it, and are serialized: they must not touch
+ * data structures the calling code may be in the middle of updating. Memory
+ * allocated or freed by the callbacks does not trigger them again. */
+#define NI_MALLOC_MAX_RECLAIM   16
+
+static ni_atomic size_t soft_limit = 0;
+pthread_mutex_t soft_limit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ni_atomic size_t hard_limit = 0;
+pthread_mutex_t hard_limit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int tls_in_reclaim = 0;
+
+static struct {
+    ni_malloc_reclaim_proc  proc;
+    void                    *privdata;
+} reclaim_procs[NI_MALLOC_MAX_RECLAIM];
+static int reclaim_count = 0;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Call the reclaim callbacks, in registration order, until 'bytes' bytes
+ * are reported as freed. Does nothing if the callbacks are already running
+ * in this or in another thread. */
+static void ni_malloc_reclaim(size_t bytes) {
+    int j;
+
+    if (tls_in_reclaim || pthread_mutex_trylock(&reclaim_lock) != 0)
+        return;
+    tls_in_reclaim = 1;
+    for (j = 0; j < reclaim_count && bytes; j++) {
+        size_t freed = reclaim_procs[j].proc(bytes, reclaim_procs[j].privdata);
+        bytes = freed >= bytes ? 0 : bytes - freed;
+    }
+    tls_in_reclaim = 0;
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+static void ni_malloc_check_soft_limit(size_t used) {
+    size_t soft;
+
+    atomicGet(soft_limit, soft);
+    if (soft && used > soft) ni_malloc_reclaim(used - soft);
+}
+
+/* Return 1 if a hard limit is set, the value of the flag of new shards. */
+static int ni_malloc_hard_limit_set(void) {
+    size_t hard;
+
+    atomicGet(hard_limit, hard);
+    return hard != 0;
+}
+
+/* Return 1 if allocating 'size' more bytes would exceed the hard limit even
+ * after calling the reclaim callbacks, otherwise 0. Called by threads that
+ * have a shard. */
+static int ni_malloc_check_hard_limit(size_t size) {
+    ni_malloc_shard *shard = tls_shard;
+    size_t hard, used, own;
+    int threads;
+
+    atomicGet(hard_limit, hard);
+    if (hard == 0) return 0;
+    if (size > hard) return 1;
+    atomicGet(shard->used, own);
+    atomicGet(shards_active, threads);
+    used = ni_malloc_used_memory_approx() + (own - shard->folded);
+    if (threads > 1) used += (size_t)(threads - 1) * NI_MALLOC_STAT_FOLD;
+    if (used <= hard - size) return 0;
+
+    /* Close to the limit: the unfolded bytes of the other threads matter. */
+    used = ni_malloc_used_memory();
+    if (used <= hard - size) return 0;
+    ni_malloc_reclaim(used - (hard - size));
+    return ni_malloc_used_memory() > hard - size;
+}
+
+/* Return 1 if an allocation of 'size' bytes must fail because of the hard
+ * limit. Without a hard limit only the flag in the shard of the calling
+ * thread is read. */
+static inline int ni_malloc_limit_reached(size_t size) {
+    ni_malloc_shard *shard = tls_shard;
+    int check;
+
+    if (shard == NULL) shard = ni_malloc_shard_create();
+    atomicGet(shard->check_limit, check);
+    return check && ni_malloc_check_hard_limit(size);
+}
+
+/* Set the soft and the hard limit of used memory in bytes, zero meaning no
+ * limit. The flag telling whether a hard limit is set is updated in the
+ * shards of all the threads, holding the registry lock so that shards
+ * created meanwhile see the new limit too. */
+void ni_malloc_set_limits(size_t soft, size_t hard) {
+    ni_malloc_shard *shard;
+
+    pthread_mutex_lock(&shards_mutex);
+    atomicSet(soft_limit, soft);
+    atomicSet(hard_limit, hard);
+    for (shard = shards; shard != NULL; shard = shard->next)
+        atomicSet(shard->check_limit, hard != 0);
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+void ni_malloc_get_limits(size_t *soft, size_t *hard) {
+    atomicGet(soft_limit, *soft);
+    atomicGet(hard_limit, *hard);
+}
+
+/* Register 'proc' to be called with 'privdata' when memory goes above the
+ * soft limit, or an allocation would go above the hard limit. The callback
+ * receives the number of bytes to reclaim and returns the number of bytes
+ * it freed, so that the next callbacks are skipped once enough memory was
+ * reclaimed.
+ *
+ * Returns 0 on success, -1 if too many callbacks are registered. */
+int ni_malloc_add_reclaim_callback(ni_malloc_reclaim_proc proc, void *privdata) {
+    int retval = -1;
+
+    pthread_mutex_lock(&reclaim_lock);
+    if (reclaim_count < NI_MALLOC_MAX_RECLAIM) {
+        reclaim_procs[reclaim_count].proc = proc;
+        reclaim_procs[reclaim_count].privdata = privdata;
+        reclaim_count++;
+        retval = 0;
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+    return retval;
+}
+
+/* Unregister a callback registered with the same 'proc' and 'privdata'. */
+void ni_malloc_remove_reclaim_callback(ni_malloc_reclaim_proc proc, void *privdata) {
+    int j;
+
+    pthread_mutex_lock(&reclaim_lock);
+    for (j = 0; j < reclaim_count; j++) {
+        if (reclaim_procs[j].proc == proc && reclaim_procs[j].privdata == privdata) {
+            memmove(&reclaim_procs[j], &reclaim_procs[j+1],
+                    sizeof(reclaim_procs[0]) * (reclaim_count - j - 1));
+            reclaim_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+/* ------------------------------ Heap profiler ------------------------------
+ *
+ * When enabled with ni_malloc_profile_start(), one allocation every
+ * 'sample_bytes' bytes on average is sampled: its backtrace is captured and
+ * the sample is kept until the allocation is freed, so that a dump shows
+ * which call sites own the live memory. As in tcmalloc, the distance in
+ * bytes between two samples is drawn from an exponential distribution,
+ * which makes the probability of sampling an allocation proportional to its
+ * size and the estimate unbiased.
+ *
+ * Every thread counts down the bytes to its next sample in a thread local
+ * variable, so with the profiler disabled allocations only pay a subtraction
+ * and a branch that is never taken, plus a check of the profiler state every
+ * NI_PROFILE_RECHECK bytes. Frees test a flag that is only written when the
+ * profiler is started or stopped. While profiling, a counting filter indexed
+ * by address tells the frees that can't be of sampled allocations, so only
+ * the others take the profiler lock. */
+#define NI_PROFILE_MAX_DEPTH    32
+#define NI_PROFILE_BUCKETS      65536
+#define NI_PROFILE_RECHECK      (1024*1024)
+#define NI_PROFILE_DEFAULT_RATE (512*1024)
+
+typedef struct ni_profile_sample {
+    struct ni_profile_sample    *next;
+    void                        *ptr;
+    size_t                      size;
+    int                         depth;
+    void                        *stack[NI_PROFILE_MAX_DEPTH];
+} ni_profile_sample;
+
+static ni_atomic int profile_enabled = 0;  /* Written with profile_lock held. */
+pthread_mutex_t profile_enabled_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t profile_rate = 0;
+static size_t profile_samples = 0;
+static ni_profile_sample **profile_table = NULL;
+/* Number of samples per bucket. Written with profile_lock held, read by the
+ * frees without it: a sample is inserted before ni_malloc() returns the
+ * pointer, so the free of that pointer can't miss it. */
+static uint16_t *profile_filter = NULL;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread long tls_profile_left = 0;
+static __thread uint64_t tls_profile_seed = 0;
+
+#define ni_profile_bucket(p) ((((uintptr_t)(p)) >> 4) * 11400714819323198485ULL >> 48)
+
+#define ni_malloc_profile_alloc(ptr,size) do { \
+    if ((tls_profile_left -= (long)(size)) < 0) \
+        ni_malloc_profile_sample(ptr, size); \
 } while(0)
 
-static size_t used_memory = 0;
-pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define ni_malloc_profile_free(ptr) do { \
+    int _enabled; \
+    atomicGet(profile_enabled, _enabled); \
+    if (_enabled) ni_malloc_profile_forget(ptr); \
+} while(0)
+
+/* Return the bytes to the next sample, exponentially distributed with mean
+ * 'rate'. */
+static long ni_malloc_profile_next(size_t rate) {
+    uint64_t x = tls_profile_seed;
+    double u;
+
+    if (x == 0) x = (uintptr_t)&tls_profile_seed ^ (uint64_t)time(NULL) ^ 0x9e3779b97f4a7c15ULL;
+    x ^= x >> 12; x ^= x << 25; x ^= x >> 27;
+    tls_profile_seed = x;
+    u = ((x * 2685821657736338717ULL) >> 11) * (1.0/9007199254740992.0);
+    return (long)(-log(1.0 - u) * rate) + 1;
+}
+
+static void ni_malloc_profile_sample(void *ptr, size_t size) {
+    ni_profile_sample *s;
+    int enabled;
+
+    atomicGet(profile_enabled, enabled);
+    if (!enabled) {
+        tls_profile_left = NI_PROFILE_RECHECK;
+        return;
+    }
+    tls_profile_left = ni_malloc_profile_next(profile_rate);
+    if (ptr == NULL || (s = malloc(sizeof(*s))) == NULL) return;
+    s->ptr = ptr;
+    s->size = size;
+#if defined(__GLIBC__)
+    {
+        /* Skip this function. */
+        void *stack[NI_PROFILE_MAX_DEPTH+1];
+        int depth = backtrace(stack, NI_PROFILE_MAX_DEPTH+1);
+        s->depth = depth > 1 ? depth - 1 : 0;
+        memcpy(s->stack, stack + 1, sizeof(void*) * s->depth);
+    }
+#else
+    s->depth = 0;
+#endif
+    pthread_mutex_lock(&profile_lock);
+    if (profile_enabled) {
+        uintptr_t b = ni_profile_bucket(ptr);
+        s->next = profile_table[b];
+        profile_table[b] = s;
+        profile_filter[b]++;
+        profile_samples++;
+        s = NULL;
+    }
+    pthread_mutex_unlock(&profile_lock);
+    free(s);
+}
+
+static void ni_malloc_profile_forget(void *ptr) {
+    ni_profile_sample **prev, *s = NULL;
+    uintptr_t b = ni_profile_bucket(ptr);
+
+    if (profile_filter == NULL || profile_filter[b] == 0) return;
+    pthread_mutex_lock(&profile_lock);
+    if (profile_table) {
+        for (prev = &profile_table[b]; *prev; prev = &(*prev)->next) {
+            if ((*prev)->ptr == ptr) {
+                s = *prev;
+                *prev = s->next;
+                profile_filter[b]--;
+                profile_samples--;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+    free(s);
+}
+
+/* Start sampling one allocation every 'sample_bytes' bytes on average, or
+ * every NI_PROFILE_DEFAULT_RATE bytes if zero is passed. Other threads
+ * notice within NI_PROFILE_RECHECK allocated bytes. Calling it again while
+ * profiling changes the rate and keeps the samples.
+ *
+ * Returns 0 on success, -1 on out of memory. */
+int ni_malloc_profile_start(size_t sample_bytes) {
+    pthread_mutex_lock(&profile_lock);
+    if (profile_table == NULL) {
+        /* Never freed: frees may look at them after the profiler stops. */
+        profile_table = calloc(NI_PROFILE_BUCKETS, sizeof(*profile_table));
+        profile_filter = calloc(NI_PROFILE_BUCKETS, sizeof(*profile_filter));
+        if (profile_table == NULL || profile_filter == NULL) {
+            free(profile_table);
+            free(profile_filter);
+            profile_table = NULL;
+            profile_filter = NULL;
+            pthread_mutex_unlock(&profile_lock);
+            return -1;
+        }
+    }
+    profile_rate = sample_bytes ? sample_bytes : NI_PROFILE_DEFAULT_RATE;
+    atomicSet(profile_enabled, 1);
+    pthread_mutex_unlock(&profile_lock);
+    tls_profile_left = ni_malloc_profile_next(profile_rate);
+    return 0;
+}
+
+/* Stop sampling and drop all the samples. */
+void ni_malloc_profile_stop(void) {
+    ni_profile_sample *s, *next;
+    int j;
+
+    pthread_mutex_lock(&profile_lock);
+    atomicSet(profile_enabled, 0);
+    for (j = 0; profile_table && j < NI_PROFILE_BUCKETS; j++) {
+        for (s = profile_table[j]; s; s = next) {
+            next = s->next;
+            free(s);
+        }
+        profile_table[j] = NULL;
+        profile_filter[j] = 0;
+    }
+    profile_samples = 0;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static int ni_malloc_profile_stack_cmp(const void *a, const void *b) {
+    const ni_profile_sample *x = a, *y = b;
+    if (x->depth != y->depth) return x->depth - y->depth;
+    return memcmp(x->stack, y->stack, sizeof(void*) * x->depth);
+}
+
+/* Write the name of the function of a backtrace_symbols() entry, that looks
+ * like "binary(function+0x1f) [0x4005d4]", or its address if the symbol is
+ * not known (static functions, or the binary not linked with -rdynamic). */
+static void ni_malloc_profile_write_frame(FILE *fp, const char *sym, void *addr) {
+    const char *start = sym ? strchr(sym, '(') : NULL, *end;
+
+    if (start && (end = strpbrk(start + 1, "+)")) != NULL && end > start + 1)
+        fprintf(fp, "%.*s", (int)(end - start - 1), start + 1);
+    else
+        fprintf(fp, "%p", addr);
+}
+
+/* Write the live samples to 'fp' grouped by call stack:
+ *
+ * NI_MALLOC_PROFILE_PPROF: the legacy heap profile text format read by
+ *   pprof ("heap profile: ... @ heap_v2/<rate>"), with raw sample counts
+ *   and sizes that pprof scales itself, followed by the memory mappings
+ *   needed to symbolize the addresses.
+ * NI_MALLOC_PROFILE_FOLDED: one "outer;...;inner bytes" line per stack, as
+ *   read by flamegraph.pl, with the bytes estimated from the samples.
+ *
+ * Returns 0 on success, -1 on error. */
+int ni_malloc_profile_dump(FILE *fp, int format) {
+    ni_profile_sample *samples, *s;
+    size_t count = 0, rate, i, j, k;
+    size_t total_count = 0, total_bytes = 0;
+
+    pthread_mutex_lock(&profile_lock);
+    rate = profile_rate;
+    samples = malloc(sizeof(*samples) * (profile_samples ? profile_samples : 1));
+    if (samples == NULL) {
+        pthread_mutex_unlock(&profile_lock);
+        return -1;
+    }
+    for (j = 0; profile_table && j < NI_PROFILE_BUCKETS; j++)
+        for (s = profile_table[j]; s; s = s->next)
+            samples[count++] = *s;
+    pthread_mutex_unlock(&profile_lock);
+
+    qsort(samples, count, sizeof(*samples), ni_malloc_profile_stack_cmp);
+    for (i = 0; i < count; i++) {
+        total_count++;
+        total_bytes += samples[i].size;
+    }
+    if (format == NI_MALLOC_PROFILE_PPROF)
+        fprintf(fp, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            total_count, total_bytes, total_count, total_bytes, rate);
+
+    for (i = 0; i < count; i = j) {
+        size_t objs = 0, bytes = 0;
+        double estimate = 0;
+
+        for (j = i; j < count &&
+             ni_malloc_profile_stack_cmp(&samples[i], &samples[j]) == 0; j++) {
+            objs++;
+            bytes += samples[j].size;
+            estimate += samples[j].size /
+                        (1 - exp(-(double)samples[j].size / rate));
+        }
+        if (format == NI_MALLOC_PROFILE_PPROF) {
+            fprintf(fp, "%zu: %zu [%zu: %zu] @", objs, bytes, objs, bytes);
+            for (k = 0; k < (size_t)samples[i].depth; k++)
+                fprintf(fp, " %p", samples[i].stack[k]);
+            fprintf(fp, "\n");
+        } else {
+            char **syms = NULL;
+#if defined(__GLIBC__)
+            syms = backtrace_symbols(samples[i].stack, samples[i].depth);
+#endif
+            for (k = samples[i].depth; k > 0; k--) {
+                ni_malloc_profile_write_frame(fp, syms ? syms[k-1] : NULL,
+                                              samples[i].stack[k-1]);
+                if (k > 1) fputc(';', fp);
+            }
+            if (samples[i].depth == 0) fprintf(fp, "[unknown]");
+            fprintf(fp, " %.0f\n", estimate);
+            free(syms);
+        }
+    }
+    free(samples);
+
+    if (format == NI_MALLOC_PROFILE_PPROF) {
+        FILE *maps = fopen("/proc/self/maps", "r");
+        char line[1024];
+
+        fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+        while (maps && fgets(line, sizeof(line), maps) != NULL)
+            fputs(line, fp);
+        if (maps) fclose(maps);
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+/* ------------------------------ Slab layer --------------------------------
+ *
+ * Small allocations (up to NI_SLAB_MAX_SIZE bytes) can be served by an opt-in
+ * slab allocator, enabled with ni_malloc_enable_slab(). Requests are rounded
+ * up to a size class and carved from NI_SLAB_SIZE bytes slabs that only hold
+ * objects of that class, so there is no per-object header and no call to
+ * malloc_usable_size(): the usable size of an object is the size of its class.
+ *
+ * All the slabs live in a single virtual region reserved at enable time, so
+ * telling a slab object from a libc one is a range check. Every slab starts
+ * with an ni_slab header, found by masking the object address. The classes
+ * are multiples of 16 bytes, so objects are aligned to 16 bytes like the
+ * blocks of malloc() on 64 bit systems.
+ *
+ * Slabs with free objects are linked in the 'partial' list of their class.
+ * When a slab becomes completely free and it is not the only partial slab of
+ * its class, it goes back to the region as a dirty slab, ready to be reused
+ * by any class. Once NI_SLAB_DIRTY_MAX slabs are dirty their pages are
+ * returned to the OS in a single pass, coalescing adjacent slabs so that
+ * releasing a large structure costs a few madvise() calls and not one per
+ * slab. */
+#define NI_SLAB_SIZE            4096
+#define NI_SLAB_MAX_SIZE        256
+#define NI_SLAB_CLASSES         16
+#if UINTPTR_MAX > 0xffffffffUL
+#define NI_SLAB_REGION_SIZE     (64ULL*1024*1024*1024)
+#else
+#define NI_SLAB_REGION_SIZE     (256UL*1024*1024)
+#endif
+#define NI_SLAB_REGION_MIN      (64UL*1024*1024)
+#define NI_SLAB_DIRTY_MAX       1024
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+typedef struct ni_slab {
+    void            *free;      /* List of freed objects. */
+    char            *bump;      /* First never used object. */
+    struct ni_slab  *prev;      /* Links in the class partial list. */
+    struct ni_slab  *next;
+    uint16_t        inuse;      /* Objects currently allocated. */
+    uint16_t        nobjs;      /* Objects fitting in this slab. */
+    uint8_t         cls;        /* Size class index. */
+    uint8_t         partial;    /* True if linked in the partial list. */
+} ni_slab;
+
+#define NI_SLAB_HDR_SIZE        ((sizeof(ni_slab)+15) & ~((size_t)15))
+
+typedef struct ni_slab_class {
+    size_t          size;       /* Object size of this class. */
+    ni_slab         *partial;   /* Slabs having free objects. */
+    size_t          slabs;      /* Number of slabs owned by the class. */
+    size_t          objs;       /* Objects out of the slabs, thread caches
+                                 * included. */
+    pthread_mutex_t lock;
+} ni_slab_class;
+
+static const size_t slab_class_size[NI_SLAB_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256
+};
+static ni_slab_class slab_classes[NI_SLAB_CLASSES];
+
+static int slab_enabled = 0;
+static char *slab_base = NULL;      /* Reserved region. */
+static char *slab_end = NULL;
+static char *slab_top = NULL;       /* First never used slab of the region. */
+static ni_slab *slab_free = NULL;   /* Purged slabs, linked by 'next'. */
+static ni_slab *slab_dirty[NI_SLAB_DIRTY_MAX]; /* Free but still resident. */
+static int slab_dirty_count = 0;
+static int slab_release_pages = 0;  /* madvise() works on a single slab. */
+static pthread_mutex_t slab_region_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ni_slab_owns(p) ((char*)(p) >= slab_base && (char*)(p) < slab_end)
+#define ni_slab_of(p) ((ni_slab*)((uintptr_t)(p) & ~((uintptr_t)NI_SLAB_SIZE-1)))
+
+/* Return the smallest class able to hold 'size' bytes. */
+static inline int ni_slab_class_of(size_t size) {
+    return size ? (int)((size - 1) >> 4) : 0;
+}
+
+/* Reserve the slab region and setup the size classes. Returns 0 on success,
+ * -1 if no region could be reserved. */
+static int ni_slab_init(void) {
+    size_t region = NI_SLAB_REGION_SIZE;
+    void *base = MAP_FAILED;
+    int j;
+
+    while (region >= NI_SLAB_REGION_MIN) {
+        base = mmap(NULL, region, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED) break;
+        region /= 2;
+    }
+    if (base == MAP_FAILED) return -1;
+
+    for (j = 0; j < NI_SLAB_CLASSES; j++) {
+        slab_classes[j].size = slab_class_size[j];
+        slab_classes[j].partial = NULL;
+        slab_classes[j].slabs = 0;
+        slab_classes[j].objs = 0;
+        pthread_mutex_init(&slab_classes[j].lock, NULL);
+    }
+    slab_release_pages = (sysconf(_SC_PAGESIZE) == NI_SLAB_SIZE);
+    /* The region must be slab aligned for ni_slab_of() to work. */
+    slab_top = (char*)(((uintptr_t)base + NI_SLAB_SIZE - 1) &
+                       ~((uintptr_t)NI_SLAB_SIZE - 1));
+    slab_end = (char*)base + region;
+    slab_base = base;
+    return 0;
+}
+
+/* Get a slab for the class 'cls' and link it as the only partial slab.
+ * Called with the class lock held. */
+static ni_slab *ni_slab_new(int cls) {
+    ni_slab_class *c = &slab_classes[cls];
+    ni_slab *slab;
+
+    pthread_mutex_lock(&slab_region_lock);
+    if (slab_dirty_count) {
+        slab = slab_dirty[--slab_dirty_count];
+    } else if (slab_free) {
+        slab = slab_free;
+        slab_free = slab->next;
+    } else if (slab_top + NI_SLAB_SIZE <= slab_end) {
+        slab = (ni_slab*)slab_top;
+        slab_top += NI_SLAB_SIZE;
+    } else {
+        slab = NULL;
+    }
+    pthread_mutex_unlock(&slab_region_lock);
+    if (slab == NULL) return NULL;
+
+    slab->free = NULL;
+    slab->bump = (char*)slab + NI_SLAB_HDR_SIZE;
+    slab->prev = slab->next = NULL;
+    slab->inuse = 0;
+    slab->nobjs = (NI_SLAB_SIZE - NI_SLAB_HDR_SIZE) / c->size;
+    slab->cls = cls;
+    slab->partial = 1;
+    c->partial = slab;
+    c->slabs++;
+    return slab;
+}
+
+static int ni_slab_addr_cmp(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(ni_slab* const*)a, y = (uintptr_t)*(ni_slab* const*)b;
+    return (x > y) - (x < y);
+}
+
+/* Return the pages of all the dirty slabs to the OS and move them to the
+ * free list. Called with the region lock held. */
+static void ni_slab_purge(void) {
+    int j, run = 0;
+
+    qsort(slab_dirty, slab_dirty_count, sizeof(ni_slab*), ni_slab_addr_cmp);
+    for (j = 0; j < slab_dirty_count; j++) {
+        ni_slab *slab = slab_dirty[j];
+        if (slab_release_pages && (j+1 == slab_dirty_count ||
+            (char*)slab + NI_SLAB_SIZE != (char*)slab_dirty[j+1]))
+        {
+            madvise(slab_dirty[run], (char*)slab + NI_SLAB_SIZE -
+                    (char*)slab_dirty[run], MADV_DONTNEED);
+            run = j+1;
+        }
+        slab->next = slab_free;
+        slab_free = slab;
+    }
+    slab_dirty_count = 0;
+}
+
+static void ni_slab_unlink(ni_slab_class *c, ni_slab *slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else c->partial = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->prev = slab->next = NULL;
+    slab->partial = 0;
+}
+
+/* Fill 'out' with up to 'n' objects of class 'cls' taking the class lock
+ * once. Returns the number of objects obtained, that is less than 'n' only
+ * if the region is exhausted. */
+static int ni_slab_alloc_batch(int cls, int n, void **out) {
+    ni_slab_class *c = &slab_classes[cls];
+    ni_slab *slab;
+    int j;
+
+    pthread_mutex_lock(&c->lock);
+    for (j = 0; j < n; j++) {
+        slab = c->partial;
+        if (slab == NULL && (slab = ni_slab_new(cls)) == NULL) break;
+        if (slab->free) {
+            out[j] = slab->free;
+            slab->free = *(void**)out[j];
+        } else {
+            out[j] = slab->bump;
+            slab->bump += c->size;
+        }
+        if (++slab->inuse == slab->nobjs) ni_slab_unlink(c, slab);
+    }
+    c->objs += j;
+    pthread_mutex_unlock(&c->lock);
+    return j;
+}
+
+/* Give back 'n' objects of class 'cls' to their slabs taking the class lock
+ * once. */
+static void ni_slab_free_batch(int cls, void **ptrs, int n) {
+    ni_slab_class *c = &slab_classes[cls];
+    int j;
+
+    pthread_mutex_lock(&c->lock);
+    for (j = 0; j < n; j++) {
+        ni_slab *slab = ni_slab_of(ptrs[j]);
+
+        *(void**)ptrs[j] = slab->free;
+        slab->free = ptrs[j];
+        slab->inuse--;
+        if (!slab->partial) {
+            slab->next = c->partial;
+            if (c->partial) c->partial->prev = slab;
+            c->partial = slab;
+            slab->partial = 1;
+        }
+        if (slab->inuse == 0 && (slab->prev || slab->next)) {
+            /* Keep a single empty slab per class, release the others. */
+            ni_slab_unlink(c, slab);
+            c->slabs--;
+            pthread_mutex_lock(&slab_region_lock);
+            if (slab_dirty_count == NI_SLAB_DIRTY_MAX) ni_slab_purge();
+            slab_dirty[slab_dirty_count++] = slab;
+            pthread_mutex_unlock(&slab_region_lock);
+        }
+    }
+    c->objs -= n;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* ------------------------- Thread local caches ----------------------------
+ *
+ * Every thread keeps a magazine of recently freed slab objects for each size
+ * class. ni_malloc() pops from it and ni_free() pushes to it without taking
+ * any lock: the shared slab classes are only touched to refill an empty
+ * magazine with NI_TCACHE_REFILL objects, or to flush the oldest half of a
+ * magazine once it reaches NI_TCACHE_HIGH objects, in both cases taking the
+ * class lock once for the whole batch. The cache of a thread is drained back
+ * to the slabs when the thread exits.
+ *
+ * Memory is accounted when ni_malloc() returns and when ni_free() is called,
+ * so objects sitting in a cache are not part of ni_malloc_used_memory(). */
+#define NI_TCACHE_HIGH          64
+#define NI_TCACHE_REFILL        (NI_TCACHE_HIGH/2)
+
+typedef struct ni_tcache_bin {
+    int     count;
+    void    *objs[NI_TCACHE_HIGH];
+} ni_tcache_bin;
+
+typedef struct ni_tcache {
+    ni_tcache_bin bins[NI_SLAB_CLASSES];
+} ni_tcache;
+
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static __thread ni_tcache *tls_tcache = NULL;
+
+/* Give back all the objects cached by the calling thread to the slabs. */
+void ni_malloc_tcache_flush(void) {
+    ni_tcache *tc = tls_tcache;
+    int cls;
+
+    if (tc == NULL) return;
+    for (cls = 0; cls < NI_SLAB_CLASSES; cls++) {
+        if (tc->bins[cls].count == 0) continue;
+        ni_slab_free_batch(cls, tc->bins[cls].objs, tc->bins[cls].count);
+        tc->bins[cls].count = 0;
+    }
+}
+
+/* Thread exit destructor: drain and release the cache of the thread. */
+static void ni_tcache_release(void *ptr) {
+    ni_malloc_tcache_flush();
+    tls_tcache = NULL;
+    free(ptr);
+}
+
+static void ni_tcache_key_create(void) {
+    pthread_key_create(&tcache_key, ni_tcache_release);
+}
+
+/* The cache itself is allocated with the libc allocator, it is not memory
+ * used by the program. */
+static ni_tcache *ni_tcache_create(void) {
+    ni_tcache *tc;
+
+    pthread_once(&tcache_key_once, ni_tcache_key_create);
+    if ((tc = calloc(1, sizeof(*tc))) == NULL) return NULL;
+    pthread_setspecific(tcache_key, tc);
+    tls_tcache = tc;
+    return tc;
+}
+
+/* Return an object of class 'cls', or NULL if the region is exhausted. */
+static inline void *ni_slab_alloc(int cls) {
+    ni_tcache *tc = tls_tcache;
+    ni_tcache_bin *bin;
+    void *ptr;
+
+    if (tc == NULL && (tc = ni_tcache_create()) == NULL) {
+        return ni_slab_alloc_batch(cls, 1, &ptr) ? ptr : NULL;
+    }
+    bin = &tc->bins[cls];
+    if (bin->count == 0) {
+        bin->count = ni_slab_alloc_batch(cls, NI_TCACHE_REFILL, bin->objs);
+        if (bin->count == 0) return NULL;
+    }
+    return bin->objs[--bin->count];
+}
+
+/* Return the object 'ptr' of class 'cls' to the thread cache. The class is
+ * passed by the caller, so the slab header is not touched unless the cache
+ * needs to be flushed. */
+static inline void ni_slab_free(void *ptr, int cls) {
+    ni_tcache *tc = tls_tcache;
+    ni_tcache_bin *bin;
+
+    if (tc == NULL && (tc = ni_tcache_create()) == NULL) {
+        ni_slab_free_batch(cls, &ptr, 1);
+        return;
+    }
+    bin = &tc->bins[cls];
+    if (bin->count == NI_TCACHE_HIGH) {
+        /* Flush the oldest half, the most recently freed objects are the
+         * ones more likely to be still in the CPU caches. */
+        ni_slab_free_batch(cls, bin->objs, NI_TCACHE_HIGH/2);
+        memmove(bin->objs, bin->objs + NI_TCACHE_HIGH/2,
+                sizeof(void*) * (NI_TCACHE_HIGH - NI_TCACHE_HIGH/2));
+        bin->count = NI_TCACHE_HIGH - NI_TCACHE_HIGH/2;
+    }
+    bin->objs[bin->count++] = ptr;
+}
+
+/* Enable or disable the slab layer for the next allocations. Objects already
+ * allocated from slabs can always be freed or reallocated, so this can be
+ * called at any time. Returns 0 on success, -1 if the slab region could not
+ * be reserved. */
+int ni_malloc_enable_slab(int enable) {
+    int retval = 0;
+
+    pthread_mutex_lock(&slab_region_lock);
+    if (enable && slab_base == NULL) retval = ni_slab_init();
+    if (retval == 0) slab_enabled = enable;
+    pthread_mutex_unlock(&slab_region_lock);
+    return retval;
+}
+
+/* ------------------------------ Huge blocks --------------------------------
+ *
+ * Allocations of at least 'huge_threshold' bytes are anonymous mappings of
+ * their own, so that growing them with ni_realloc() is a mremap() that
+ * moves the pages instead of copying the bytes, and freeing them gives the
+ * memory back to the system right away. Optionally the mappings are marked
+ * with MADV_HUGEPAGE.
+ *
+ * A huge block starts with a header of NI_HUGE_HDR_SIZE bytes, so the
+ * pointers handed out are always NI_HUGE_HDR_SIZE bytes past a page
+ * boundary. Pointers with this offset are looked up in a registry of the
+ * live huge blocks, all the others can't be huge and pay only the test of
+ * the offset. The usable bytes of a block are accounted in used_memory,
+ * like the libc blocks, so the accounting stays exact.
+ *
+ * The registry is a bitmap with a bit for every page of the address space,
+ * set for the first page of the live huge blocks. It is split in leaves of
+ * NI_HUGE_LEAF_PAGES bits, mapped the first time a block lands in their
+ * range and never unmapped, so a lookup takes no lock: it reads the leaf
+ * pointer and the word holding the bit. Only the writers take huge_lock,
+ * and never across mremap() or munmap(). A block is unregistered before its
+ * pages are unmapped or moved, so a libc block reusing them is never taken
+ * for a huge one. */
+#define NI_HUGE_HDR_SIZE        64
+#define NI_HUGE_ADDR_BITS       48
+#define NI_HUGE_LEAF_BITS       21
+#define NI_HUGE_LEAF_PAGES      (1UL << NI_HUGE_LEAF_BITS)
+#define NI_HUGE_LEAVES          (1UL << (NI_HUGE_ADDR_BITS - 12 - NI_HUGE_LEAF_BITS))
+#define NI_HUGE_WORD_BITS       (sizeof(unsigned long) * 8)
+#ifndef NI_MALLOC_HUGE_THRESHOLD
+#define NI_MALLOC_HUGE_THRESHOLD (1024*1024)
+#endif
+
+typedef struct ni_huge_block {
+    size_t                  len;    /* Bytes of the mapping, header included. */
+} ni_huge_block;
+
+static size_t huge_threshold = NI_MALLOC_HUGE_THRESHOLD;
+static int huge_thp = 0;            /* Mark the mappings MADV_HUGEPAGE. */
+static unsigned long *huge_map[NI_HUGE_LEAVES];
+static size_t huge_blocks = 0;      /* Blocks and bytes registered, */
+static size_t huge_mapped = 0;      /* written with huge_lock held. */
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ni_huge_of(p) ((ni_huge_block*)((char*)(p) - NI_HUGE_HDR_SIZE))
+#define ni_huge_owns(p) (((uintptr_t)(p) & 4095) == NI_HUGE_HDR_SIZE && \
+                         ni_huge_registered(p))
+#define ni_huge_usable(p) (ni_huge_of(p)->len - NI_HUGE_HDR_SIZE)
+
+/* Register 'b', with huge_lock held.
+ *
+ * On error, -1 is returned since the leaf covering 'b' can't be mapped or
+ * 'b' is out of the range of the bitmap. Otherwise 0. */
+static int ni_huge_link(ni_huge_block *b) {
+    uintptr_t page = (uintptr_t)b >> 12;
+    unsigned long **slot, *leaf, *word;
+
+    if (page >> (NI_HUGE_ADDR_BITS - 12)) return -1;
+    slot = &huge_map[page >> NI_HUGE_LEAF_BITS];
+    if ((leaf = *slot) == NULL) {
+        leaf = mmap(NULL, NI_HUGE_LEAF_PAGES / 8, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (leaf == MAP_FAILED) return -1;
+        ni_sync_store(slot, leaf);
+    }
+    page &= NI_HUGE_LEAF_PAGES - 1;
+    word = &leaf[page / NI_HUGE_WORD_BITS];
+    ni_sync_store(word, *word | (1UL << (page % NI_HUGE_WORD_BITS)));
+    huge_blocks++;
+    huge_mapped += b->len;
+    return 0;
+}
+
+/* Unregister 'b', with huge_lock held. */
+static void ni_huge_unlink(ni_huge_block *b) {
+    uintptr_t page = (uintptr_t)b >> 12;
+    unsigned long *leaf = huge_map[page >> NI_HUGE_LEAF_BITS], *word;
+
+    page &= NI_HUGE_LEAF_PAGES - 1;
+    word = &leaf[page / NI_HUGE_WORD_BITS];
+    ni_sync_store(word, *word & ~(1UL << (page % NI_HUGE_WORD_BITS)));
+    huge_blocks--;
+    huge_mapped -= b->len;
+}
+
+/* Return 1 if 'ptr', that is NI_HUGE_HDR_SIZE bytes past a page boundary,
+ * is a live huge block. */
+static inline int ni_huge_registered(void *ptr) {
+    uintptr_t page = (uintptr_t)ptr >> 12;
+    unsigned long *leaf;
+
+    if (page >> (NI_HUGE_ADDR_BITS - 12)) return 0;
+    if ((leaf = ni_sync_load(&huge_map[page >> NI_HUGE_LEAF_BITS])) == NULL)
+        return 0;
+    page &= NI_HUGE_LEAF_PAGES - 1;
+    return (ni_sync_load_relaxed(&leaf[page / NI_HUGE_WORD_BITS]) >>
+            (page % NI_HUGE_WORD_BITS)) & 1;
+}
+
+static size_t ni_huge_len(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len = size + NI_HUGE_HDR_SIZE;
+
+    if (len < size || len + page < len) return 0;
+    return (len + page - 1) & ~(page - 1);
+}
+
+static void ni_huge_advise(ni_huge_block *b) {
+#ifdef MADV_HUGEPAGE
+    if (huge_thp) madvise(b, b->len, MADV_HUGEPAGE);
+#else
+    ((void) b);
+#endif
+}
+
+/* Map a huge block for 'size' bytes, setting '*usable' to the bytes it can
+ * hold. Returns NULL if the mapping fails. The pages are zeroed. */
+static void *ni_huge_alloc(size_t size, size_t *usable) {
+    size_t len = ni_huge_len(size);
+    ni_huge_block *b;
+
+    if (len == 0) return NULL;
+    b = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) return NULL;
+    b->len = len;
+    pthread_mutex_lock(&huge_lock);
+    if (ni_huge_link(b) == -1) {
+        pthread_mutex_unlock(&huge_lock);
+        munmap(b, len);
+        return NULL;
+    }
+    pthread_mutex_unlock(&huge_lock);
+    ni_huge_advise(b);
+    *usable = len - NI_HUGE_HDR_SIZE;
+    return (char*)b + NI_HUGE_HDR_SIZE;
+}
+
+/* Resize the huge block 'ptr' to hold 'size' bytes, moving its pages with
+ * mremap() where available. On success '*usable' is set to the bytes the
+ * new block can hold. Returns NULL, leaving the block untouched, if it
+ * can't be resized. */
+static void *ni_huge_realloc(void *ptr, size_t size, size_t *usable) {
+    ni_huge_block *b = ni_huge_of(ptr), *newb;
+    size_t len = ni_huge_len(size);
+    int failed;
+
+    if (len == 0) return NULL;
+    if (len == b->len) {
+        *usable = len - NI_HUGE_HDR_SIZE;
+        return ptr;
+    }
+    /* The block belongs to the caller, so it can leave the registry while
+     * its pages move without holding the lock. */
+    pthread_mutex_lock(&huge_lock);
+    ni_huge_unlink(b);
+    pthread_mutex_unlock(&huge_lock);
+#ifdef MREMAP_MAYMOVE
+    newb = mremap(b, b->len, len, MREMAP_MAYMOVE);
+#else
+    newb = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (newb != MAP_FAILED) {
+        memcpy(newb, b, b->len < len ? b->len : len);
+        munmap(b, b->len);
+    }
+#endif
+    if ((failed = newb == MAP_FAILED)) newb = b;
+    else newb->len = len;
+    pthread_mutex_lock(&huge_lock);
+    if (ni_huge_link(newb) == -1) {
+        /* The pages moved to a range whose leaf can't be mapped, and the
+         * caller's pointer is gone: nothing sane is left to do. */
+        fprintf(stderr, "ni_malloc: can't register a huge block of %zu bytes.\n", len);
+        abort();
+    }
+    pthread_mutex_unlock(&huge_lock);
+    if (failed) return NULL;
+    ni_huge_advise(newb);
+    *usable = len - NI_HUGE_HDR_SIZE;
+    return (char*)newb + NI_HUGE_HDR_SIZE;
+}
+
+/* Unmap the huge block 'ptr', returning the bytes it could hold. */
+static size_t ni_huge_free(void *ptr) {
+    ni_huge_block *b = ni_huge_of(ptr);
+    size_t len = b->len;
+
+    pthread_mutex_lock(&huge_lock);
+    ni_huge_unlink(b);
+    pthread_mutex_unlock(&huge_lock);
+    munmap(b, len);
+    return len - NI_HUGE_HDR_SIZE;
+}
+
+/* Serve allocations of at least 'threshold' bytes with huge blocks, marking
+ * them MADV_HUGEPAGE if 'thp' is true. A zero 'threshold' disables huge
+ * blocks for the next allocations, the live ones keep working. */
+void ni_malloc_set_huge(size_t threshold, int thp) {
+    huge_threshold = threshold ? threshold : (size_t)-1;
+    huge_thp = thp;
+}
+
+/* ----------------------------- Size classes --------------------------------
+ *
+ * Every allocation and free updates the counters of its size class in the
+ * shard of the calling thread, with the requested size as well as the
+ * usable one, so the internal slack of every class is known. The classes
+ * are the ones of the slab layer, so slab objects are counted using their
+ * class directly, then powers of two for the sizes only libc serves.
+ * Shards are never freed, so summing all of them gives the figures of the
+ * whole process. */
+#define ni_malloc_hist_alloc(class,req,use) do { \
+    ni_malloc_hist *_h = &tls_shard->hist[class]; \
+    _h->live_objects++; \
+    _h->live_bytes += (use); \
+    _h->allocs++; \
+    _h->requested += (req); \
+    _h->usable += (use); \
+} while(0)
+
+#define ni_malloc_hist_free(class,use) do { \
+    ni_malloc_hist *_h = &tls_shard->hist[class]; \
+    _h->live_objects--; \
+    _h->live_bytes -= (use); \
+} while(0)
+
+/* Return the size class of a block of 'usable' bytes. The first classes
+ * match slab_class_size[]. */
+static inline int ni_malloc_hist_class(size_t usable) {
+    int class;
+
+    if (usable <= NI_SLAB_MAX_SIZE) return ni_slab_class_of(usable);
+    class = NI_SLAB_CLASSES + (int)(sizeof(long)*8 - 1 - __builtin_clzl(usable - 1)) - 8;
+    return class < NI_MALLOC_SIZE_CLASSES ? class : NI_MALLOC_SIZE_CLASSES - 1;
+}
+
+/* Fill 'classes', that must have room for NI_MALLOC_SIZE_CLASSES entries,
+ * with the figures of every size class. The figures of the running threads
+ * are read without synchronization, so they may be slightly behind.
+ *
+ * Returns NI_MALLOC_SIZE_CLASSES. */
+int ni_malloc_get_size_classes(ni_malloc_size_class *classes) {
+    ni_malloc_shard *shard;
+    int j;
+
+    for (j = 0; j < NI_MALLOC_SIZE_CLASSES; j++) {
+        memset(&classes[j], 0, sizeof(classes[j]));
+        if (j < NI_SLAB_CLASSES) {
+            classes[j].min_size = j ? slab_class_size[j-1] : 0;
+            classes[j].max_size = slab_class_size[j];
+        } else {
+            classes[j].min_size = (size_t)NI_SLAB_MAX_SIZE << (j - NI_SLAB_CLASSES);
+            classes[j].max_size = classes[j].min_size * 2;
+        }
+    }
+    classes[NI_MALLOC_SIZE_CLASSES-1].max_size = (size_t)-1;
+    pthread_mutex_lock(&shards_mutex);
+    for (shard = shards; shard != NULL; shard = shard->next) {
+        for (j = 0; j < NI_MALLOC_SIZE_CLASSES; j++) {
+            ni_malloc_hist *h = &shard->hist[j];
+            classes[j].live_objects += h->live_objects;
+            classes[j].live_bytes += h->live_bytes;
+            classes[j].allocs += h->allocs;
+            classes[j].requested += h->requested;
+            classes[j].usable += h->usable;
+        }
+    }
+    pthread_mutex_unlock(&shards_mutex);
+    return NI_MALLOC_SIZE_CLASSES;
+}
+
+/* Write to 'fp' a table with the size classes that were ever used. The
+ * slack is the percentage of the usable bytes the callers did not ask for.
+ *
+ * On error, -1 is returned. Otherwise 0. */
+int ni_malloc_write_size_classes(FILE *fp) {
+    ni_malloc_size_class classes[NI_MALLOC_SIZE_CLASSES];
+    int j;
+
+    ni_malloc_get_size_classes(classes);
+    fprintf(fp, "%-8s %14s %16s %14s %18s %18s %7s\n", "size", "live_objects",
+        "live_bytes", "allocs", "requested", "usable", "slack");
+    for (j = 0; j < NI_MALLOC_SIZE_CLASSES; j++) {
+        ni_malloc_size_class *c = &classes[j];
+        char size[32];
+
+        if (c->allocs == 0) continue;
+        if (c->max_size == (size_t)-1)
+            snprintf(size, sizeof(size), ">%zu", c->min_size);
+        else
+            snprintf(size, sizeof(size), "%zu", c->max_size);
+        fprintf(fp, "%-8s %14zu %16zu %14zu %18zu %18zu %6.2f%%\n", size,
+            c->live_objects, c->live_bytes, c->allocs, c->requested,
+            c->usable, c->usable ?
+            100.0 * (c->usable - c->requested) / c->usable : 0.0);
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+/* ---------------------------- Allocation scopes ----------------------------
+ *
+ * A scope counts what the calling thread allocates and frees between
+ * ni_malloc_scope_begin() and ni_malloc_scope_end(), so that tests and
+ * benchmarks can check that a path expected not to allocate really does
+ * not. Nothing is done on the allocation path: the scope takes a snapshot
+ * of the size classes of the thread shard, that every allocation and free
+ * already updates, and compares it with the figures at the end. Reallocs
+ * count as a free plus an allocation. Scopes can be nested up to
+ * NI_MALLOC_SCOPE_DEPTH levels. */
+#define NI_MALLOC_SCOPE_DEPTH 8
+
+typedef struct ni_malloc_scope_snap {
+    size_t  allocs;
+    size_t  live_objects;
+    size_t  usable;
+    size_t  live_bytes;
+} ni_malloc_scope_snap;
+
+static __thread ni_malloc_scope_snap tls_scopes[NI_MALLOC_SCOPE_DEPTH];
+static __thread int tls_scope_depth = 0;
+
+static void ni_malloc_scope_snapshot(ni_malloc_scope_snap *snap) {
+    ni_malloc_shard *shard = tls_shard;
+    int j;
+
+    if (shard == NULL) shard = ni_malloc_shard_create();
+    memset(snap, 0, sizeof(*snap));
+    for (j = 0; j < NI_MALLOC_SIZE_CLASSES; j++) {
+        snap->allocs += shard->hist[j].allocs;
+        snap->live_objects += shard->hist[j].live_objects;
+        snap->usable += shard->hist[j].usable;
+        snap->live_bytes += shard->hist[j].live_bytes;
+    }
+}
+
+/* Open an allocation scope on the calling thread.
+ *
+ * On error, -1 is returned since NI_MALLOC_SCOPE_DEPTH scopes are already
+ * open. Otherwise 0. */
+int ni_malloc_scope_begin(void) {
+    if (tls_scope_depth == NI_MALLOC_SCOPE_DEPTH) return -1;
+    ni_malloc_scope_snapshot(&tls_scopes[tls_scope_depth++]);
+    return 0;
+}
+
+/* Close the innermost scope of the calling thread, filling 'stats' with
+ * the allocations and frees the thread made since it was opened, nested
+ * scopes included.
+ *
+ * On error, -1 is returned since no scope is open. Otherwise 0. */
+int ni_malloc_scope_end(ni_malloc_scope_stats *stats) {
+    ni_malloc_scope_snap now, *start;
+
+    if (tls_scope_depth == 0) return -1;
+    start = &tls_scopes[--tls_scope_depth];
+    ni_malloc_scope_snapshot(&now);
+    /* What was allocated minus what is still live was freed. */
+    stats->allocs = now.allocs - start->allocs;
+    stats->frees = stats->allocs - (now.live_objects - start->live_objects);
+    stats->alloc_bytes = now.usable - start->usable;
+    stats->free_bytes = stats->alloc_bytes - (now.live_bytes - start->live_bytes);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void ni_malloc_default_oom(size_t size) {
+    fprintf(stderr, "ni_malloc: Out of memory trying to allocate %zu bytes.\n", size);
+    fflush(stderr);
+    abort();
+}
+
+static void (*ni_malloc_oom_handler)(size_t) = ni_malloc_default_oom;
+
+/* Allocate a huge block of 'size' bytes. */
+static void *ni_malloc_huge(size_t size, size_t *accounted) {
+    void *ptr;
+
+    if ((ptr = ni_huge_alloc(size, accounted)) == NULL) {
+        ni_malloc_oom_handler(size);
+        *accounted = 0;
+        return NULL;
+    }
+    update_ni_malloc_stat_alloc(*accounted);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(*accounted), size, *accounted);
+    ni_malloc_profile_alloc(ptr, *accounted);
+    return ptr;
+}
+
+/* Bytes accounted for a libc block of 'size' bytes allocated with the sized
+ * functions, rounded like update_ni_malloc_stat_alloc() does. */
+#define ni_malloc_sized_usage(size) \
+    (((size) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+/* The *_impl functions do the actual work of the public allocation
+ * functions and also report the bytes they accounted, so that the tagged
+ * variants can charge them to their tag without asking the allocator for
+ * the size again. When 'sized' is true libc blocks are accounted for the
+ * size asked, see ni_malloc_sized(), otherwise for their usable size. */
+static inline void *ni_malloc_unlimited_impl(size_t size, size_t *accounted, int sized) {
+    void *ptr;
+
+    *accounted = 0;
+    if (slab_enabled && size <= NI_SLAB_MAX_SIZE) {
+        int cls = ni_slab_class_of(size);
+        if ((ptr = ni_slab_alloc(cls)) != NULL) {
+            *accounted = slab_class_size[cls];
+            update_ni_malloc_stat_alloc(slab_class_size[cls]);
+            ni_malloc_hist_alloc(cls, size, slab_class_size[cls]);
+            ni_malloc_profile_alloc(ptr, slab_class_size[cls]);
+            return ptr;
+        }
+    }
+    if (size >= huge_threshold)
+        return ni_malloc_huge(size, accounted);
+    ptr = malloc(size + PREFIX_SIZE);
+    if (!ptr) {
+        ni_malloc_oom_handler(size);
+        return NULL;
+    }
+#ifdef HAVE_MALLOC_SIZE
+    *accounted = sized ? ni_malloc_sized_usage(size) : ni_malloc_libc_size(ptr);
+    update_ni_malloc_stat_alloc(*accounted);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(*accounted), size, *accounted);
+    ni_malloc_profile_alloc(ptr, *accounted);
+    return ptr;
+#else
+    ((void) sized);
+    *((size_t*)ptr) = size;
+    *accounted = size + PREFIX_SIZE;
+    update_ni_malloc_stat_alloc(size + PREFIX_SIZE);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(*accounted), size, *accounted);
+    ni_malloc_profile_alloc((char*)ptr + PREFIX_SIZE, size + PREFIX_SIZE);
+    return (char*)(ptr + PREFIX_SIZE);
+#endif
+}
+
+static inline void *ni_malloc_impl(size_t size, size_t *accounted) {
+    if (ni_malloc_limit_reached(size)) {
+        *accounted = 0;
+        return NULL;
+    }
+    return ni_malloc_unlimited_impl(size, accounted, 0);
+}
+
+static inline void *ni_malloc_sized_impl(size_t size, size_t *accounted) {
+    if (ni_malloc_limit_reached(size)) {
+        *accounted = 0;
+        return NULL;
+    }
+    return ni_malloc_unlimited_impl(size, accounted, 1);
+}
+
+static inline void *ni_calloc_impl(size_t mblock, size_t size, size_t *accounted) {
+    void *ptr;
+
+    *accounted = 0;
+    if (size && mblock > (size_t)-1 / size)
+        return NULL;
+    if (ni_malloc_limit_reached(mblock * size))
+        return NULL;
+    if (slab_enabled && size && mblock <= NI_SLAB_MAX_SIZE / size) {
+        int cls = ni_slab_class_of(mblock * size);
+        if ((ptr = ni_slab_alloc(cls)) != NULL) {
+            memset(ptr, 0, slab_class_size[cls]);
+            *accounted = slab_class_size[cls];
+            update_ni_malloc_stat_alloc(slab_class_size[cls]);
+            ni_malloc_hist_alloc(cls, mblock * size, slab_class_size[cls]);
+            ni_malloc_profile_alloc(ptr, slab_class_size[cls]);
+            return ptr;
+        }
+    }
+    /* Huge blocks are zeroed by the kernel. */
+    if (mblock * size >= huge_threshold)
+        return ni_malloc_huge(mblock * size, accounted);
+    ptr = calloc(mblock, size + PREFIX_SIZE);
+    if (!ptr)
+        ni_malloc_oom_handler(size);
+#ifdef HAVE_MALLOC_SIZE
+    *accounted = ni_malloc_libc_size(ptr);
+    update_ni_malloc_stat_alloc(*accounted);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(*accounted), mblock * size, *accounted);
+    ni_malloc_profile_alloc(ptr, *accounted);
+    return ptr;
+#else
+    *((size_t*)ptr) = size;
+    *accounted = size + PREFIX_SIZE;
+    update_ni_malloc_stat_alloc(size + PREFIX_SIZE);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(*accounted), mblock * size, *accounted);
+    ni_malloc_profile_alloc((char*)ptr + PREFIX_SIZE, size + PREFIX_SIZE);
+    return (char*)(ptr + PREFIX_SIZE);
+#endif
+}
+
+void *ni_malloc(size_t size) {
+    size_t accounted;
+    return ni_malloc_impl(size, &accounted);
+}
+
+void *ni_calloc(size_t mblock, size_t size) {
+    size_t accounted;
+    return ni_calloc_impl(mblock, size, &accounted);
+}
+
+/* Allocate 'size' bytes like ni_malloc(), accounting libc blocks for the
+ * size asked instead of the size the libc allocator rounded it to, so that
+ * freeing them does not need to ask the allocator for it. The block must be
+ * freed and reallocated with ni_free_sized() and ni_realloc_sized() passing
+ * the size it was allocated with: ni_free() would remove its usable size
+ * from the accounting. */
+void *ni_malloc_sized(size_t size) {
+    size_t accounted;
+    return ni_malloc_sized_impl(size, &accounted);
+}
+
+static inline int ni_malloc_batch_impl(size_t size, int n, void **out, size_t *accounted) {
+    size_t total = 0;
+    int j = 0;
+
+    *accounted = 0;
+    if (n > 0 && size > (size_t)-1 / n)
+        return 0;
+    if (ni_malloc_limit_reached(size * n))
+        return 0;
+    /* Size classes are counted while allocating. */
+    if (tls_shard == NULL) ni_malloc_shard_create();
+    if (slab_enabled && size <= NI_SLAB_MAX_SIZE) {
+        int cls = ni_slab_class_of(size);
+        ni_tcache *tc = tls_tcache;
+        ni_malloc_hist *h = &tls_shard->hist[cls];
+
+        if (tc != NULL) {
+            ni_tcache_bin *bin = &tc->bins[cls];
+            while (j < n && bin->count) out[j++] = bin->objs[--bin->count];
+        }
+        if (j < n) j += ni_slab_alloc_batch(cls, n - j, out + j);
+        total = (size_t)j * slab_class_size[cls];
+        h->live_objects += j;
+        h->live_bytes += total;
+        h->allocs += j;
+        h->requested += (size_t)j * size;
+        h->usable += total;
+    }
+    for (; j < n; j++) {
+        size_t usable;
+
+        out[j] = malloc(size + PREFIX_SIZE);
+        if (!out[j])
+            ni_malloc_oom_handler(size);
+#ifdef HAVE_MALLOC_SIZE
+        usable = ni_malloc_sized_usage(size);
+#else
+        *((size_t*)out[j]) = size;
+        out[j] = (char*)out[j] + PREFIX_SIZE;
+        usable = size + PREFIX_SIZE;
+#endif
+        total += usable;
+        ni_malloc_hist_alloc(ni_malloc_hist_class(usable), size, usable);
+    }
+    *accounted = total;
+    update_ni_malloc_stat_alloc(total);
+    for (j = 0; j < n; j++)
+        ni_malloc_profile_alloc(out[j], size);
+    return n;
+}
+
+/* Allocate 'n' blocks of 'size' bytes, storing them in 'out', with a single
+ * update of the memory accounting. Sizes served by the slab layer are taken
+ * from the thread cache first, then from the slabs taking the class lock
+ * once for all the rest. The blocks are accounted like ni_malloc_sized()
+ * does, so they are freed one by one with ni_free_sized() or all together
+ * with ni_free_batch_sized().
+ *
+ * Returns 'n', or 0 if no block was allocated because of the hard limit. */
+int ni_malloc_batch(size_t size, int n, void **out) {
+    size_t accounted;
+    return ni_malloc_batch_impl(size, n, out, &accounted);
+}
+
+/* Move a slab object of class 'cls' to a new allocation of 'size' bytes,
+ * accounted like ni_malloc_sized() does if 'sized' is true. If the class can
+ * still hold 'size' bytes the object is left where it is. '*accounted' is
+ * set to the accounted size of the resulting object. */
+static void *ni_slab_realloc(void *ptr, int cls, size_t size, size_t *accounted, int sized) {
+    size_t oldsize = slab_class_size[cls];
+    void *newptr;
+
+    *accounted = oldsize;
+    if (size <= oldsize && ni_slab_class_of(size) == cls)
+        return ptr;
+    /* A shrinking object always moves to its new class, the sized free and
+     * realloc functions take the class from the size the caller passes. It
+     * frees memory, so the hard limit is not checked. */
+    if (size <= oldsize)
+        newptr = ni_malloc_unlimited_impl(size, accounted, sized);
+    else if (sized)
+        newptr = ni_malloc_sized_impl(size, accounted);
+    else
+        newptr = ni_malloc_impl(size, accounted);
+    if (newptr == NULL) {
+        *accounted = oldsize;
+        return NULL;
+    }
+    memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+    update_ni_malloc_stat_free(oldsize);
+    ni_malloc_hist_free(cls, oldsize);
+    ni_malloc_profile_free(ptr);
+    ni_slab_free(ptr, cls);
+    return newptr;
+}
+
+/* Resize the huge block 'ptr', with the contract of ni_realloc_impl(). */
+static void *ni_realloc_huge(void *ptr, size_t size, size_t *oldsize, size_t *newsize) {
+    void *newptr;
+
+    *oldsize = *newsize = ni_huge_usable(ptr);
+    if (size > *oldsize && ni_malloc_limit_reached(size - *oldsize))
+        return NULL;
+    if ((newptr = ni_huge_realloc(ptr, size, newsize)) == NULL) {
+        ni_malloc_oom_handler(size);
+        *newsize = *oldsize;
+        return NULL;
+    }
+    update_ni_malloc_stat_free(*oldsize);
+    update_ni_malloc_stat_alloc(*newsize);
+    ni_malloc_hist_free(ni_malloc_hist_class(*oldsize), *oldsize);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(*newsize), size, *newsize);
+    ni_malloc_profile_free(ptr);
+    ni_malloc_profile_alloc(newptr, *newsize);
+    return newptr;
+}
+
+static inline size_t ni_free_impl(void *ptr);
+
+/* Move the libc block 'ptr' to a huge block of 'size' bytes, so that its
+ * next reallocations don't copy it. Same contract of ni_realloc_impl(). */
+static void *ni_realloc_to_huge(void *ptr, size_t size, size_t *oldsize, size_t *newsize) {
+    size_t used;
+    void *newptr;
+
+#ifdef HAVE_MALLOC_SIZE
+    used = ni_malloc_libc_size(ptr);
+    *oldsize = used;
+#else
+    used = *((size_t*)((char*)ptr - PREFIX_SIZE));
+    *oldsize = used + PREFIX_SIZE;
+#endif
+    if ((newptr = ni_malloc_impl(size, newsize)) == NULL) {
+        *newsize = *oldsize;
+        return NULL;
+    }
+    memcpy(newptr, ptr, used < size ? used : size);
+    ni_free_impl(ptr);
+    return newptr;
+}
+
+/* Reallocate 'ptr' reporting in '*oldsize' and '*newsize' the accounted
+ * size of the old and of the new allocation. On failure both are the size
+ * of the old allocation, that is left untouched. */
+static inline void *ni_realloc_impl(void *ptr, size_t size, size_t *oldsize, size_t *newsize) {
+#ifndef HAVE_MALLOC_SIZE
+    void *realptr;
+#endif
+    void *newptr;
+
+    if (ptr == NULL) {
+        *oldsize = 0;
+        newptr = ni_malloc_impl(size, newsize);
+        return newptr;
+    }
+    if (ni_slab_owns(ptr)) {
+        int cls = ni_slab_of(ptr)->cls;
+        *oldsize = slab_class_size[cls];
+        return ni_slab_realloc(ptr, cls, size, newsize, 0);
+    }
+    if (ni_huge_owns(ptr))
+        return ni_realloc_huge(ptr, size, oldsize, newsize);
+    if (size >= huge_threshold)
+        return ni_realloc_to_huge(ptr, size, oldsize, newsize);
+#ifdef HAVE_MALLOC_SIZE
+    *oldsize = *newsize = ni_malloc_libc_size(ptr);
+    if (size > *oldsize && ni_malloc_limit_reached(size - *oldsize))
+        return NULL;
+    ni_malloc_profile_free(ptr);
+    newptr = realloc(ptr, size);
+    if (!newptr)
+        ni_malloc_oom_handler(size);
+    *newsize = ni_malloc_libc_size(newptr);
+    update_ni_malloc_stat_free(*oldsize);
+    update_ni_malloc_stat_alloc(*newsize);
+    ni_malloc_hist_free(ni_malloc_hist_class(*oldsize), *oldsize);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(*newsize), size, *newsize);
+    ni_malloc_profile_alloc(newptr, *newsize);
+    return newptr;
+#else
+    realptr = (char*)(ptr - PREFIX_SIZE);
+    *oldsize = *newsize = *((size_t*)realptr) + PREFIX_SIZE;
+    if (size + PREFIX_SIZE > *oldsize &&
+        ni_malloc_limit_reached(size + PREFIX_SIZE - *oldsize))
+        return NULL;
+    ni_malloc_profile_free(ptr);
+    newptr = realloc(realptr, size + PREFIX_SIZE);
+    if (!newptr)
+        ni_malloc_oom_handler(size);
+    *((size_t*)newptr) = size;
+    *newsize = size + PREFIX_SIZE;
+    update_ni_malloc_stat_free(*oldsize);
+    update_ni_malloc_stat_alloc(*newsize);
+    ni_malloc_hist_free(ni_malloc_hist_class(*oldsize), *oldsize);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(*newsize), size, *newsize);
+    ni_malloc_profile_alloc((char*)newptr + PREFIX_SIZE, *newsize);
+    return (char*)(newptr + PREFIX_SIZE);
+#endif
+}
+
+void *ni_realloc(void *ptr, size_t size) {
+    size_t oldsize, newsize;
+    return ni_realloc_impl(ptr, size, &oldsize, &newsize);
+}
+
+/* Return the size ni_malloc accounts for the allocation 'ptr': the size of
+ * the class for slab objects, otherwise what the libc allocator reports, or
+ * for systems where this function is not provided by malloc itself, the
+ * size stored in the header we put as the first bytes of every allocation. */
+size_t ni_malloc_size(void *ptr) {
+#ifndef HAVE_MALLOC_SIZE
+    void *realptr;
+    size_t size;
+#endif
+    if (ni_slab_owns(ptr))
+        return slab_class_size[ni_slab_of(ptr)->cls];
+    if (ni_huge_owns(ptr))
+        return ni_huge_usable(ptr);
+#ifdef HAVE_MALLOC_SIZE
+    return ni_malloc_libc_size(ptr);
+#else
+    realptr = (char*)(ptr - PREFIX_SIZE);
+    size = *((size_t*)realptr);
+    /* Assume at least that all the allocations are padded at sizeof(long) by
+     * the underlying allocator. */
+    if (size & (sizeof(long)-1))
+        size += sizeof(long) - (size&(sizeof(long)-1));
+    return size + PREFIX_SIZE;
+#endif
+}
+
+#ifndef HAVE_MALLOC_SIZE
+size_t ni_malloc_usable(void *ptr) {
+    if (ni_slab_owns(ptr) || ni_huge_owns(ptr)) return ni_malloc_size(ptr);
+    return ni_malloc_size(ptr) - PREFIX_SIZE;
+}
+#endif
+
+/* Free 'ptr' returning the bytes removed from the accounting. */
+static inline size_t ni_free_impl(void *ptr) {
+#ifndef HAVE_MALLOC_SIZE
+    void *realptr;
+#endif
+    size_t oldsize;
+
+    if (ptr == NULL)
+        return 0;
+    ni_malloc_profile_free(ptr);
+    if (ni_slab_owns(ptr)) {
+        int cls = ni_slab_of(ptr)->cls;
+        update_ni_malloc_stat_free(slab_class_size[cls]);
+        ni_malloc_hist_free(cls, slab_class_size[cls]);
+        ni_slab_free(ptr, cls);
+        return slab_class_size[cls];
+    }
+    if (ni_huge_owns(ptr)) {
+        oldsize = ni_huge_free(ptr);
+        update_ni_malloc_stat_free(oldsize);
+        ni_malloc_hist_free(ni_malloc_hist_class(oldsize), oldsize);
+        return oldsize;
+    }
+#ifdef HAVE_MALLOC_SIZE
+    oldsize = ni_malloc_libc_size(ptr);
+    update_ni_malloc_stat_free(oldsize);
+    ni_malloc_hist_free(ni_malloc_hist_class(oldsize), oldsize);
+    free(ptr);
+    return oldsize;
+#else
+    realptr = (char*)(ptr - PREFIX_SIZE);
+    oldsize = *((size_t*)realptr) + PREFIX_SIZE;
+    update_ni_malloc_stat_free(oldsize);
+    ni_malloc_hist_free(ni_malloc_hist_class(oldsize), oldsize);
+    free(realptr);
+    return oldsize;
+#endif
+}
+
+void ni_free(void *ptr) {
+    ni_free_impl(ptr);
+}
+
+/* Free the blocks in 'ptrs' returning the bytes removed from the accounting
+ * and in '*count' the number of blocks that were not NULL. If 'sized' is
+ * true the blocks are of 'size' bytes, accounted like ni_malloc_sized()
+ * does. */
+static inline size_t ni_free_batch_impl(void **ptrs, int n, size_t size, int sized,
+                                        int *count) {
+    size_t total = 0;
+    int j;
+
+    *count = 0;
+    /* Size classes are counted while freeing. */
+    if (tls_shard == NULL) ni_malloc_shard_create();
+    for (j = 0; j < n; j++) {
+        void *ptr = ptrs[j];
+        size_t usable;
+
+        if (ptr == NULL)
+            continue;
+        (*count)++;
+        ni_malloc_profile_free(ptr);
+        if (ni_slab_owns(ptr)) {
+            int cls = sized && size <= NI_SLAB_MAX_SIZE ? ni_slab_class_of(size) :
+                                                          ni_slab_of(ptr)->cls;
+            total += slab_class_size[cls];
+            ni_malloc_hist_free(cls, slab_class_size[cls]);
+            ni_slab_free(ptr, cls);
+            continue;
+        }
+        if (ni_huge_owns(ptr)) {
+            usable = ni_huge_free(ptr);
+        } else {
+#ifdef HAVE_MALLOC_SIZE
+            usable = sized ? ni_malloc_sized_usage(size) : ni_malloc_libc_size(ptr);
+            free(ptr);
+#else
+            ptr = (char*)ptr - PREFIX_SIZE;
+            usable = *((size_t*)ptr) + PREFIX_SIZE;
+            free(ptr);
+#endif
+        }
+        total += usable;
+        ni_malloc_hist_free(ni_malloc_hist_class(usable), usable);
+    }
+    update_ni_malloc_stat_free(total);
+    return total;
+}
+
+/* Free the 'n' blocks in 'ptrs' with a single update of the memory
+ * accounting. NULL entries are skipped. */
+void ni_free_batch(void **ptrs, int n) {
+    int count;
+    ni_free_batch_impl(ptrs, n, 0, 0, &count);
+}
+
+/* Like ni_free_batch() for blocks of 'size' bytes allocated with
+ * ni_malloc_batch() or ni_malloc_sized(). */
+void ni_free_batch_sized(void **ptrs, int n, size_t size) {
+    int count;
+    ni_free_batch_impl(ptrs, n, size, 1, &count);
+}
+
+static inline size_t ni_free_sized_impl(void *ptr, size_t size) {
+    if (ptr == NULL)
+        return 0;
+    if (ni_slab_owns(ptr)) {
+        if (size <= NI_SLAB_MAX_SIZE) {
+            int cls = ni_slab_class_of(size);
+            update_ni_malloc_stat_free(slab_class_size[cls]);
+            ni_malloc_hist_free(cls, slab_class_size[cls]);
+            ni_malloc_profile_free(ptr);
+            ni_slab_free(ptr, cls);
+            return slab_class_size[cls];
+        }
+    } else if (!ni_huge_owns(ptr)) {
+#ifdef HAVE_MALLOC_SIZE
+        size_t usage = ni_malloc_sized_usage(size);
+
+        ni_malloc_profile_free(ptr);
+        update_ni_malloc_stat_free(usage);
+        ni_malloc_hist_free(ni_malloc_hist_class(usage), usage);
+        free(ptr);
+        return usage;
+#endif
+    }
+    return ni_free_impl(ptr);
+}
+
+/* Free 'ptr' knowing its size: the size it was allocated with by
+ * ni_malloc_sized(), ni_malloc_batch() or the last ni_realloc_sized(), or
+ * the size ni_malloc_size() reports for the blocks of ni_malloc() and the
+ * other functions. Slab objects are accounted and returned to the thread
+ * cache using the class of 'size' and libc blocks are accounted for 'size',
+ * so neither the slab header nor malloc_usable_size() are read. Huge blocks
+ * know their size and are freed like ni_free() does. */
+void ni_free_sized(void *ptr, size_t size) {
+    ni_free_sized_impl(ptr, size);
+}
+
+#ifdef HAVE_MALLOC_SIZE
+/* Reallocate the libc block 'ptr' of 'oldsize' bytes accounted like
+ * ni_malloc_sized() does, with the contract of ni_realloc_impl(). */
+static void *ni_realloc_sized_libc(void *ptr, size_t oldsize, size_t size,
+                                   size_t *oldacc, size_t *newacc) {
+    void *newptr;
+
+    *oldacc = *newacc = ni_malloc_sized_usage(oldsize);
+    if (size >= huge_threshold) {
+        /* Move to a huge block, so that the next reallocations don't copy. */
+        if ((newptr = ni_malloc_sized_impl(size, newacc)) == NULL) {
+            *newacc = *oldacc;
+            return NULL;
+        }
+        memcpy(newptr, ptr, oldsize < size ? oldsize : size);
+        ni_free_sized_impl(ptr, oldsize);
+        return newptr;
+    }
+    if (ni_malloc_sized_usage(size) > *oldacc &&
+        ni_malloc_limit_reached(ni_malloc_sized_usage(size) - *oldacc))
+        return NULL;
+    ni_malloc_profile_free(ptr);
+    if ((newptr = realloc(ptr, size)) == NULL) {
+        ni_malloc_oom_handler(size);
+        return NULL;
+    }
+    *newacc = ni_malloc_sized_usage(size);
+    update_ni_malloc_stat_free(*oldacc);
+    update_ni_malloc_stat_alloc(*newacc);
+    ni_malloc_hist_free(ni_malloc_hist_class(*oldacc), *oldacc);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(*newacc), size, *newacc);
+    ni_malloc_profile_alloc(newptr, *newacc);
+    return newptr;
+}
+#endif
+
+static inline void *ni_realloc_sized_impl(void *ptr, size_t oldsize, size_t size,
+                                          size_t *oldacc, size_t *newacc) {
+    if (ptr == NULL) {
+        *oldacc = 0;
+        return ni_malloc_sized_impl(size, newacc);
+    }
+    if (ni_slab_owns(ptr)) {
+        if (oldsize <= NI_SLAB_MAX_SIZE) {
+            int cls = ni_slab_class_of(oldsize);
+            *oldacc = slab_class_size[cls];
+            return ni_slab_realloc(ptr, cls, size, newacc, 1);
+        }
+    } else if (!ni_huge_owns(ptr)) {
+#ifdef HAVE_MALLOC_SIZE
+        return ni_realloc_sized_libc(ptr, oldsize, size, oldacc, newacc);
+#endif
+    }
+    return ni_realloc_impl(ptr, size, oldacc, newacc);
+}
 
-static void ni_malloc_default_oom(size_t size) {
-    fprintf(stderr, "ni_malloc: Out of memory trying to allocate %zu bytes.\n", size);
-    fflush(stderr);
-    abort();
+/* Like ni_realloc() for an allocation 'ptr' of 'oldsize' bytes, with the
+ * same contract of ni_free_sized() about 'oldsize'. The new block is
+ * accounted like ni_malloc_sized() does, so it must be freed with
+ * ni_free_sized() passing 'size'. */
+void *ni_realloc_sized(void *ptr, size_t oldsize, size_t size) {
+    size_t oldacc, newacc;
+    return ni_realloc_sized_impl(ptr, oldsize, size, &oldacc, &newacc);
 }
 
-static void (*ni_malloc_oom_handler)(size_t) = ni_malloc_default_oom;
+/* --------------------------- Aligned allocations ---------------------------
+ *
+ * Blocks whose address is a multiple of a given power of two, typically
+ * NI_CACHE_LINE so that a structure written by a thread does not share its
+ * cache lines with anything else. Alignments up to the pointer size are
+ * served like ni_malloc(), huge blocks are aligned to NI_HUGE_HDR_SIZE by
+ * construction, anything else comes from posix_memalign(). */
+void *ni_malloc_aligned(size_t size, size_t align) {
+    void *ptr;
+    size_t accounted;
 
-void *ni_malloc(size_t size) {
-    void *ptr = malloc(size + PREFIX_SIZE);
-    if (!ptr)
-        ni_malloc_oom_handler(size);
+    if (align == 0 || (align & (align - 1)))
+        return NULL;
 #ifdef HAVE_MALLOC_SIZE
-    update_ni_malloc_stat_alloc(ni_malloc_size(ptr));
-    return ptr;
+    if (align <= sizeof(void*))
+        return ni_malloc_impl(size, &accounted);
 #else
-    *((size_t*)ptr) = size;
-    update_ni_malloc_stat_alloc(size + PREFIX_SIZE);
-    return (char*)(ptr + PREFIX_SIZE);
+    if (align < 2 * sizeof(size_t))
+        align = 2 * sizeof(size_t);
 #endif
-}
-
-void *ni_calloc(size_t mblock, size_t size) {
-    void *ptr = calloc(mblock, size + PREFIX_SIZE);
-    if (!ptr)
-        ni_malloc_oom_handler(size);
+    if (ni_malloc_limit_reached(size + align))
+        return NULL;
+    if (size >= huge_threshold && align <= NI_HUGE_HDR_SIZE)
+        return ni_malloc_huge(size, &accounted);
 #ifdef HAVE_MALLOC_SIZE
-    update_ni_malloc_stat_alloc(ni_malloc_size(ptr));
-    return ptr;
+    if (posix_memalign(&ptr, align, size ? size : 1) != 0) {
+        ni_malloc_oom_handler(size);
+        return NULL;
+    }
+    accounted = ni_malloc_libc_size(ptr);
 #else
-    *((size_t*)ptr) = size;
-    update_ni_malloc_stat_alloc(size + PREFIX_SIZE);
-    return (char*)(ptr + PREFIX_SIZE);
+    /* The header is stored in the padding before the aligned address: the
+     * size of the block as ni_malloc_size() expects it, preceded by the
+     * alignment that ni_free_aligned() needs to find the real pointer. */
+    {
+        void *realptr;
+
+        if (posix_memalign(&realptr, align, size + align) != 0) {
+            ni_malloc_oom_handler(size);
+            return NULL;
+        }
+        ptr = (char*)realptr + align;
+        *((size_t*)ptr - 1) = size + align - PREFIX_SIZE;
+        *((size_t*)ptr - 2) = align;
+        accounted = size + align;
+    }
 #endif
+    update_ni_malloc_stat_alloc(accounted);
+    ni_malloc_hist_alloc(ni_malloc_hist_class(accounted), size, accounted);
+    ni_malloc_profile_alloc(ptr, accounted);
+    return ptr;
 }
 
-void *ni_realloc(void *ptr, size_t size) {
+/* Free a block allocated with ni_malloc_aligned(). These blocks must not be
+ * passed to ni_realloc(), that would not keep their alignment. */
+void ni_free_aligned(void *ptr) {
 #ifndef HAVE_MALLOC_SIZE
-    void *realptr;
+    size_t oldsize, align;
+
+    if (ptr != NULL && !ni_huge_owns(ptr)) {
+        align = *((size_t*)ptr - 2);
+        oldsize = *((size_t*)ptr - 1) + PREFIX_SIZE;
+        ni_malloc_profile_free(ptr);
+        update_ni_malloc_stat_free(oldsize);
+        ni_malloc_hist_free(ni_malloc_hist_class(oldsize), oldsize);
+        free((char*)ptr - align);
+        return;
+    }
 #endif
-    size_t oldsize;
+    ni_free_impl(ptr);
+}
+
+/* ---------------------------- Defragmentation ------------------------------
+ *
+ * Slabs only go back to the region once all their objects are freed, so a
+ * long running program can end up with many slabs holding a few objects
+ * each. Moving the objects of the sparsely used slabs into the slabs the
+ * class is allocating from lets the sparse ones empty and be released.
+ * Only slab objects can be told apart this way: the libc allocator does not
+ * tell how used the pages of a block are, and huge blocks own their pages. */
+
+/* Return 1 if 'ptr' sits in a slab used less than the average slab of its
+ * class, so that moving it with ni_malloc_defrag() helps the slab to be
+ * released. Full slabs and the slab the class is allocating from are never
+ * worth leaving. */
+int ni_malloc_defrag_hint(void *ptr) {
+    ni_slab_class *c;
+    ni_slab *slab;
+    int hint;
+
+    if (!ni_slab_owns(ptr)) return 0;
+    slab = ni_slab_of(ptr);
+    c = &slab_classes[slab->cls];
+    pthread_mutex_lock(&c->lock);
+    hint = slab->partial && slab != c->partial &&
+           (size_t)slab->inuse * c->slabs < c->objs;
+    pthread_mutex_unlock(&c->lock);
+    return hint;
+}
+
+/* Move 'ptr' to a new object if ni_malloc_defrag_hint() says so. The new
+ * object is taken from the slabs, not from the thread cache that could hold
+ * objects of the same sparse slab, and the old one goes back to its slab
+ * directly. The size does not change, so the accounting is untouched.
+ *
+ * Returns the new pointer, or NULL if 'ptr' was not moved and is still
+ * valid. */
+void *ni_malloc_defrag(void *ptr) {
     void *newptr;
+    int cls;
 
-    if (ptr == NULL)
-        return ni_malloc(size);
-#ifdef HAVE_MALLOC_SIZE
-    oldsize = ni_malloc_size(ptr);
-    newptr = realloc(ptr, size);
-    if (!newptr)
-        ni_malloc_oom_handler(size);
-    update_ni_malloc_stat_free(oldsize);
-    update_ni_malloc_stat_alloc(ni_malloc_size(newptr));
+    if (!ni_malloc_defrag_hint(ptr)) return NULL;
+    cls = ni_slab_of(ptr)->cls;
+    if (ni_slab_alloc_batch(cls, 1, &newptr) == 0) return NULL;
+    memcpy(newptr, ptr, slab_class_size[cls]);
+    ni_malloc_profile_free(ptr);
+    ni_malloc_profile_alloc(newptr, slab_class_size[cls]);
+    ni_slab_free_batch(cls, &ptr, 1);
     return newptr;
-#else
-    realptr = (char*)(ptr - PREFIX_SIZE);
-    oldsize = *((size_t*)realptr);
-    newptr = realloc(realptr, size + PREFIX_SIZE);
-    if (!newptr)
-        ni_malloc_oom_handler(size);
-    *((size_t*)newptr) = size;
-    update_ni_malloc_stat_free(oldsize + PREFIX_SIZE);
-    update_ni_malloc_stat_alloc(size + PREFIX_SIZE);
-    return (char*)(newptr + PREFIX_SIZE);
-#endif
 }
 
-/* Provide ni_malloc_size() for systems where this function is not provided by
- * malloc itself, given that in that case we store a header with this
- * information as the first bytes of every allocation. */
-#ifndef HAVE_MALLOC_SIZE
-size_t ni_malloc_size(void *ptr) {
-    void *realptr = (char*)(ptr - PREFIX_SIZE);
-    size_t size = *((size_t*)realptr);
-    /* Assume at least that all the allocations are padded at sizeof(long) by
-     * the underlying allocator. */
-    if (size & (sizeof(long)-1))
-        size += sizeof(long) - (size&(sizeof(long)-1));
-    return size + PREFIX_SIZE;
+/* ------------------------------ Tagged variants ----------------------------
+ *
+ * The same functions as above charging the memory to a tag, so that it is
+ * possible to tell which subsystem owns it, see ni_malloc_get_tag_stats().
+ * Memory allocated with a tag must be freed or reallocated with the same
+ * tag, memory allocated without a tag is not charged to any tag. */
+void *ni_malloc_tagged(size_t size, int tag) {
+    size_t accounted;
+    void *ptr = ni_malloc_impl(size, &accounted);
+    if (ptr) ni_malloc_tag_update(tag, accounted, 1);
+    return ptr;
 }
 
-size_t ni_malloc_usable(void *ptr) {
-    return ni_malloc_size(ptr) - PREFIX_SIZE;
+void *ni_malloc_sized_tagged(size_t size, int tag) {
+    size_t accounted;
+    void *ptr = ni_malloc_sized_impl(size, &accounted);
+    if (ptr) ni_malloc_tag_update(tag, accounted, 1);
+    return ptr;
 }
-#endif
 
-void ni_free(void *ptr) {
-#ifndef HAVE_MALLOC_SIZE
-    void *realptr;
-    size_t oldsize;
-#endif
-    if (ptr == NULL)
-        return;
-#ifdef HAVE_MALLOC_SIZE
-    update_ni_malloc_stat_free(ni_malloc_size(ptr));
-    free(ptr);
-#else
-    realptr = (char*)(ptr - PREFIX_SIZE);
-    oldsize = *((size_t*)realptr);
-    update_ni_malloc_stat_free(oldsize + PREFIX_SIZE);
-    free(realptr);
-#endif
+void *ni_calloc_tagged(size_t mblock, size_t size, int tag) {
+    size_t accounted;
+    void *ptr = ni_calloc_impl(mblock, size, &accounted);
+    if (ptr) ni_malloc_tag_update(tag, accounted, 1);
+    return ptr;
+}
+
+void *ni_realloc_tagged(void *ptr, size_t size, int tag) {
+    size_t oldsize, newsize;
+    void *newptr = ni_realloc_impl(ptr, size, &oldsize, &newsize);
+    if (newptr) ni_malloc_tag_update(tag, newsize - oldsize, ptr == NULL);
+    return newptr;
+}
+
+void *ni_realloc_sized_tagged(void *ptr, size_t oldsize, size_t size, int tag) {
+    size_t oldacc, newacc;
+    void *newptr = ni_realloc_sized_impl(ptr, oldsize, size, &oldacc, &newacc);
+    if (newptr) ni_malloc_tag_update(tag, newacc - oldacc, ptr == NULL);
+    return newptr;
+}
+
+int ni_malloc_batch_tagged(size_t size, int n, void **out, int tag) {
+    size_t accounted;
+    int count = ni_malloc_batch_impl(size, n, out, &accounted);
+    if (count) ni_malloc_tag_update(tag, accounted, count);
+    return count;
+}
+
+void ni_free_tagged(void *ptr, int tag) {
+    if (ptr) ni_malloc_tag_update(tag, -ni_free_impl(ptr), -1);
+}
+
+void ni_free_sized_tagged(void *ptr, size_t size, int tag) {
+    if (ptr) ni_malloc_tag_update(tag, -ni_free_sized_impl(ptr, size), -1);
+}
+
+void ni_free_batch_tagged(void **ptrs, int n, int tag) {
+    int count;
+    size_t total = ni_free_batch_impl(ptrs, n, 0, 0, &count);
+    if (count) ni_malloc_tag_update(tag, -total, -count);
+}
+
+void ni_free_batch_sized_tagged(void **ptrs, int n, size_t size, int tag) {
+    int count;
+    size_t total = ni_free_batch_impl(ptrs, n, size, 1, &count);
+    if (count) ni_malloc_tag_update(tag, -total, -count);
 }
 
+/* Return the exact amount of memory allocated, summing the per thread
+ * shards. This takes the shards registry lock, see
+ * ni_malloc_used_memory_approx() for a cheaper alternative. */
 size_t ni_malloc_used_memory(void) {
+    ni_malloc_shard *shard;
+    size_t um, used;
+
+    pthread_mutex_lock(&shards_mutex);
+    um = exited_memory;
+    for (shard = shards; shard != NULL; shard = shard->next) {
+        atomicGet(shard->used, used);
+        um += used;
+    }
+    pthread_mutex_unlock(&shards_mutex);
+    return um;
+}
+
+/* Return the amount of memory allocated with a single atomic load. The
+ * figure lags behind the exact one by at most NI_MALLOC_STAT_FOLD bytes for
+ * every thread that allocated memory, so it is well suited for callers that
+ * poll it often and only need to compare it with some coarse threshold. */
+size_t ni_malloc_used_memory_approx(void) {
     size_t um;
     atomicGet(used_memory, um);
     return um;
@@ -153,13 +2264,13 @@ void ni_malloc_set_oom_handler(void (*oom_handler)(size_t)) {
 
 /* Get the RSS information in an OS-specific way.
  *
- * WARNING: the function zmalloc_get_rss() is not designed to be fast
- * and may not be called in the busy loops where Redis tries to release
+ * WARNING: the function ni_malloc_get_rss() is not designed to be fast
+ * and may not be called in the busy loops where the program tries to release
  * memory expiring or swapping out objects.
  *
- * For this kind of "fast RSS reporting" usages use instead the
- * function RedisEstimateRSS() that is a much faster (and less precise)
- * version of the function. */
+ * For this kind of "fast RSS reporting" usages start the RSS sampler with
+ * ni_malloc_rss_sampler_start() and use ni_malloc_get_rss_sampled(), that
+ * returns the last sample with an atomic load. */
 
 #if defined(HAVE_PROC_STAT)
 #include <unistd.h>
@@ -232,13 +2343,303 @@ size_t ni_malloc_get_rss(void) {
 }
 #endif
 
+/* ------------------------------ RSS sampler --------------------------------
+ *
+ * A background thread calls ni_malloc_get_rss() every 'interval' ms and
+ * publishes the value together with the time it was taken, so that code
+ * needing the RSS very often, like eviction or admission checks on every
+ * write, pays an atomic load instead of a read of /proc.
+ *
+ * Both are packed in a single 64 bit word, so that they always belong to
+ * the same sample: the RSS in KB in the high bits, up to 16 TB, and the
+ * monotonic time in ms modulo 2^NI_RSS_TIME_BITS in the low ones. Ages are
+ * computed with the same modulo, so they are right up to about 12 days. */
+#define NI_RSS_TIME_BITS    30
+#define NI_RSS_TIME_MASK    ((1ULL << NI_RSS_TIME_BITS) - 1)
+
+static ni_atomic uint64_t rss_sample = 0;     /* Zero until the first sample. */
+pthread_mutex_t rss_sample_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t rss_sampler_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rss_sampler_cond;
+static pthread_t rss_sampler_thread;
+static int rss_sampler_running = 0;
+static int rss_sampler_interval = 0;
+
+static long long ni_malloc_monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void ni_malloc_rss_sample(void) {
+    uint64_t kb = (ni_malloc_get_rss() + 1023) / 1024;
+
+    if (kb == 0) kb = 1;
+    atomicSet(rss_sample, kb << NI_RSS_TIME_BITS |
+                          ((uint64_t)ni_malloc_monotonic_ms() & NI_RSS_TIME_MASK));
+}
+
+static void *ni_malloc_rss_sampler(void *arg) {
+    struct timespec deadline;
+    long long when;
+    ((void) arg);
+
+    pthread_mutex_lock(&rss_sampler_lock);
+    while (rss_sampler_running) {
+        pthread_mutex_unlock(&rss_sampler_lock);
+        ni_malloc_rss_sample();
+        pthread_mutex_lock(&rss_sampler_lock);
+        when = ni_malloc_monotonic_ms() + rss_sampler_interval;
+        deadline.tv_sec = when / 1000;
+        deadline.tv_nsec = (when % 1000) * 1000000;
+        while (rss_sampler_running &&
+               pthread_cond_timedwait(&rss_sampler_cond, &rss_sampler_lock,
+                                      &deadline) == 0);
+    }
+    pthread_mutex_unlock(&rss_sampler_lock);
+    return NULL;
+}
+
+/* Start sampling the RSS every 'interval_ms' milliseconds. If the sampler
+ * is already running only the interval is changed, starting from the next
+ * sample. The first sample is taken before returning.
+ *
+ * Returns 0 on success, -1 if the thread could not be created. */
+int ni_malloc_rss_sampler_start(int interval_ms) {
+    int retval = 0;
+
+    if (interval_ms <= 0) interval_ms = 1;
+    pthread_mutex_lock(&rss_sampler_lock);
+    rss_sampler_interval = interval_ms;
+    if (!rss_sampler_running) {
+        pthread_condattr_t attr;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&rss_sampler_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        ni_malloc_rss_sample();
+        rss_sampler_running = 1;
+        if (pthread_create(&rss_sampler_thread, NULL, ni_malloc_rss_sampler, NULL)) {
+            rss_sampler_running = 0;
+            pthread_cond_destroy(&rss_sampler_cond);
+            retval = -1;
+        }
+    }
+    pthread_mutex_unlock(&rss_sampler_lock);
+    return retval;
+}
+
+/* Stop the RSS sampler and wait for its thread to exit. The last sample is
+ * still returned by ni_malloc_get_rss_sampled(), getting older. */
+void ni_malloc_rss_sampler_stop(void) {
+    pthread_mutex_lock(&rss_sampler_lock);
+    if (!rss_sampler_running) {
+        pthread_mutex_unlock(&rss_sampler_lock);
+        return;
+    }
+    rss_sampler_running = 0;
+    pthread_cond_signal(&rss_sampler_cond);
+    pthread_mutex_unlock(&rss_sampler_lock);
+    pthread_join(rss_sampler_thread, NULL);
+    pthread_cond_destroy(&rss_sampler_cond);
+}
+
+/* Return the last RSS sample, rounded up to KB, with a single atomic load
+ * that also gets the time of the sample. If 'age_ms' is not NULL it is set
+ * to the milliseconds elapsed since the sample was taken, which costs a
+ * clock read more. As long as the sampler was never started every call
+ * reads the RSS right away, like ni_malloc_get_rss() does, with an age of
+ * zero. */
+size_t ni_malloc_get_rss_sampled(long long *age_ms) {
+    uint64_t sample;
+
+    atomicGet(rss_sample, sample);
+    if (sample == 0) {
+        if (age_ms) *age_ms = 0;
+        return ni_malloc_get_rss();
+    }
+    if (age_ms)
+        *age_ms = (long long)(((uint64_t)ni_malloc_monotonic_ms() - sample) & NI_RSS_TIME_MASK);
+    return (size_t)(sample >> NI_RSS_TIME_BITS) * 1024;
+}
+
+/* Modules that keep memory ni_malloc can't tell apart from the rest, like
+ * the objects queued for a background release, register a source so that
+ * their figures are part of ni_malloc_get_info() without ni_malloc knowing
+ * about the modules. */
+typedef struct ni_malloc_source_proc {
+    const char  *name;
+    size_t      (*bytes)(void);
+    size_t      (*objects)(void);
+} ni_malloc_source_proc;
+
+static ni_malloc_source_proc info_sources[NI_MALLOC_INFO_SOURCES];
+static int info_sources_count = 0;
+static pthread_mutex_t info_sources_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Report the bytes returned by 'bytes', and the objects returned by
+ * 'objects' if not NULL, as the source 'name' of ni_malloc_get_info(). The
+ * functions are called without locks held and must be cheap. Registering
+ * a name again replaces its functions, so modules can register every time
+ * they start.
+ *
+ * On error, -1 is returned since NI_MALLOC_INFO_SOURCES sources are already
+ * registered. Otherwise 0. */
+int ni_malloc_register_info_source(const char *name, size_t (*bytes)(void),
+                                   size_t (*objects)(void)) {
+    int j, retval = 0;
+
+    pthread_mutex_lock(&info_sources_lock);
+    for (j = 0; j < info_sources_count; j++)
+        if (strcmp(info_sources[j].name, name) == 0) break;
+    if (j == NI_MALLOC_INFO_SOURCES) {
+        retval = -1;
+    } else {
+        info_sources[j].name = name;
+        info_sources[j].bytes = bytes;
+        info_sources[j].objects = objects;
+        if (j == info_sources_count) info_sources_count++;
+    }
+    pthread_mutex_unlock(&info_sources_lock);
+    return retval;
+}
+
+/* Return the bytes of the source 'name' in 'info', 0 if it is not there. */
+size_t ni_malloc_info_source_bytes(const ni_malloc_info *info, const char *name) {
+    int j;
+
+    for (j = 0; j < info->sources; j++)
+        if (strcmp(info->source[j].name, name) == 0) return info->source[j].bytes;
+    return 0;
+}
+
+/* Fill 'info' with the figures of the allocators behind ni_malloc. The libc
+ * ones come from mallinfo2(), that walks the free lists of the malloc arenas
+ * without touching the chunks in use, the slab ones from per class counters,
+ * then the registered sources. This is cheap enough to be polled every
+ * second. */
+void ni_malloc_get_info(ni_malloc_info *info) {
+    ni_malloc_source_proc procs[NI_MALLOC_INFO_SOURCES];
+    int j;
+
+    memset(info, 0, sizeof(*info));
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2,33)
+    {
+        struct mallinfo2 mi = mallinfo2();
+        info->libc_allocated = mi.uordblks + mi.hblkhd;
+        info->libc_resident = mi.arena + mi.hblkhd;
+        info->libc_active = info->libc_resident - mi.keepcost;
+    }
+#else
+    {
+        /* The fields of mallinfo() are int and wrap past 4GB. */
+        struct mallinfo mi = mallinfo();
+        info->libc_allocated = (unsigned)mi.uordblks + (unsigned)mi.hblkhd;
+        info->libc_resident = (unsigned)mi.arena + (unsigned)mi.hblkhd;
+        info->libc_active = info->libc_resident - (unsigned)mi.keepcost;
+    }
+#endif
+#endif
+    if (slab_base != NULL) {
+        for (j = 0; j < NI_SLAB_CLASSES; j++) {
+            ni_slab_class *c = &slab_classes[j];
+            pthread_mutex_lock(&c->lock);
+            info->slab_allocated += c->objs * c->size;
+            info->slab_active += c->slabs * NI_SLAB_SIZE;
+            pthread_mutex_unlock(&c->lock);
+        }
+        pthread_mutex_lock(&slab_region_lock);
+        info->slab_resident = info->slab_active +
+                              (size_t)slab_dirty_count * NI_SLAB_SIZE;
+        pthread_mutex_unlock(&slab_region_lock);
+    }
+    pthread_mutex_lock(&huge_lock);
+    info->huge_resident = huge_mapped;
+    info->huge_allocated = huge_mapped - huge_blocks * NI_HUGE_HDR_SIZE;
+    pthread_mutex_unlock(&huge_lock);
+
+    pthread_mutex_lock(&info_sources_lock);
+    info->sources = info_sources_count;
+    memcpy(procs, info_sources, sizeof(procs[0]) * info_sources_count);
+    pthread_mutex_unlock(&info_sources_lock);
+    for (j = 0; j < info->sources; j++) {
+        info->source[j].name = procs[j].name;
+        info->source[j].bytes = procs[j].bytes();
+        info->source[j].objects = procs[j].objects ? procs[j].objects() : 0;
+    }
+}
+
+/* Report the bytes allocated by the program, the bytes of the pages holding
+ * them and the bytes the allocators keep resident, summing the libc and the
+ * slab figures of ni_malloc_get_info(). */
 int ni_malloc_get_allocator_info(size_t *allocated,
                                     size_t *active,
                                     size_t *resident) {
-    *allocated = *resident = *active = 0;
+    ni_malloc_info info;
+
+    ni_malloc_get_info(&info);
+    *allocated = info.libc_allocated + info.slab_allocated + info.huge_allocated;
+    *active = info.libc_active + info.slab_active + info.huge_resident;
+    *resident = info.libc_resident + info.slab_resident + info.huge_resident;
     return 1;
 }
 
+/* Write to 'fp' the malloc_info() XML report of the libc allocator followed
+ * by the slab classes and the sources. Meant for debugging, unlike
+ * ni_malloc_get_info() the libc report walks the whole heap.
+ *
+ * Returns 0 on success, -1 on error. */
+int ni_malloc_write_allocator_info(FILE *fp) {
+    ni_malloc_info info;
+    int j;
+
+    fprintf(fp, "<ni_malloc used=\"%zu\">\n", ni_malloc_used_memory());
+#if defined(__GLIBC__)
+    if (malloc_info(0, fp) == -1) return -1;
+#endif
+    ni_malloc_get_info(&info);
+    fprintf(fp, "<slabs allocated=\"%zu\" active=\"%zu\" resident=\"%zu\">\n",
+        info.slab_allocated, info.slab_active, info.slab_resident);
+    for (j = 0; slab_base != NULL && j < NI_SLAB_CLASSES; j++) {
+        ni_slab_class *c = &slab_classes[j];
+        size_t slabs, objs;
+
+        pthread_mutex_lock(&c->lock);
+        slabs = c->slabs;
+        objs = c->objs;
+        pthread_mutex_unlock(&c->lock);
+        fprintf(fp, "<class size=\"%zu\" slabs=\"%zu\" objs=\"%zu\"/>\n",
+            c->size, slabs, objs);
+    }
+    fprintf(fp, "</slabs>\n<huge allocated=\"%zu\" resident=\"%zu\"/>\n"
+        "<sources>\n", info.huge_allocated, info.huge_resident);
+    for (j = 0; j < info.sources; j++)
+        fprintf(fp, "<source name=\"%s\" bytes=\"%zu\" objects=\"%zu\"/>\n",
+            info.source[j].name, info.source[j].bytes, info.source[j].objects);
+    fprintf(fp, "</sources>\n<tags>\n");
+    for (j = 0; j < NI_MEM_TAGS; j++) {
+        size_t bytes, count;
+
+        if (ni_malloc_get_tag_stats(j, &bytes, &count) == -1) continue;
+        fprintf(fp, "<tag name=\"%s\" bytes=\"%zu\" count=\"%zu\"/>\n",
+            ni_malloc_tag_name(j), bytes, count);
+    }
+    fprintf(fp, "</tags>\n</ni_malloc>\n");
+    return ferror(fp) ? -1 : 0;
+}
+
+/* Return the ratio between the RSS of the process and the memory allocated
+ * through ni_malloc. The RSS is passed by the caller, that usually needs it
+ * for other purposes too. The approximate used memory is used, so this does
+ * not take any lock. */
+float ni_malloc_get_fragmentation_ratio(size_t rss) {
+    size_t used = ni_malloc_used_memory_approx();
+    return used ? (float)rss / used : 0;
+}
+
 /* Get the sum of the specified field (converted form kb to bytes) in
  * /proc/self/smaps. The field must be specified with trailing ":" as it
  * apperas in the smaps output.
@@ -285,6 +2686,79 @@ size_t ni_malloc_get_smap_bytes_by_field(char *field, long pid) {
 }
 #endif
 
+#if defined(HAVE_PROC_SMAPS)
+/* smaps fields collected by ni_malloc_memory_report(). */
+static const struct {
+    const char  *name;
+    size_t      offset;
+} mem_report_fields[] = {
+    {"Rss:",            offsetof(ni_malloc_mem_report, rss)},
+    {"Pss:",            offsetof(ni_malloc_mem_report, pss)},
+    {"Pss_Anon:",       offsetof(ni_malloc_mem_report, pss_anon)},
+    {"Pss_File:",       offsetof(ni_malloc_mem_report, pss_file)},
+    {"Shared_Clean:",   offsetof(ni_malloc_mem_report, shared_clean)},
+    {"Shared_Dirty:",   offsetof(ni_malloc_mem_report, shared_dirty)},
+    {"Private_Clean:",  offsetof(ni_malloc_mem_report, private_clean)},
+    {"Private_Dirty:",  offsetof(ni_malloc_mem_report, private_dirty)},
+    {"Referenced:",     offsetof(ni_malloc_mem_report, referenced)},
+    {"Anonymous:",      offsetof(ni_malloc_mem_report, anonymous)},
+    {"LazyFree:",       offsetof(ni_malloc_mem_report, lazy_free)},
+    {"AnonHugePages:",  offsetof(ni_malloc_mem_report, anon_huge_pages)},
+    {"Swap:",           offsetof(ni_malloc_mem_report, swap)},
+    {"SwapPss:",        offsetof(ni_malloc_mem_report, swap_pss)},
+    {"Locked:",         offsetof(ni_malloc_mem_report, locked)},
+    {NULL, 0}
+};
+
+/* Fill 'report' with the memory map totals of the process 'pid', or of the
+ * current process if pid is -1. The totals are read from smaps_rollup, that
+ * the kernel computes in a single pass without formatting every mapping.
+ * Older kernels lack it, in that case smaps is read once summing all the
+ * fields together, instead of once per field as
+ * ni_malloc_get_smap_bytes_by_field() does. Fields only present in
+ * smaps_rollup (Pss_Anon, Pss_File, ...) are then left to zero.
+ *
+ * Returns 0 on success, -1 if the information is not available. */
+int ni_malloc_memory_report(ni_malloc_mem_report *report, long pid) {
+    char line[1024], filename[128];
+    FILE *fp;
+    int j;
+
+    memset(report, 0, sizeof(*report));
+    if (pid == -1)
+        snprintf(filename,sizeof(filename),"/proc/self/smaps_rollup");
+    else
+        snprintf(filename,sizeof(filename),"/proc/%ld/smaps_rollup",pid);
+    if ((fp = fopen(filename,"r")) == NULL) {
+        /* Strip the "_rollup" suffix. */
+        filename[strlen(filename) - 7] = '\0';
+        if ((fp = fopen(filename,"r")) == NULL) return -1;
+    }
+
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        /* Mapping headers start with an hex address, fields with a capital
+         * letter. */
+        if (line[0] < 'A' || line[0] > 'Z') continue;
+        for (j = 0; mem_report_fields[j].name; j++) {
+            size_t flen = strlen(mem_report_fields[j].name);
+            if (strncmp(line, mem_report_fields[j].name, flen) == 0) {
+                size_t *field = (size_t*)((char*)report + mem_report_fields[j].offset);
+                *field += strtoll(line + flen, NULL, 10) * 1024;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+#else
+int ni_malloc_memory_report(ni_malloc_mem_report *report, long pid) {
+    ((void) pid);
+    memset(report, 0, sizeof(*report));
+    return -1;
+}
+#endif
+
 /* Returns the size of physical memory (RAM) in bytes.
  * It looks ugly, but this is the cleanest way to achieve cross platform results.
  * Cleaned up from:
@@ -298,7 +2772,7 @@ size_t ni_malloc_get_smap_bytes_by_field(char *field, long pid) {
  * 3) Was modified for Redis by Matt Stancliff.
  * 4) This note exists in order to comply with the original license.
  */
-size_t ni_malloc_get_memory_size(void) {
+static size_t ni_malloc_get_physical_memory_size(void) {
 #if defined(__unix__) || defined(__unix) || defined(unix) || \
     (defined(__APPLE__) && defined(__MACH__))
 #if defined(CTL_HW) && (defined(HW_MEMSIZE) || defined(HW_PHYSMEM64))
@@ -340,3 +2814,231 @@ size_t ni_malloc_get_memory_size(void) {
     return 0L;          /* Unknown OS. */
 #endif
 }
+
+/* -------------------------------- cgroups ----------------------------------
+ *
+ * Inside a container the memory the process can use is bounded by its
+ * memory cgroup, not by the RAM of the machine. */
+/* cgroup v1 reports "no limit" as a huge number rounded down to a page. */
+#define NI_CGROUP_UNLIMITED     (1ULL<<62)
+
+/* Read the number in the file 'path' into 'value'. Returns 0 on success,
+ * 1 if the file contains "max", -1 on error. */
+static int ni_malloc_read_size_file(const char *path, size_t *value) {
+    char buf[64];
+    FILE *fp;
+    int retval = -1;
+
+    if ((fp = fopen(path,"r")) == NULL) return -1;
+    if (fgets(buf, sizeof(buf), fp) != NULL) {
+        if (strncmp(buf, "max", 3) == 0) {
+            retval = 1;
+        } else if (buf[0] >= '0' && buf[0] <= '9') {
+            *value = strtoull(buf, NULL, 10);
+            retval = 0;
+        }
+    }
+    fclose(fp);
+    return retval;
+}
+
+/* Undo the octal escapes of the spaces and the other special characters
+ * in the paths of /proc/self/mountinfo, in place. */
+static void ni_malloc_unescape_mount_path(char *s) {
+    char *d = s;
+
+    for (; *s; s++) {
+        if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' &&
+            s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+            *d++ = (char)((s[1] - '0') * 64 + (s[2] - '0') * 8 + (s[3] - '0'));
+            s += 3;
+        } else {
+            *d++ = *s;
+        }
+    }
+    *d = '\0';
+}
+
+/* Find in /proc/self/mountinfo the mount of the cgroup v1 hierarchy with the
+ * memory controller if 'v1' is true, of the cgroup v2 one otherwise. 'mount'
+ * is set to the mount point and 'root' to the path of the hierarchy that is
+ * mounted there, both of at least 1024 bytes.
+ *
+ * On error, -1 is returned since the hierarchy is not mounted. Otherwise 0. */
+static int ni_malloc_find_cgroup_mount(int v1, char *mount, char *root) {
+    char line[4096];
+    FILE *fp;
+    int retval = -1;
+
+    if ((fp = fopen("/proc/self/mountinfo","r")) == NULL) return -1;
+    while(retval == -1 && fgets(line, sizeof(line), fp) != NULL) {
+        /* id parent major:minor root mount-point options [tags] - type source super-options */
+        char fstype[64], opts[1024], *sep = strstr(line, " - "), *o, *saveptr;
+
+        if (sep == NULL ||
+            sscanf(line, "%*s %*s %*s %1023s %1023s", root, mount) != 2 ||
+            sscanf(sep + 3, "%63s %*s %1023s", fstype, opts) != 2) continue;
+        if (!v1) {
+            if (strcmp(fstype, "cgroup2") == 0) retval = 0;
+            continue;
+        }
+        if (strcmp(fstype, "cgroup") != 0) continue;
+        for (o = strtok_r(opts, ",", &saveptr); o; o = strtok_r(NULL, ",", &saveptr))
+            if (strcmp(o, "memory") == 0) retval = 0;
+    }
+    fclose(fp);
+    if (retval == 0) {
+        ni_malloc_unescape_mount_path(mount);
+        ni_malloc_unescape_mount_path(root);
+    }
+    return retval;
+}
+
+/* Read the memory limit and usage of the cgroup at 'path' of the v1 memory
+ * hierarchy if 'v1' is true, of the v2 one otherwise. Every ancestor can
+ * set a lower limit than the cgroup itself, so the cgroups are walked up to
+ * the top of the mount and the smallest limit is taken. '*limit' is set to
+ * zero if none of them has a limit. The usage is the one of the innermost
+ * cgroup that can be read.
+ *
+ * Returns 1 on success, 0 if no cgroup file can be read. */
+static int ni_malloc_read_cgroup_memory(int v1, const char *path,
+                                        size_t *limit, size_t *usage) {
+    char mount[1024], root[1024], dir[2048], filename[2100], *slash;
+    size_t rootlen, mountlen, l;
+    int found = 0, retval;
+
+    *limit = *usage = 0;
+    if (ni_malloc_find_cgroup_mount(v1, mount, root) == -1) return 0;
+    if (strcmp(mount, "/") == 0) mount[0] = '\0';
+    /* The path is relative to the top of the hierarchy, the mount shows the
+     * part of it below 'root'. When the cgroup namespace of a container
+     * hides the path, the top of the mount is the cgroup of the container. */
+    rootlen = strcmp(root, "/") ? strlen(root) : 0;
+    if (strncmp(path, root, rootlen) == 0 &&
+        (path[rootlen] == '/' || path[rootlen] == '\0'))
+        path += rootlen;
+    else
+        path = "";
+    mountlen = strlen(mount);
+    snprintf(dir, sizeof(dir), "%s%s", mount, path);
+    while (strlen(dir) > mountlen && dir[strlen(dir) - 1] == '/')
+        dir[strlen(dir) - 1] = '\0';
+
+    while (1) {
+        snprintf(filename, sizeof(filename), "%s/%s", dir,
+            v1 ? "memory.limit_in_bytes" : "memory.max");
+        if ((retval = ni_malloc_read_size_file(filename, &l)) != -1) {
+            if (!found) {
+                snprintf(filename, sizeof(filename), "%s/%s", dir,
+                    v1 ? "memory.usage_in_bytes" : "memory.current");
+                ni_malloc_read_size_file(filename, usage);
+                found = 1;
+            }
+            if (retval == 0 && l < NI_CGROUP_UNLIMITED && (*limit == 0 || l < *limit))
+                *limit = l;
+        }
+        if (strlen(dir) <= mountlen || (slash = strrchr(dir, '/')) == NULL) break;
+        *slash = '\0';
+    }
+    return found;
+}
+
+/* Get the memory limit and the current usage of the memory cgroup of the
+ * process, supporting both cgroup v1 (memory.limit_in_bytes) and v2
+ * (memory.max), wherever /proc/self/mountinfo says their hierarchy is
+ * mounted. '*limit' is set to zero if neither the cgroup nor its ancestors
+ * have a limit. Both 'limit' and 'usage' can be NULL.
+ *
+ * Returns the cgroup version, or 0 if the process is not in a memory cgroup
+ * or its files can't be read. */
+int ni_malloc_get_cgroup_memory(size_t *limit, size_t *usage) {
+    char line[1024], v1[512] = "", v2[512] = "";
+    int has_v1 = 0, has_v2 = 0, version = 0;
+    size_t l = 0, u = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/self/cgroup","r")) == NULL) return 0;
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        /* hierarchy-ID:controller-list:cgroup-path */
+        char *controllers = strchr(line, ':'), *path, *c, *saveptr;
+
+        if (controllers == NULL) continue;
+        controllers++;
+        if ((path = strchr(controllers, ':')) == NULL) continue;
+        *path++ = '\0';
+        path[strcspn(path, "\n")] = '\0';
+        if (controllers[0] == '\0') {
+            snprintf(v2, sizeof(v2), "%s", path);
+            has_v2 = 1;
+            continue;
+        }
+        for (c = strtok_r(controllers, ",", &saveptr); c;
+             c = strtok_r(NULL, ",", &saveptr)) {
+            if (strcmp(c, "memory") == 0) {
+                snprintf(v1, sizeof(v1), "%s", path);
+                has_v1 = 1;
+            }
+        }
+    }
+    fclose(fp);
+
+    if (has_v1 && ni_malloc_read_cgroup_memory(1, v1, &l, &u))
+        version = 1;
+    else if (has_v2 && ni_malloc_read_cgroup_memory(0, v2, &l, &u))
+        version = 2;
+    if (limit) *limit = l;
+    if (usage) *usage = u;
+    return version;
+}
+
+/* Returns the size of the memory the process can use: the physical memory,
+ * or the limit of the memory cgroup of the process if it is lower. */
+size_t ni_malloc_get_memory_size(void) {
+    size_t physical = ni_malloc_get_physical_memory_size(), limit;
+
+    if (ni_malloc_get_cgroup_memory(&limit, NULL) && limit &&
+        (physical == 0 || limit < physical))
+        return limit;
+    return physical;
+}
+
+/* Fill 'pressure' with the memory pressure stall information of the system
+ * from /proc/pressure/memory: the share of time some or all the non idle
+ * tasks were stalled waiting for memory over the last 10, 60 and 300
+ * seconds, and the total stall time in microseconds. Rising "some" figures
+ * are an early signal to start evicting, well before the OOM killer acts.
+ *
+ * Returns 0 on success, -1 if PSI is not available (kernels older than
+ * 4.20 or built without CONFIG_PSI). */
+int ni_malloc_get_memory_pressure(ni_malloc_pressure *pressure) {
+    char line[256];
+    FILE *fp;
+    int found = 0;
+
+    memset(pressure, 0, sizeof(*pressure));
+    if ((fp = fopen("/proc/pressure/memory","r")) == NULL) return -1;
+    while(fgets(line, sizeof(line), fp) != NULL) {
+        float avg10, avg60, avg300;
+        unsigned long long total;
+        char kind[8];
+
+        if (sscanf(line, "%7s avg10=%f avg60=%f avg300=%f total=%llu",
+                   kind, &avg10, &avg60, &avg300, &total) != 5) continue;
+        if (strcmp(kind, "some") == 0) {
+            pressure->some_avg10 = avg10;
+            pressure->some_avg60 = avg60;
+            pressure->some_avg300 = avg300;
+            pressure->some_total = total;
+            found++;
+        } else if (strcmp(kind, "full") == 0) {
+            pressure->full_avg10 = avg10;
+            pressure->full_avg60 = avg60;
+            pressure->full_avg300 = avg300;
+            pressure->full_total = total;
+            found++;
+        }
+    }
+    fclose(fp);
+    return found ? 0 : -1;
+}
@@ -8,19 +8,179 @@
 #ifndef _NI_MALLOC_H_
 #define _NI_MALLOC_H_
 
+#include <stdio.h>
 #include <malloc.h>
 #define HAVE_MALLOC_SIZE        1
-#define ni_malloc_size(p)       malloc_usable_size(p)
+#define ni_malloc_libc_size(p)  malloc_usable_size(p)
+
+#ifdef __linux__
+#define HAVE_PROC_STAT          1
+#define HAVE_PROC_SMAPS         1
+#endif
+
+/* Memory a module holds in blocks of its own, registered with
+ * ni_malloc_register_info_source(). 'objects' is 0 for the sources that
+ * don't count them. */
+#define NI_MALLOC_INFO_SOURCES  8
+
+typedef struct ni_malloc_source {
+    const char  *name;
+    size_t      bytes;
+    size_t      objects;
+} ni_malloc_source;
+
+/* Figures of the allocators behind ni_malloc, see ni_malloc_get_info().
+ * 'allocated' is what the program holds, 'active' the pages containing it
+ * and 'resident' what the allocator keeps from the system. The blocks of
+ * the sources, like the arena chunks, are part of the libc, slab or huge
+ * figures as well. */
+typedef struct ni_malloc_info {
+    size_t  libc_allocated;
+    size_t  libc_active;
+    size_t  libc_resident;
+    size_t  slab_allocated;     /* Objects cached by threads included. */
+    size_t  slab_active;
+    size_t  slab_resident;
+    size_t  huge_allocated;
+    size_t  huge_resident;      /* Huge blocks are always active. */
+    int     sources;
+    ni_malloc_source source[NI_MALLOC_INFO_SOURCES];
+} ni_malloc_info;
+
+/* Memory map totals of a process in bytes, see ni_malloc_memory_report(). */
+typedef struct ni_malloc_mem_report {
+    size_t  rss;
+    size_t  pss;
+    size_t  pss_anon;
+    size_t  pss_file;
+    size_t  shared_clean;
+    size_t  shared_dirty;
+    size_t  private_clean;
+    size_t  private_dirty;
+    size_t  referenced;
+    size_t  anonymous;
+    size_t  lazy_free;
+    size_t  anon_huge_pages;
+    size_t  swap;
+    size_t  swap_pss;
+    size_t  locked;
+} ni_malloc_mem_report;
+
+/* Memory pressure stall information, see ni_malloc_get_memory_pressure().
+ * Averages are percentages, totals microseconds. */
+typedef struct ni_malloc_pressure {
+    float               some_avg10;
+    float               some_avg60;
+    float               some_avg300;
+    unsigned long long  some_total;
+    float               full_avg10;
+    float               full_avg60;
+    float               full_avg300;
+    unsigned long long  full_total;
+} ni_malloc_pressure;
+
+/* Allocation figures of a size class, see ni_malloc_get_size_classes().
+ * Objects fall in the class if their usable size is in (min_size,max_size].
+ * Live figures are the objects allocated and not yet freed, the others are
+ * cumulative since the start of the process: 'requested' versus 'usable'
+ * tells the internal slack of the class. */
+typedef struct ni_malloc_size_class {
+    size_t  min_size;
+    size_t  max_size;
+    size_t  live_objects;
+    size_t  live_bytes;         /* Usable bytes of the live objects. */
+    size_t  allocs;
+    size_t  requested;          /* Bytes asked by the callers. */
+    size_t  usable;             /* Bytes they got. */
+} ni_malloc_size_class;
+
+/* Allocations made by a thread inside a scope, see ni_malloc_scope_end().
+ * Bytes are the usable sizes of the blocks. */
+typedef struct ni_malloc_scope_stats {
+    size_t  allocs;
+    size_t  frees;
+    size_t  alloc_bytes;
+    size_t  free_bytes;
+} ni_malloc_scope_stats;
+
+/* The slab size classes, then powers of two up to 2^48 bytes. */
+#define NI_MALLOC_SIZE_CLASSES      56
+
+/* Output formats of ni_malloc_profile_dump(). */
+#define NI_MALLOC_PROFILE_PPROF     0
+#define NI_MALLOC_PROFILE_FOLDED    1
+
+/* Tags charging memory to the subsystem owning it, see ni_malloc_tagged().
+ * Tags from NI_MEM_USER up are handed out by ni_malloc_register_tag(). */
+#define NI_MEM_LIST                 0
+#define NI_MEM_STRING               1
+#define NI_MEM_ARENA                2
+#define NI_MEM_USER                 3
+#define NI_MEM_TAGS                 32
+
+/* Called when memory must be reclaimed, see ni_malloc_add_reclaim_callback(). */
+typedef size_t (*ni_malloc_reclaim_proc)(size_t bytes, void *privdata);
 
 void *ni_malloc(size_t size);
 void *ni_calloc(size_t mblock, size_t size);
 void *ni_realloc(void *ptr, size_t size);
 void ni_free(void *ptr);
+void *ni_malloc_sized(size_t size);
+void *ni_realloc_sized(void *ptr, size_t oldsize, size_t size);
+void ni_free_sized(void *ptr, size_t size);
+int ni_malloc_batch(size_t size, int n, void **out);
+void ni_free_batch(void **ptrs, int n);
+void ni_free_batch_sized(void **ptrs, int n, size_t size);
+void *ni_malloc_aligned(size_t size, size_t align);
+void ni_free_aligned(void *ptr);
+void *ni_malloc_tagged(size_t size, int tag);
+void *ni_malloc_sized_tagged(size_t size, int tag);
+void *ni_calloc_tagged(size_t mblock, size_t size, int tag);
+void *ni_realloc_tagged(void *ptr, size_t size, int tag);
+void ni_free_tagged(void *ptr, int tag);
+void *ni_realloc_sized_tagged(void *ptr, size_t oldsize, size_t size, int tag);
+void ni_free_sized_tagged(void *ptr, size_t size, int tag);
+int ni_malloc_batch_tagged(size_t size, int n, void **out, int tag);
+void ni_free_batch_tagged(void **ptrs, int n, int tag);
+void ni_free_batch_sized_tagged(void **ptrs, int n, size_t size, int tag);
+int ni_malloc_register_tag(const char *name);
+const char *ni_malloc_tag_name(int tag);
+int ni_malloc_get_tag_stats(int tag, size_t *bytes, size_t *count);
+size_t ni_malloc_size(void *ptr);
+int ni_malloc_enable_slab(int enable);
+void ni_malloc_tcache_flush(void);
+void ni_malloc_set_huge(size_t threshold, int thp);
+int ni_malloc_defrag_hint(void *ptr);
+void *ni_malloc_defrag(void *ptr);
 size_t ni_malloc_used_memory(void);
+size_t ni_malloc_used_memory_approx(void);
 void ni_malloc_set_oom_handler(void (*oom_handler)(size_t));
+void ni_malloc_set_limits(size_t soft, size_t hard);
+void ni_malloc_get_limits(size_t *soft, size_t *hard);
+int ni_malloc_add_reclaim_callback(ni_malloc_reclaim_proc proc, void *privdata);
+void ni_malloc_remove_reclaim_callback(ni_malloc_reclaim_proc proc, void *privdata);
+int ni_malloc_profile_start(size_t sample_bytes);
+void ni_malloc_profile_stop(void);
+int ni_malloc_profile_dump(FILE *fp, int format);
+int ni_malloc_get_size_classes(ni_malloc_size_class *classes);
+int ni_malloc_write_size_classes(FILE *fp);
+int ni_malloc_scope_begin(void);
+int ni_malloc_scope_end(ni_malloc_scope_stats *stats);
 size_t ni_malloc_get_rss(void);
+int ni_malloc_rss_sampler_start(int interval_ms);
+void ni_malloc_rss_sampler_stop(void);
+size_t ni_malloc_get_rss_sampled(long long *age_ms);
 int ni_malloc_get_allocator_info(size_t *allocated, size_t *active, size_t *resident);
+void ni_malloc_get_info(ni_malloc_info *info);
+int ni_malloc_register_info_source(const char *name, size_t (*bytes)(void),
+                                   size_t (*objects)(void));
+size_t ni_malloc_info_source_bytes(const ni_malloc_info *info, const char *name);
+int ni_malloc_write_allocator_info(FILE *fp);
+float ni_malloc_get_fragmentation_ratio(size_t rss);
 size_t ni_malloc_get_smap_bytes_by_field(char *field, long pid);
+int ni_malloc_memory_report(ni_malloc_mem_report *report, long pid);
 size_t ni_malloc_get_memory_size(void);
+int ni_malloc_get_cgroup_memory(size_t *limit, size_t *usage);
+int ni_malloc_get_memory_pressure(ni_malloc_pressure *pressure);
 
 #endif /* _NI_MALLOC_H_ */
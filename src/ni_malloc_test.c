@@ -1,8 +1,93 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "ni_test.h"
+#include "ni_atomic.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define ni_malloc_bench_cycles() __rdtsc()
+#else
+#define ni_malloc_bench_cycles() 0ULL
+#endif
 
 #define UNUSED(x) ((void)(x))
 
+#define NI_MALLOC_TEST_THREADS      4
+#define NI_MALLOC_TEST_BLOCKS       10000
+
+/* Reclaim callback of the limits test: frees the blocks of a pool. */
+static void *ni_malloc_test_pool[1024];
+static int ni_malloc_test_pool_len = 0;
+static int ni_malloc_test_reclaims = 0;
+
+static size_t ni_malloc_test_reclaim(size_t bytes, void *privdata) {
+    size_t freed = 0;
+    UNUSED(privdata);
+    ni_malloc_test_reclaims++;
+    while (freed < bytes && ni_malloc_test_pool_len) {
+        void *ptr = ni_malloc_test_pool[--ni_malloc_test_pool_len];
+        freed += ni_malloc_size(ptr);
+        ni_free(ptr);
+    }
+    return freed;
+}
+
+/* Allocate blocks on a thread that exits before they are freed, so that
+ * the shard of the thread is retired with a positive balance. */
+static void *ni_malloc_test_alloc_thread(void *arg) {
+    void **blocks = arg;
+    int j;
+    for (j = 0; j < NI_MALLOC_TEST_BLOCKS; j++)
+        blocks[j] = ni_malloc(64);
+    return NULL;
+}
+
+/* Grow, shrink and free huge blocks while the other threads do the same,
+ * checking that the content survives every move. */
+static void *ni_malloc_test_huge_thread(void *arg) {
+    long *ok = arg;
+    char *ptr;
+    int j;
+
+    *ok = 1;
+    for (j = 0; j < 50; j++) {
+        ptr = ni_malloc(2*1024*1024);
+        ptr[0] = (char)j;
+        ptr = ni_realloc(ptr, 9*1024*1024);
+        ptr[9*1024*1024-1] = (char)j;
+        ptr = ni_realloc(ptr, 3*1024*1024);
+        if (ptr[0] != (char)j || ni_malloc_size(ptr) < 3*1024*1024) *ok = 0;
+        ni_free(ptr);
+    }
+    return NULL;
+}
+
+static size_t ni_malloc_test_source_bytes(void) {
+    return 1234;
+}
+
+static ni_atomic int ni_malloc_test_limit_step = 0;
+pthread_mutex_t ni_malloc_test_limit_step_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Allocate a little, so that the thread is running before the hard limit
+ * is set, then try to go over it. */
+static void *ni_malloc_test_limit_thread(void *arg) {
+    int step;
+    ni_free(ni_malloc(16));
+    atomicSet(ni_malloc_test_limit_step, 1);
+    do {
+        atomicGet(ni_malloc_test_limit_step, step);
+    } while (step != 2);
+    *(void**)arg = ni_malloc(4*1024*1024);
+    return NULL;
+}
+
 int ni_malloc_test(int argc, char **argv) {
     void *ptr;
     UNUSED(argc);
@@ -14,5 +99,681 @@ int ni_malloc_test(int argc, char **argv) {
     printf("Reallocated to 456 bytes; used: %zu\n", ni_malloc_used_memory());
     ni_free(ptr);
     printf("Freed pointer; used: %zu\n", ni_malloc_used_memory());
+
+    {
+        static void *blocks[NI_MALLOC_TEST_THREADS][NI_MALLOC_TEST_BLOCKS];
+        pthread_t tids[NI_MALLOC_TEST_THREADS];
+        size_t initial = ni_malloc_used_memory(), used, approx;
+        int j, k;
+
+        for (j = 0; j < NI_MALLOC_TEST_THREADS; j++)
+            pthread_create(&tids[j], NULL, ni_malloc_test_alloc_thread, blocks[j]);
+        for (j = 0; j < NI_MALLOC_TEST_THREADS; j++)
+            pthread_join(tids[j], NULL);
+        used = ni_malloc_used_memory();
+        test_cond("Memory allocated by exited threads is still accounted",
+            used - initial >= (size_t)NI_MALLOC_TEST_THREADS * NI_MALLOC_TEST_BLOCKS * 64)
+
+        for (j = 0; j < NI_MALLOC_TEST_THREADS; j++)
+            for (k = 0; k < NI_MALLOC_TEST_BLOCKS; k++)
+                ni_free(blocks[j][k]);
+        used = ni_malloc_used_memory();
+        approx = ni_malloc_used_memory_approx();
+        test_cond("Freeing blocks of other threads balances the shards",
+            used == initial)
+        test_cond("Approximate used memory error is bounded",
+            (approx > used ? approx - used : used - approx) <= 64*1024)
+    }
+
+    {
+        size_t initial, sizes[] = {1, 8, 20, 24, 33, 100, 256};
+        void *ptrs[sizeof(sizes)/sizeof(sizes[0])];
+        unsigned char *p;
+        int j, zeroed = 1, classes = 1;
+
+        test_cond("Enable the slab layer", ni_malloc_enable_slab(1) == 0)
+        initial = ni_malloc_used_memory();
+        for (j = 0; j < (int)(sizeof(sizes)/sizeof(sizes[0])); j++) {
+            ptrs[j] = ni_malloc(sizes[j]);
+            if (ni_malloc_size(ptrs[j]) < sizes[j] ||
+                ni_malloc_size(ptrs[j]) - sizes[j] >= 16 ||
+                ((uintptr_t)ptrs[j] & 15) != 0) classes = 0;
+        }
+        test_cond("Slab objects are sized by their class and 16 bytes aligned", classes)
+        for (j = 0; j < (int)(sizeof(sizes)/sizeof(sizes[0])); j++)
+            ni_free(ptrs[j]);
+        test_cond("Slab allocations are accounted exactly",
+            ni_malloc_used_memory() == initial)
+
+        p = ni_calloc(10, 10);
+        for (j = 0; j < 100; j++) if (p[j]) zeroed = 0;
+        test_cond("ni_calloc() returns zeroed slab objects", zeroed &&
+            ni_malloc_size(p) >= 100)
+        memset(p, 'x', 100);
+        p = ni_realloc(p, 1000);
+        test_cond("ni_realloc() moves slab objects out of the slab",
+            ni_malloc_size(p) >= 1000 && p[0] == 'x' && p[99] == 'x')
+        p = ni_realloc(p, 40);
+        ni_free(p);
+        test_cond("Slab and libc reallocations balance",
+            ni_malloc_used_memory() == initial)
+
+        static void *blocks[NI_MALLOC_TEST_THREADS][NI_MALLOC_TEST_BLOCKS];
+        pthread_t tids[NI_MALLOC_TEST_THREADS];
+        for (j = 0; j < NI_MALLOC_TEST_THREADS; j++)
+            pthread_create(&tids[j], NULL, ni_malloc_test_alloc_thread, blocks[j]);
+        for (j = 0; j < NI_MALLOC_TEST_THREADS; j++)
+            pthread_join(tids[j], NULL);
+        for (j = 0; j < NI_MALLOC_TEST_THREADS; j++) {
+            int k;
+            for (k = 0; k < NI_MALLOC_TEST_BLOCKS; k++) ni_free(blocks[j][k]);
+        }
+        test_cond("Objects cached by threads are not accounted as used",
+            ni_malloc_used_memory() == initial)
+        {
+            ni_malloc_info flushed, refilled, reused;
+
+            /* After a flush the first allocation takes a whole batch from
+             * the slabs, the freed object then stays in the thread cache
+             * and is the next one handed out. */
+            ni_malloc_tcache_flush();
+            ni_malloc_get_info(&flushed);
+            ptrs[0] = ni_malloc(64);
+            ni_malloc_get_info(&refilled);
+            ni_free(ptrs[0]);
+            ptrs[1] = ni_malloc(64);
+            ni_malloc_get_info(&reused);
+            test_cond("Thread caches are refilled after a flush",
+                ni_malloc_size(ptrs[0]) == 64 &&
+                refilled.slab_allocated - flushed.slab_allocated > 64 &&
+                (refilled.slab_allocated - flushed.slab_allocated) % 64 == 0)
+            test_cond("Objects freed after a flush come back from the thread cache",
+                ptrs[1] == ptrs[0] && reused.slab_allocated == refilled.slab_allocated)
+            ni_free(ptrs[1]);
+        }
+
+        for (j = 0; j < (int)(sizeof(sizes)/sizeof(sizes[0])); j++)
+            ptrs[j] = ni_malloc_sized(sizes[j]);
+        ptrs[0] = ni_realloc_sized(ptrs[0], sizes[0], 7);
+        ptrs[1] = ni_realloc_sized(ptrs[1], sizes[1], 100);
+        for (j = 0; j < (int)(sizeof(sizes)/sizeof(sizes[0])); j++)
+            ni_free_sized(ptrs[j], j == 1 ? 100 : sizes[j]);
+        test_cond("Sized frees and reallocations balance",
+            ni_malloc_used_memory() == initial)
+
+        ni_malloc_batch(24, NI_MALLOC_TEST_THREADS, ptrs);
+        classes = 1;
+        for (j = 0; j < NI_MALLOC_TEST_THREADS; j++)
+            if (ptrs[j] == NULL || ni_malloc_size(ptrs[j]) != 32) classes = 0;
+        test_cond("ni_malloc_batch() serves small sizes from the slabs", classes)
+        ni_free_batch_sized(ptrs, NI_MALLOC_TEST_THREADS, 24);
+        ni_malloc_batch(1000, 2, ptrs);
+        ptrs[2] = NULL;
+        ni_free_batch_sized(ptrs, 3, 1000);
+        ptrs[0] = ni_malloc(8);
+        ptrs[1] = ni_malloc(1000);
+        ni_free_batch(ptrs, 2);
+        test_cond("Batch allocations and frees balance",
+            ni_malloc_used_memory() == initial)
+        ni_malloc_enable_slab(0);
+
+        ptrs[0] = ni_malloc_sized(1001);
+        test_cond("Sized libc blocks are accounted for the size asked",
+            ni_malloc_used_memory() == initial + 1008)
+        ptrs[0] = ni_realloc_sized(ptrs[0], 1001, 2000);
+        ptrs[1] = ni_malloc(1001);
+        ptrs[1] = ni_realloc_sized(ptrs[1], ni_malloc_size(ptrs[1]), 3000);
+        ni_free_sized(ptrs[0], 2000);
+        ni_free_sized(ptrs[1], 3000);
+        test_cond("Sized frees of libc blocks balance",
+            ni_malloc_used_memory() == initial)
+    }
+
+    {
+        size_t initial = ni_malloc_used_memory();
+        ni_malloc_info info;
+        char *ptr, *moved;
+        int j, zeroed = 1;
+
+        ni_malloc_set_huge(1024*1024, 1);
+        ptr = ni_calloc(1, 3*1024*1024);
+        for (j = 0; j < 3*1024*1024; j += 4096) if (ptr[j]) zeroed = 0;
+        ni_malloc_get_info(&info);
+        test_cond("Huge blocks are zeroed mappings", zeroed &&
+            ((uintptr_t)ptr & 4095) != 0 && ni_malloc_size(ptr) >= 3*1024*1024 &&
+            info.huge_allocated >= ni_malloc_size(ptr) &&
+            info.huge_resident > info.huge_allocated)
+        test_cond("Huge blocks are accounted exactly",
+            ni_malloc_used_memory() == initial + ni_malloc_size(ptr))
+        memset(ptr, 'x', 3*1024*1024);
+        moved = ni_realloc(ptr, 64*1024*1024);
+        test_cond("Huge blocks grow keeping their content",
+            moved[0] == 'x' && moved[3*1024*1024-1] == 'x' &&
+            ni_malloc_used_memory() == initial + ni_malloc_size(moved))
+        ptr = ni_realloc(moved, 2*1024*1024);
+        test_cond("Huge blocks shrink",
+            ptr[0] == 'x' && ni_malloc_size(ptr) < 3*1024*1024 &&
+            ni_malloc_used_memory() == initial + ni_malloc_size(ptr))
+        ni_free(ptr);
+        ni_malloc_get_info(&info);
+        test_cond("Freed huge blocks are unmapped",
+            info.huge_resident == 0 && ni_malloc_used_memory() == initial)
+
+        ptr = ni_malloc(1000);
+        memset(ptr, 'y', 1000);
+        ptr = ni_realloc(ptr, 2*1024*1024);
+        test_cond("libc blocks growing past the threshold become huge",
+            ptr[999] == 'y' && ((uintptr_t)ptr & 4095) == 64 &&
+            ni_malloc_used_memory() == initial + ni_malloc_size(ptr))
+        ni_free(ptr);
+        {
+            pthread_t tids[NI_MALLOC_TEST_THREADS];
+            long ok[NI_MALLOC_TEST_THREADS], all = 1;
+
+            for (j = 0; j < NI_MALLOC_TEST_THREADS; j++)
+                pthread_create(&tids[j], NULL, ni_malloc_test_huge_thread, &ok[j]);
+            for (j = 0; j < NI_MALLOC_TEST_THREADS; j++) {
+                pthread_join(tids[j], NULL);
+                all &= ok[j];
+            }
+            ni_malloc_get_info(&info);
+            test_cond("Huge blocks are resized by many threads at once", all &&
+                info.huge_resident == 0 && ni_malloc_used_memory() == initial)
+        }
+        ni_malloc_set_huge(0, 0);
+        ptr = ni_malloc(2*1024*1024);
+        ni_malloc_get_info(&info);
+        test_cond("Huge blocks can be disabled", info.huge_resident == 0)
+        ni_free(ptr);
+        ni_malloc_set_huge(1024*1024, 0);
+        test_cond("Huge and libc frees balance", ni_malloc_used_memory() == initial)
+    }
+
+    {
+        typedef struct {
+            ni_atomic size_t head;
+            NI_CACHE_PAD(pad, sizeof(size_t));
+            ni_atomic size_t tail;
+        } NI_CACHE_ALIGNED padded;
+        size_t initial = ni_malloc_used_memory();
+        size_t align;
+        void *ptr, *huge;
+        int aligned = 1, accounted = 1;
+
+        for (align = 1; align <= 8192; align <<= 1) {
+            size_t before = ni_malloc_used_memory();
+            ptr = ni_malloc_aligned(100, align);
+            if ((uintptr_t)ptr & (align - 1)) aligned = 0;
+            if (ni_malloc_used_memory() != before + ni_malloc_size(ptr)) accounted = 0;
+            memset(ptr, 'x', 100);
+            ni_free_aligned(ptr);
+        }
+        test_cond("ni_malloc_aligned() returns aligned blocks", aligned)
+        test_cond("Aligned blocks are accounted", accounted &&
+            ni_malloc_used_memory() == initial)
+        test_cond("Alignments must be powers of two",
+            ni_malloc_aligned(100, 48) == NULL && ni_malloc_aligned(100, 0) == NULL)
+        huge = ni_malloc_aligned(2*1024*1024, NI_CACHE_LINE);
+        ptr = ni_malloc_aligned(2*1024*1024, 4096);
+        test_cond("Large blocks are aligned too",
+            ((uintptr_t)huge & (NI_CACHE_LINE - 1)) == 0 &&
+            ((uintptr_t)ptr & 4095) == 0 &&
+            ni_malloc_used_memory() == initial + ni_malloc_size(huge) + ni_malloc_size(ptr))
+        ni_free_aligned(huge);
+        ni_free_aligned(ptr);
+        test_cond("Padded counters live on different cache lines",
+            sizeof(padded) == 2 * NI_CACHE_LINE &&
+            offsetof(padded, tail) == NI_CACHE_LINE &&
+            ni_malloc_used_memory() == initial)
+    }
+
+    {
+        ni_malloc_info before, after;
+        size_t allocated, active, resident, rss;
+        void *big, *small;
+        FILE *fp;
+        char buf[256];
+
+        ni_malloc_enable_slab(1);
+        ni_malloc_tcache_flush();
+        ni_malloc_get_info(&before);
+        big = ni_malloc(512*1024);
+        small = ni_malloc(48);
+        ni_malloc_get_info(&after);
+        test_cond("Allocator info reports libc blocks",
+            after.libc_allocated - before.libc_allocated >= 512*1024)
+        test_cond("Allocator info reports slab objects",
+            after.slab_allocated > before.slab_allocated &&
+            (after.slab_allocated - before.slab_allocated) % 48 == 0 &&
+            after.slab_active >= after.slab_allocated &&
+            after.slab_resident >= after.slab_active)
+        ni_malloc_get_allocator_info(&allocated, &active, &resident);
+        test_cond("Allocated <= active <= resident",
+            allocated <= active && active <= resident)
+        rss = ni_malloc_get_rss();
+        test_cond("Fragmentation ratio is computed from the RSS",
+            rss > 0 && ni_malloc_get_fragmentation_ratio(rss) > 0)
+        ni_malloc_register_info_source("test", ni_malloc_test_source_bytes, NULL);
+        ni_malloc_get_info(&after);
+        test_cond("Registered sources are part of the allocator info",
+            ni_malloc_info_source_bytes(&after, "test") == 1234 &&
+            ni_malloc_info_source_bytes(&after, "none") == 0)
+        fp = tmpfile();
+        ni_malloc_write_allocator_info(fp);
+        rewind(fp);
+        test_cond("Allocator info XML report",
+            fgets(buf, sizeof(buf), fp) != NULL &&
+            strncmp(buf, "<ni_malloc ", 11) == 0)
+        while (fgets(buf, sizeof(buf), fp) != NULL &&
+               strstr(buf, "<source name=\"test\"") == NULL);
+        test_cond("Allocator info XML report lists the sources",
+            strstr(buf, "bytes=\"1234\"") != NULL)
+        fclose(fp);
+        ni_free(big);
+        ni_free(small);
+        ni_malloc_enable_slab(0);
+    }
+
+    {
+        long long age = -1;
+        size_t rss;
+
+        rss = ni_malloc_get_rss_sampled(&age);
+        test_cond("Without the sampler the RSS is read right away",
+            rss > 0 && age == 0 && ni_malloc_get_rss_sampled(&age) > 0 && age == 0)
+        test_cond("Start the RSS sampler", ni_malloc_rss_sampler_start(10) == 0)
+        usleep(50000);
+        rss = ni_malloc_get_rss_sampled(&age);
+        test_cond("The RSS sample is recent", rss > 0 && age >= 0 && age < 1000)
+        ni_malloc_rss_sampler_stop();
+        usleep(30000);
+        ni_malloc_get_rss_sampled(&age);
+        test_cond("The RSS sample ages once the sampler stops", age >= 20)
+    }
+
+    {
+        ni_malloc_mem_report report;
+        size_t rss = ni_malloc_get_smap_bytes_by_field("Rss:", -1);
+
+        test_cond("Memory report from smaps_rollup",
+            ni_malloc_memory_report(&report, -1) == 0 && report.rss > 0 &&
+            report.private_dirty > 0 && report.pss <= report.rss)
+        test_cond("Memory report agrees with the smaps fields",
+            (report.rss > rss ? report.rss - rss : rss - report.rss) < report.rss / 10)
+    }
+
+    {
+        size_t limit, usage, size = ni_malloc_get_memory_size();
+        ni_malloc_pressure pressure;
+        int version = ni_malloc_get_cgroup_memory(&limit, &usage);
+
+        printf("cgroup v%d, limit: %zu, usage: %zu, memory size: %zu\n",
+            version, limit, usage, size);
+        test_cond("Memory size is bounded by the cgroup limit",
+            size > 0 && (limit == 0 || size <= limit))
+        test_cond("cgroup usage includes this process",
+            version == 0 || usage >= ni_malloc_get_rss() / 2)
+        if (ni_malloc_get_memory_pressure(&pressure) == 0) {
+            test_cond("Memory pressure averages are percentages",
+                pressure.some_avg10 >= 0 && pressure.some_avg10 <= 100 &&
+                pressure.full_avg300 <= pressure.some_avg300 + 0.01)
+        }
+    }
+
+    {
+        size_t used = ni_malloc_used_memory_approx(), soft, hard, before, size;
+        void *ptr, *small;
+        int j, failed = 0;
+
+        ni_malloc_add_reclaim_callback(ni_malloc_test_reclaim, NULL);
+        ni_malloc_set_limits(used + 1024*1024, 0);
+        ni_malloc_get_limits(&soft, &hard);
+        test_cond("Set the memory limits", soft == used + 1024*1024 && hard == 0)
+        for (j = 0; j < 1024; j++) {
+            /* The callback may shrink the pool inside ni_malloc(). */
+            ptr = ni_malloc(4096);
+            ni_malloc_test_pool[ni_malloc_test_pool_len++] = ptr;
+        }
+        test_cond("Crossing the soft limit calls the reclaim callbacks",
+            ni_malloc_test_reclaims > 0 && ni_malloc_test_pool_len < 1024)
+        test_cond("Reclaim keeps memory close to the soft limit",
+            ni_malloc_used_memory_approx() <= soft + 2*64*1024 + 4096)
+
+        ni_malloc_remove_reclaim_callback(ni_malloc_test_reclaim, NULL);
+        ni_malloc_enable_slab(1);
+        small = ni_malloc(200);
+        ni_malloc_set_limits(0, used + 2*1024*1024);
+        for (j = 0; j < 64 && !failed; j++) {
+            if ((ptr = ni_malloc(64*1024)) == NULL) failed = 1;
+            else ni_malloc_test_pool[ni_malloc_test_pool_len++] = ptr;
+        }
+        test_cond("Allocations over the hard limit fail", failed)
+        ptr = ni_malloc_test_pool[0];
+        test_cond("ni_realloc() over the hard limit keeps the block",
+            ni_realloc(ptr, 8*1024*1024) == NULL && ni_malloc_size(ptr) >= 4096)
+        before = ni_malloc_used_memory();
+        size = ni_malloc_size(small);
+        small = ni_realloc_sized(small, 200, 40);
+        test_cond("Shrinking over the hard limit moves to the smaller class",
+            small != NULL && ni_malloc_size(small) < 200)
+        ni_free_sized(small, 40);
+        test_cond("The shrunk block is freed from its new class",
+            ni_malloc_used_memory() == before - size)
+        ni_malloc_enable_slab(0);
+        test_cond("ni_calloc() refuses sizes that overflow",
+            ni_calloc((size_t)-1 / 2 + 2, 2) == NULL)
+        {
+            pthread_t tid;
+            void *big = NULL;
+            int step;
+
+            ni_malloc_set_limits(0, 0);
+            pthread_create(&tid, NULL, ni_malloc_test_limit_thread, &big);
+            do {
+                atomicGet(ni_malloc_test_limit_step, step);
+            } while (step != 1);
+            ni_malloc_set_limits(0, ni_malloc_used_memory() + 1024*1024);
+            atomicSet(ni_malloc_test_limit_step, 2);
+            pthread_join(tid, NULL);
+            test_cond("A new hard limit applies to running threads", big == NULL)
+            ni_free(big);
+            ni_malloc_set_limits(0, used + 2*1024*1024);
+        }
+        ni_malloc_add_reclaim_callback(ni_malloc_test_reclaim, NULL);
+        test_cond("The hard limit reclaims before failing",
+            (ptr = ni_malloc(512*1024)) != NULL)
+        ni_free(ptr);
+        ni_malloc_remove_reclaim_callback(ni_malloc_test_reclaim, NULL);
+        ni_malloc_set_limits(0, 0);
+        while (ni_malloc_test_pool_len)
+            ni_free(ni_malloc_test_pool[--ni_malloc_test_pool_len]);
+        ptr = ni_malloc(8*1024*1024);
+        test_cond("Allocations succeed again without limits", ptr != NULL)
+        ni_free(ptr);
+    }
+
+    {
+        static void *blocks[NI_MALLOC_TEST_BLOCKS];
+        char line[4096];
+        double bytes = 0;
+        int j, lines = 0;
+        FILE *fp;
+
+        test_cond("Start the heap profiler", ni_malloc_profile_start(4096) == 0)
+        for (j = 0; j < NI_MALLOC_TEST_BLOCKS; j++)
+            blocks[j] = ni_malloc(1000);
+        fp = tmpfile();
+        ni_malloc_profile_dump(fp, NI_MALLOC_PROFILE_FOLDED);
+        rewind(fp);
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            char *p = strrchr(line, ' ');
+            if (p) bytes += atof(p + 1);
+            lines++;
+        }
+        fclose(fp);
+        test_cond("Folded profile estimates the live bytes",
+            lines > 0 && bytes > NI_MALLOC_TEST_BLOCKS * 1000 * 0.7 &&
+            bytes < NI_MALLOC_TEST_BLOCKS * 1000 * 1.3)
+        fp = tmpfile();
+        ni_malloc_profile_dump(fp, NI_MALLOC_PROFILE_PPROF);
+        rewind(fp);
+        test_cond("pprof heap profile header",
+            fgets(line, sizeof(line), fp) != NULL &&
+            strncmp(line, "heap profile: ", 14) == 0 &&
+            strstr(line, "@ heap_v2/4096") != NULL)
+        fclose(fp);
+        for (j = 0; j < NI_MALLOC_TEST_BLOCKS; j++)
+            ni_free(blocks[j]);
+        fp = tmpfile();
+        ni_malloc_profile_dump(fp, NI_MALLOC_PROFILE_FOLDED);
+        test_cond("Freed allocations leave the profile", ftell(fp) == 0)
+        fclose(fp);
+        ni_malloc_profile_stop();
+    }
+
+    {
+        static void *blocks[NI_MALLOC_TEST_BLOCKS];
+        size_t bytes0, count0, bytes, count, sum = 0;
+        size_t lbytes0, lcount0, lbytes, lcount;
+        int j, tag = ni_malloc_register_tag("test");
+        ni_list *lst;
+
+        test_cond("Register a memory tag", tag >= NI_MEM_USER &&
+            strcmp(ni_malloc_tag_name(tag), "test") == 0 &&
+            ni_malloc_tag_name(NI_MEM_LIST) != NULL &&
+            ni_malloc_tag_name(NI_MEM_TAGS - 1) == NULL)
+        ni_malloc_get_tag_stats(tag, &bytes0, &count0);
+        for (j = 0; j < NI_MALLOC_TEST_BLOCKS; j++)
+            blocks[j] = ni_malloc_tagged(j % 2000, tag);
+        blocks[0] = ni_realloc_tagged(blocks[0], 5000, tag);
+        for (j = 0; j < NI_MALLOC_TEST_BLOCKS; j++)
+            sum += ni_malloc_size(blocks[j]);
+        ni_malloc_get_tag_stats(tag, &bytes, &count);
+        test_cond("Tagged allocations are charged to their tag",
+            bytes - bytes0 == sum && count - count0 == NI_MALLOC_TEST_BLOCKS)
+        for (j = 0; j < NI_MALLOC_TEST_BLOCKS; j++)
+            ni_free_tagged(blocks[j], tag);
+        ni_malloc_get_tag_stats(tag, &bytes, &count);
+        test_cond("Tagged frees balance", bytes == bytes0 && count == count0)
+
+        ni_malloc_get_tag_stats(NI_MEM_LIST, &lbytes0, &lcount0);
+        lst = ni_list_create();
+        for (j = 0; j < 1000; j++) ni_list_add_node_tail(lst, NULL);
+        ni_list_add_nodes_tail(lst, blocks, 1000);
+        ni_malloc_get_tag_stats(NI_MEM_LIST, &lbytes, &lcount);
+        test_cond("Lists charge their memory to NI_MEM_LIST",
+            lcount - lcount0 == 2001 &&
+            lbytes - lbytes0 >= 2000 * sizeof(ni_list_node) + sizeof(ni_list))
+        ni_list_release(lst);
+        ni_malloc_get_tag_stats(NI_MEM_LIST, &lbytes, &lcount);
+        test_cond("Released lists leave NI_MEM_LIST",
+            lbytes == lbytes0 && lcount == lcount0)
+        test_cond("Unregistered tags have no stats",
+            ni_malloc_get_tag_stats(NI_MEM_TAGS - 1, &bytes, &count) == -1)
+    }
+
+    {
+        static ni_malloc_size_class before[NI_MALLOC_SIZE_CLASSES];
+        static ni_malloc_size_class after[NI_MALLOC_SIZE_CLASSES];
+        static void *blocks[NI_MALLOC_TEST_BLOCKS];
+        size_t live = 0, requested = 0, usable = 0, sum = 0;
+        char line[256];
+        int j, ordered = 1;
+        FILE *fp;
+
+        ni_malloc_get_size_classes(before);
+        for (j = 0; j < NI_MALLOC_TEST_BLOCKS; j++) {
+            blocks[j] = ni_malloc(1 + j % 3000);
+            sum += ni_malloc_size(blocks[j]);
+        }
+        ni_malloc_get_size_classes(after);
+        for (j = 0; j < NI_MALLOC_SIZE_CLASSES; j++) {
+            live += after[j].live_objects - before[j].live_objects;
+            requested += after[j].requested - before[j].requested;
+            usable += after[j].usable - before[j].usable;
+            if (j && after[j].min_size != after[j-1].max_size) ordered = 0;
+        }
+        test_cond("Size classes are contiguous", ordered &&
+            after[0].min_size == 0 && after[NI_MALLOC_SIZE_CLASSES-1].max_size == (size_t)-1)
+        test_cond("Size classes count live objects and requested bytes",
+            live == NI_MALLOC_TEST_BLOCKS && usable == sum &&
+            requested == (size_t)(NI_MALLOC_TEST_BLOCKS / 3000) * 3000 * 3001 / 2 +
+                         (size_t)(NI_MALLOC_TEST_BLOCKS % 3000) * (NI_MALLOC_TEST_BLOCKS % 3000 + 1) / 2)
+        for (j = 0; j < NI_MALLOC_TEST_BLOCKS; j++)
+            ni_free(blocks[j]);
+        ni_malloc_get_size_classes(after);
+        live = 0;
+        for (j = 0; j < NI_MALLOC_SIZE_CLASSES; j++)
+            live += after[j].live_objects - before[j].live_objects;
+        test_cond("Freed objects leave the size classes", live == 0)
+        fp = tmpfile();
+        ni_malloc_write_size_classes(fp);
+        rewind(fp);
+        test_cond("Size classes report",
+            fgets(line, sizeof(line), fp) != NULL && strncmp(line, "size", 4) == 0 &&
+            fgets(line, sizeof(line), fp) != NULL && strchr(line, '%') != NULL)
+        fclose(fp);
+    }
+
+    {
+        ni_malloc_scope_stats stats, inner;
+        ni_list *lst = ni_list_create();
+        ni_list_iter iter;
+        ni_list_node *node;
+        ni_string s = ni_string_make_room_for(ni_string_empty(), 64);
+        void *ptr;
+        long j, sum = 0;
+
+        for (j = 0; j < 100; j++)
+            ni_list_add_node_tail(lst, (void*)j);
+        ptr = ni_malloc(100);
+        ni_malloc_scope_begin();
+        ni_free(ptr);
+        ni_malloc_scope_begin();
+        ptr = ni_malloc(1000);
+        ptr = ni_realloc(ptr, 5000);
+        ni_malloc_scope_end(&inner);
+        ni_malloc_scope_end(&stats);
+        test_cond("Scopes count the allocations of the thread",
+            inner.allocs == 2 && inner.frees == 1 &&
+            inner.alloc_bytes - inner.free_bytes == ni_malloc_size(ptr) &&
+            stats.allocs == 2 && stats.frees == 2)
+        ni_free(ptr);
+        test_cond("Scopes must be opened before closing them",
+            ni_malloc_scope_end(&stats) == -1)
+
+        ni_malloc_scope_begin();
+        ni_list_rewind(lst, &iter);
+        while ((node = ni_list_next(&iter)) != NULL)
+            sum += (long)lstNodeVal(node);
+        for (j = 0; j < 8; j++)
+            s = ni_string_cat_len(s, "abcdefgh", 8);
+        ni_malloc_scope_end(&stats);
+        test_cond("Iterating lists and appending to strings with room do not allocate",
+            stats.allocs == 0 && stats.frees == 0 && sum == 4950 &&
+            ni_string_len(s) == 64)
+        ni_string_obj_free(s);
+        ni_list_release(lst);
+    }
+    test_report()
+    return 0;
+}
+
+/* ----------------------------- Benchmarks -------------------------------- */
+
+#define NI_MALLOC_BENCH_MAX_THREADS     64
+#define NI_MALLOC_BENCH_OPS             1000000
+#define NI_MALLOC_BENCH_BATCH           64
+#define NI_MALLOC_BENCH_FREE_OBJS       (1024*1024)
+
+static long long ni_malloc_bench_ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/* Every thread allocates a small batch of blocks and frees them again, so
+ * that each operation goes through the used_memory accounting while the
+ * blocks themselves stay hot in the allocator caches. */
+static void *ni_malloc_bench_thread(void *arg) {
+    long ops = *(long *)arg;
+    void *ptrs[NI_MALLOC_BENCH_BATCH];
+    long i;
+    int j;
+
+    for (i = 0; i < ops; i += NI_MALLOC_BENCH_BATCH) {
+        for (j = 0; j < NI_MALLOC_BENCH_BATCH; j++)
+            ptrs[j] = ni_malloc(16 + (j & 7) * 8);
+        for (j = 0; j < NI_MALLOC_BENCH_BATCH; j++)
+            ni_free(ptrs[j]);
+    }
+    return NULL;
+}
+
+/* Measure ni_malloc()/ni_free() throughput while an increasing number of
+ * threads contend on the memory accounting. With a lock-free atomic backend
+ * the allocations/sec figure should grow with the number of threads instead
+ * of collapsing as soon as a second thread shows up.
+ *
+ * Usage: ni_malloc_bench([ops per thread]) */
+int ni_malloc_bench(int argc, char **argv) {
+    pthread_t tids[NI_MALLOC_BENCH_MAX_THREADS];
+    long ops = NI_MALLOC_BENCH_OPS;
+    int nthreads, slab, j;
+
+    if (argc > 1) ops = atol(argv[1]);
+    printf("ni_malloc contention benchmark (atomic backend: %s)\n", NI_ATOMIC_API);
+    for (slab = 0; slab <= 1; slab++) {
+        if (ni_malloc_enable_slab(slab) == -1) break;
+        printf("%s:\n", slab ? "slab + thread caches" : "libc malloc");
+        for (nthreads = 1; nthreads <= NI_MALLOC_BENCH_MAX_THREADS; nthreads *= 2) {
+            long long start = ni_malloc_bench_ustime(), elapsed;
+            double total = (double)ops * nthreads;
+
+            for (j = 0; j < nthreads; j++)
+                pthread_create(&tids[j], NULL, ni_malloc_bench_thread, &ops);
+            for (j = 0; j < nthreads; j++)
+                pthread_join(tids[j], NULL);
+            elapsed = ni_malloc_bench_ustime() - start;
+            if (elapsed == 0) elapsed = 1;
+            printf("%2d threads: %ld allocs/thread, %.0f allocs/sec, used: %zu\n",
+                nthreads, ops, total * 1000000 / elapsed, ni_malloc_used_memory());
+        }
+    }
+
+    /* Free path: the objects are freed in random order so that the metadata
+     * ni_free() has to read is usually not in the CPU caches. The sized
+     * round allocates with ni_malloc_sized(), so that ni_free_sized() skips
+     * malloc_usable_size() for the libc blocks and the slab header for the
+     * slab objects. The used memory must be back where it started after
+     * each round, or the two functions would not be comparable. */
+    {
+        static void *objs[NI_MALLOC_BENCH_FREE_OBJS];
+        static size_t sizes[NI_MALLOC_BENCH_FREE_OBJS];
+        int round;
+
+        printf("ni_malloc free path benchmark (%d objects)\n", NI_MALLOC_BENCH_FREE_OBJS);
+        for (slab = 0; slab <= 1; slab++) {
+            if (ni_malloc_enable_slab(slab) == -1) break;
+            /* The first round only warms up the slabs and is not reported. */
+            for (round = 0; round < 3; round++) {
+                int sized = round == 2;
+                unsigned long long cycles;
+                long long start, elapsed;
+                size_t used = ni_malloc_used_memory();
+
+                for (j = 0; j < NI_MALLOC_BENCH_FREE_OBJS; j++) {
+                    sizes[j] = 16 + (j & 7) * 8;
+                    objs[j] = sized ? ni_malloc_sized(sizes[j]) : ni_malloc(sizes[j]);
+                }
+                for (j = NI_MALLOC_BENCH_FREE_OBJS - 1; j > 0; j--) {
+                    int k = rand() % (j + 1);
+                    void *tp = objs[j]; size_t ts = sizes[j];
+                    objs[j] = objs[k]; sizes[j] = sizes[k];
+                    objs[k] = tp; sizes[k] = ts;
+                }
+                start = ni_malloc_bench_ustime();
+                cycles = ni_malloc_bench_cycles();
+                if (sized) {
+                    for (j = 0; j < NI_MALLOC_BENCH_FREE_OBJS; j++)
+                        ni_free_sized(objs[j], sizes[j]);
+                } else {
+                    for (j = 0; j < NI_MALLOC_BENCH_FREE_OBJS; j++)
+                        ni_free(objs[j]);
+                }
+                cycles = ni_malloc_bench_cycles() - cycles;
+                elapsed = ni_malloc_bench_ustime() - start;
+                ni_malloc_tcache_flush();
+                if (round == 0) continue;
+                printf("%-20s %-14s %.1f ns/free, %.1f cycles/free%s\n",
+                    slab ? "slab + thread caches" : "libc malloc",
+                    sized ? "ni_free_sized:" : "ni_free:",
+                    (double)elapsed * 1000 / NI_MALLOC_BENCH_FREE_OBJS,
+                    (double)cycles / NI_MALLOC_BENCH_FREE_OBJS,
+                    ni_malloc_used_memory() == used ? "" : " (unbalanced!)");
+            }
+        }
+    }
+    ni_malloc_enable_slab(0);
     return 0;
 }
@@ -61,23 +61,30 @@ static inline char ni_string_req_type(size_t ni_string_size) {
  * You can print the string with printf() as there is an implicit \0 at the
  * end of the string. However the string is binary safe and can contain
  * \0 characters in the middle, as the length is stored in the ni_string header. */
-ni_string ni_string_new_len(const void *init, size_t initlen) {
+static ni_string ni_string_new_len_generic(ni_arena *a, const void *init, size_t initlen) {
     void        *sh;
     ni_string   s;
     char type = ni_string_req_type(initlen);
     /* Empty strings are usually created in order to append. Use type 8
-     * since type 5 is not good at this. */
-    if (type == NI_STRING_TYPE_5 && initlen == 0)
+     * since type 5 is not good at this. Arena strings need the flags bits
+     * type 5 uses for the length. */
+    if (type == NI_STRING_TYPE_5 && (initlen == 0 || a))
         type = NI_STRING_TYPE_8;
     int hdrlen = ni_string_hdr_size(type);
     unsigned char *fp; /* flags pointer. */
+    unsigned char flags = type | (a ? NI_STRING_ARENA : 0);
 
-    sh = ni_string_malloc(hdrlen + initlen + 1);
+    if (a)
+        sh = ni_arena_alloc(a, hdrlen + initlen + 1);
+    else if (type == NI_STRING_TYPE_5)
+        sh = ni_string_malloc(hdrlen + initlen + 1);
+    else
+        sh = ni_string_malloc_sized(hdrlen + initlen + 1);
+    if (sh == NULL) return NULL;
     if (init == NI_STRING_NOINIT)
         init = NULL;
     else if (!init)
         memset(sh, 0, hdrlen + initlen + 1);
-    if (sh == NULL) return NULL;
     s = (char*)sh + hdrlen;
     fp = ((unsigned char*)s) - 1;
     switch(type) {
@@ -89,28 +96,28 @@ ni_string ni_string_new_len(const void *init, size_t initlen) {
             NI_STRING_HDR_VAR(8, s);
             sh->len = initlen;
             sh->alloc = initlen;
-            *fp = type;
+            *fp = flags;
             break;
         }
         case NI_STRING_TYPE_16: {
             NI_STRING_HDR_VAR(16, s);
             sh->len = initlen;
             sh->alloc = initlen;
-            *fp = type;
+            *fp = flags;
             break;
         }
         case NI_STRING_TYPE_32: {
             NI_STRING_HDR_VAR(32, s);
             sh->len = initlen;
             sh->alloc = initlen;
-            *fp = type;
+            *fp = flags;
             break;
         }
         case NI_STRING_TYPE_64: {
             NI_STRING_HDR_VAR(64, s);
             sh->len = initlen;
             sh->alloc = initlen;
-            *fp = type;
+            *fp = flags;
             break;
         }
     }
@@ -120,6 +127,19 @@ ni_string ni_string_new_len(const void *init, size_t initlen) {
     return s;
 }
 
+ni_string ni_string_new_len(const void *init, size_t initlen) {
+    return ni_string_new_len_generic(NULL, init, initlen);
+}
+
+/* Like ni_string_new_len() but the string is allocated from the arena 'a'
+ * and released by the next ni_arena_reset(). Arena strings can be used with
+ * all the ni_string functions: when one of them needs to grow the string,
+ * the string is moved to the heap and must then be freed as usual with
+ * ni_string_obj_free(), that is a no-op on strings still in the arena. */
+ni_string ni_string_new_len_arena(ni_arena *a, const void *init, size_t initlen) {
+    return ni_string_new_len_generic(a, init, initlen);
+}
+
 /* Create an empty (zero length) ni_string. Even in this case the string
  * always has an implicit null term. */
 ni_string ni_string_empty(void) {
@@ -137,10 +157,35 @@ ni_string ni_string_dup(const ni_string s) {
     return ni_string_new_len(s, ni_string_len(s));
 }
 
-/* Free an ni_string. No operation is performed if 's' is NULL. */
+/* Arena versions of ni_string_new() and ni_string_dup(). */
+ni_string ni_string_new_arena(ni_arena *a, const char *init) {
+    size_t initlen = (init == NULL) ? 0 : strlen(init);
+    return ni_string_new_len_arena(a, init, initlen);
+}
+
+ni_string ni_string_dup_arena(ni_arena *a, const ni_string s) {
+    return ni_string_new_len_arena(a, s, ni_string_len(s));
+}
+
+/* Give the allocation of the heap string 's' back to the allocator. All the
+ * headers but type 5 remember the size that was allocated, so those strings
+ * are allocated with ni_string_malloc_sized() and the allocator is told
+ * about their size instead of looking it up. */
+static void ni_string_release(ni_string s) {
+    char type = s[-1] & NI_STRING_TYPE_MASK;
+    void *sh = (char*)s - ni_string_hdr_size(type);
+
+    if (type == NI_STRING_TYPE_5)
+        ni_string_free(sh);
+    else
+        ni_string_free_sized(sh, ni_string_alloc_size(s));
+}
+
+/* Free an ni_string. No operation is performed if 's' is NULL or if it was
+ * allocated from an arena. */
 void ni_string_obj_free(ni_string s) {
-    if (s == NULL) return;
-    ni_string_free((char*)s - ni_string_hdr_size(s[-1]));
+    if (s == NULL || ni_string_is_arena(s)) return;
+    ni_string_release(s);
 }
 
 /* Set the ni_string length to the length as obtained with strlen(), so
@@ -203,17 +248,19 @@ ni_string ni_string_make_room_for(ni_string s, size_t addlen) {
     if (type == NI_STRING_TYPE_5) type = NI_STRING_TYPE_8;
 
     hdrlen = ni_string_hdr_size(type);
-    if (oldtype == type) {
-        newsh = ni_string_realloc(sh, hdrlen + newlen + 1);
+    if (oldtype == type && !ni_string_is_arena(s)) {
+        newsh = ni_string_realloc_sized(sh, ni_string_alloc_size(s),
+                                        hdrlen + newlen + 1);
         if (newsh == NULL) return NULL;
         s = (char*)newsh + hdrlen;
     } else {
         /* Since the header size changes, need to move the string forward,
-         * and can't use realloc */
-        newsh = ni_string_malloc(hdrlen + newlen + 1);
+         * and can't use realloc. Arena strings are moved to the heap, the
+         * old copy is left to the arena. */
+        newsh = ni_string_malloc_sized(hdrlen + newlen + 1);
         if (newsh == NULL) return NULL;
         memcpy((char*)newsh + hdrlen, s, len + 1);
-        ni_string_free(sh);
+        if (!ni_string_is_arena(s)) ni_string_release(s);
         s = (char*)newsh + hdrlen;
         s[-1] = type;
         ni_string_set_len(s, len);
@@ -236,8 +283,9 @@ ni_string ni_string_remove_free_space(ni_string s) {
     size_t avail = ni_string_avail(s);
     sh = (char*)s - oldhdrlen;
 
-    /* Return ASAP if there is no space left. */
-    if (avail == 0) return s;
+    /* Return ASAP if there is no space left. Arena strings can't give back
+     * memory to the arena. */
+    if (avail == 0 || ni_string_is_arena(s)) return s;
 
     /* Check what would be the minimum NI_STRING header that is just good enough to
      * fit this string. */
@@ -249,14 +297,16 @@ ni_string ni_string_remove_free_space(ni_string s) {
      * only if really needed. Otherwise if the change is huge, we manually
      * reallocate the string to use the different header type. */
     if (oldtype == type || type > NI_STRING_TYPE_8) {
-        newsh = ni_string_realloc(sh, oldhdrlen + len + 1);
+        newsh = ni_string_realloc_sized(sh, ni_string_alloc_size(s),
+                                        oldhdrlen + len + 1);
         if (newsh == NULL) return NULL;
         s = (char*)newsh + oldhdrlen;
     } else {
-        newsh = ni_string_malloc(hdrlen + len + 1);
+        newsh = type == NI_STRING_TYPE_5 ? ni_string_malloc(hdrlen + len + 1) :
+                                           ni_string_malloc_sized(hdrlen + len + 1);
         if (newsh == NULL) return NULL;
         memcpy((char*)newsh + hdrlen, s, len + 1);
-        ni_string_free(sh);
+        ni_string_release(s);
         s = (char*)newsh + hdrlen;
         s[-1] = type;
         ni_string_set_len(s, len);
@@ -283,6 +333,22 @@ void *ni_string_alloc_ptr(ni_string s) {
     return (void*)(s - ni_string_hdr_size(s[-1]));
 }
 
+/* Move the heap string 's' to a fresh allocation if it sits in a sparsely
+ * used slab, see ni_malloc_defrag(). Strings still in an arena are never
+ * moved.
+ *
+ * Returns the moved string, the old pointer is no longer valid, or NULL if
+ * 's' was not moved. */
+ni_string ni_string_defrag(ni_string s) {
+    size_t hdrlen;
+    char *newsh;
+
+    if (s == NULL || ni_string_is_arena(s)) return NULL;
+    hdrlen = ni_string_hdr_size(s[-1]);
+    if ((newsh = ni_malloc_defrag(s - hdrlen)) == NULL) return NULL;
+    return newsh + hdrlen;
+}
+
 /* Increment the ni_string length and decrements the left free space at the
  * end of the string according to 'incr'. Also set the null term
  * in the new end of the string.
@@ -787,14 +853,15 @@ int ni_string_cmp(const ni_string s1, const ni_string s2) {
  * requires length arguments. ni_string_split() is just the
  * same function but for zero-terminated strings.
  */
-ni_string *ni_string_split_len(const char *s, ssize_t len, const char *sep, int seplen, int *count) {
+static ni_string *ni_string_split_len_generic(ni_arena *a, const char *s, ssize_t len, const char *sep, int seplen, int *count) {
     int elements = 0, slots = 5;
     long start = 0, j;
     ni_string *tokens;
 
     if (seplen < 1 || len < 0) return NULL;
 
-    tokens = ni_string_malloc(sizeof(ni_string) * slots);
+    tokens = a ? ni_arena_alloc(a, sizeof(ni_string) * slots) :
+                 ni_string_malloc(sizeof(ni_string) * slots);
     if (tokens == NULL) return NULL;
 
     if (len == 0) {
@@ -807,13 +874,18 @@ ni_string *ni_string_split_len(const char *s, ssize_t len, const char *sep, int
             ni_string *newtokens;
 
             slots *= 2;
-            newtokens = ni_string_realloc(tokens, sizeof(ni_string) * slots);
+            if (a) {
+                newtokens = ni_arena_alloc(a, sizeof(ni_string) * slots);
+                if (newtokens) memcpy(newtokens, tokens, sizeof(ni_string) * elements);
+            } else {
+                newtokens = ni_string_realloc(tokens, sizeof(ni_string) * slots);
+            }
             if (newtokens == NULL) goto cleanup;
             tokens = newtokens;
         }
         /* search the separator */
         if ((seplen == 1 && *(s + j) == sep[0]) || (memcmp(s + j, sep, seplen) == 0)) {
-            tokens[elements] = ni_string_new_len(s + start, j - start);
+            tokens[elements] = ni_string_new_len_generic(a, s + start, j - start);
             if (tokens[elements] == NULL) goto cleanup;
             elements++;
             start = j + seplen;
@@ -821,7 +893,7 @@ ni_string *ni_string_split_len(const char *s, ssize_t len, const char *sep, int
         }
     }
     /* Add the final element. We are sure there is room in the tokens array. */
-    tokens[elements] = ni_string_new_len(s + start, len - start);
+    tokens[elements] = ni_string_new_len_generic(a, s + start, len - start);
     if (tokens[elements] == NULL) goto cleanup;
     elements++;
     *count = elements;
@@ -830,18 +902,33 @@ ni_string *ni_string_split_len(const char *s, ssize_t len, const char *sep, int
 cleanup:
     {
         int i;
-        for (i = 0; i < elements; i++) ni_string_free(tokens[i]);
-        ni_string_free(tokens);
+        /* Arena memory is released by the next reset of the arena. */
+        if (!a) {
+            for (i = 0; i < elements; i++) ni_string_obj_free(tokens[i]);
+            ni_string_free(tokens);
+        }
         *count = 0;
         return NULL;
     }
 }
 
+ni_string *ni_string_split_len(const char *s, ssize_t len, const char *sep, int seplen, int *count) {
+    return ni_string_split_len_generic(NULL, s, len, sep, seplen, count);
+}
+
+/* Like ni_string_split_len() but both the tokens and the array are
+ * allocated from the arena 'a'. The result must not be passed to
+ * ni_string_free_split_res(), it is released by the next reset of the
+ * arena. */
+ni_string *ni_string_split_len_arena(ni_arena *a, const char *s, ssize_t len, const char *sep, int seplen, int *count) {
+    return ni_string_split_len_generic(a, s, len, sep, seplen, count);
+}
+
 /* Free the result returned by ni_string_split_len(), or do nothing if 'tokens' is NULL. */
 void ni_string_free_split_res(ni_string *tokens, int count) {
     if (!tokens) return;
     while (count--)
-        ni_string_free(tokens[count]);
+        ni_string_obj_free(tokens[count]);
     ni_string_free(tokens);
 }
 
@@ -926,10 +1013,11 @@ int hex_digit_to_int(char c) {
  * quotes or closed quotes followed by non space characters
  * as in: "foo"bar or "foo'
  */
-ni_string *ni_string_split_args(const char *line, int *argc) {
+static ni_string *ni_string_split_args_generic(ni_arena *a, const char *line, int *argc) {
     const char *p = line;
     char *current = NULL;
     char **vector = NULL;
+    int slots = 0;
 
     *argc = 0;
     while (1) {
@@ -1013,26 +1101,60 @@ ni_string *ni_string_split_args(const char *line, int *argc) {
                 if (*p) p++;
             }
             /* add the token to the vector */
-            vector = ni_string_realloc(vector, ((*argc) + 1) * sizeof(char*));
-            vector[*argc] = current;
+            if (a) {
+                /* Copy the token to the arena and keep the heap buffer
+                 * to parse the next one. The vector can't be reallocated
+                 * so it is copied, doubling its size. */
+                if (*argc == slots) {
+                    char **newvector;
+                    slots = slots ? slots * 2 : 8;
+                    newvector = ni_arena_alloc(a, slots * sizeof(char*));
+                    if (newvector == NULL) goto err;
+                    if (*argc) memcpy(newvector, vector, (*argc) * sizeof(char*));
+                    vector = newvector;
+                }
+                vector[*argc] = ni_string_dup_arena(a, current);
+                if (vector[*argc] == NULL) goto err;
+                ni_string_clear(current);
+            } else {
+                vector = ni_string_realloc(vector, ((*argc) + 1) * sizeof(char*));
+                vector[*argc] = current;
+                current = NULL;
+            }
             (*argc)++;
-            current = NULL;
         } else {
+            if (current) ni_string_obj_free(current);
             /* Even on empty input string return something not NULL. */
-            if (vector == NULL) vector = ni_string_malloc(sizeof(void*));
+            if (vector == NULL)
+                vector = a ? ni_arena_alloc(a, sizeof(void*)) :
+                             ni_string_malloc(sizeof(void*));
             return vector;
         }
     }
 
 err:
-    while ((*argc)--)
-        ni_string_free(vector[*argc]);
-    ni_string_free(vector);
-    if (current) ni_string_free(current);
+    if (!a) {
+        while ((*argc)--)
+            ni_string_obj_free(vector[*argc]);
+        ni_string_free(vector);
+    }
+    if (current) ni_string_obj_free(current);
     *argc = 0;
     return NULL;
 }
 
+ni_string *ni_string_split_args(const char *line, int *argc) {
+    return ni_string_split_args_generic(NULL, line, argc);
+}
+
+/* Like ni_string_split_args() but both the arguments and the array are
+ * allocated from the arena 'a', so that they are all released by the next
+ * reset of the arena. Only one heap buffer is used while parsing, however
+ * many arguments the line has. */
+ni_string *ni_string_split_args_arena(ni_arena *a, const char *line, int *argc) {
+    return ni_string_split_args_generic(a, line, argc);
+}
+
 /* Modify the string substituting all the occurrences of the set of
  * characters specified in the 'from' string to the corresponding character
  * in the 'to' array.
@@ -1086,6 +1208,9 @@ ni_string ni_string_join_ni_string(ni_string *argv, int argc, const char *sep, s
  * the overhead of function calls. Here we define these wrappers only for
  * the programs ni_string is linked to, if they want to touch the ni_string internals
  * even if they use a different allocator. */
-void *ni_string_malloc(size_t size) { return ni_malloc(size); }
-void *ni_string_realloc(void *ptr, size_t size) { return ni_realloc(ptr, size); }
-void ni_string_free(void *ptr) { ni_free(ptr); }
+void *ni_string_malloc(size_t size) { return ni_malloc_tagged(size, NI_MEM_STRING); }
+void *ni_string_malloc_sized(size_t size) { return ni_malloc_sized_tagged(size, NI_MEM_STRING); }
+void *ni_string_realloc(void *ptr, size_t size) { return ni_realloc_tagged(ptr, size, NI_MEM_STRING); }
+void ni_string_free(void *ptr) { ni_free_tagged(ptr, NI_MEM_STRING); }
+void *ni_string_realloc_sized(void *ptr, size_t oldsize, size_t size) { return ni_realloc_sized_tagged(ptr, oldsize, size, NI_MEM_STRING); }
+void ni_string_free_sized(void *ptr, size_t size) { ni_free_sized_tagged(ptr, size, NI_MEM_STRING); }
@@ -14,6 +14,7 @@ const char *NI_STRING_NOINIT;
 #include <sys/types.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include "ni_arena.h"
 
 typedef char *ni_string;
 
@@ -26,25 +27,25 @@ struct __attribute__ ((__packed__)) ni_string_hdr5 {
 struct __attribute__ ((__packed__)) ni_string_hdr8 {
     uint8_t len; /* used */
     uint8_t alloc; /* excluding the header and null terminator */
-    unsigned char flags; /* 3 lsb of type, 5 unused bits */
+    unsigned char flags; /* 3 lsb of type, arena bit, 4 unused bits */
     char buf[];
 };
 struct __attribute__ ((__packed__)) ni_string_hdr16 {
     uint16_t len; /* used */
     uint16_t alloc; /* excluding the header and null terminator */
-    unsigned char flags; /* 3 lsb of type, 5 unused bits */
+    unsigned char flags; /* 3 lsb of type, arena bit, 4 unused bits */
     char buf[];
 };
 struct __attribute__ ((__packed__)) ni_string_hdr32 {
     uint32_t len; /* used */
     uint32_t alloc; /* excluding the header and null terminator */
-    unsigned char flags; /* 3 lsb of type, 5 unused bits */
+    unsigned char flags; /* 3 lsb of type, arena bit, 4 unused bits */
     char buf[];
 };
 struct __attribute__ ((__packed__)) ni_string_hdr64 {
     uint64_t len; /* used */
     uint64_t alloc; /* excluding the header and null terminator */
-    unsigned char flags; /* 3 lsb of type, 5 unused bits */
+    unsigned char flags; /* 3 lsb of type, arena bit, 4 unused bits */
     char buf[];
 };
 
@@ -55,10 +56,20 @@ struct __attribute__ ((__packed__)) ni_string_hdr64 {
 #define NI_STRING_TYPE_64       4
 #define NI_STRING_TYPE_MASK     7
 #define NI_STRING_TYPE_BITS     3
+/* Strings allocated from an ni_arena are never freed or reallocated in
+ * place. They are never of type 5, that has no room for the flag. */
+#define NI_STRING_ARENA         8
 #define NI_STRING_HDR_VAR(T, s) struct ni_string_hdr##T *sh = (void*)((s) - (sizeof(struct ni_string_hdr##T)));
 #define NI_STRING_HDR(T, s) ((struct ni_string_hdr##T *)((s) - (sizeof(struct ni_string_hdr##T))))
 #define NI_STRING_TYPE_5_LEN(f) ((f) >> NI_STRING_TYPE_BITS)
 
+/* True if 's' lives in an arena. Type 5 strings never do. */
+static inline int ni_string_is_arena(const ni_string s) {
+    unsigned char flags = s[-1];
+    return (flags & NI_STRING_TYPE_MASK) != NI_STRING_TYPE_5 &&
+           (flags & NI_STRING_ARENA);
+}
+
 static inline size_t ni_string_len(const ni_string s) {
     unsigned char flags = s[-1];
     switch (flags & NI_STRING_TYPE_MASK) {
@@ -192,6 +203,9 @@ ni_string ni_string_new_len(const void *init, size_t initlen);
 ni_string ni_string_new(const char *init);
 ni_string ni_string_empty(void);
 ni_string ni_string_dup(const ni_string s);
+ni_string ni_string_new_len_arena(ni_arena *a, const void *init, size_t initlen);
+ni_string ni_string_new_arena(ni_arena *a, const char *init);
+ni_string ni_string_dup_arena(ni_arena *a, const ni_string s);
 void ni_string_obj_free(ni_string s);
 ni_string ni_string_grow_zero(ni_string s, size_t len);
 ni_string ni_string_cat_len(ni_string s, const void *t, size_t len);
@@ -221,6 +235,8 @@ void ni_string_toupper(ni_string s);
 ni_string ni_string_from_longlong(long long value);
 ni_string ni_string_cat_repr(ni_string s, const char *p, size_t len);
 ni_string *ni_string_split_args(const char *line, int *argc);
+ni_string *ni_string_split_len_arena(ni_arena *a, const char *s, ssize_t len, const char *sep, int seplen, int *count);
+ni_string *ni_string_split_args_arena(ni_arena *a, const char *line, int *argc);
 ni_string ni_string_map_chars(ni_string s, const char *from, const char *to, size_t setlen);
 ni_string ni_string_join(char **argv, int argc, char *sep);
 ni_string ni_string_join_ni_string(ni_string *argv, int argc, const char *sep, size_t seplen);
@@ -231,13 +247,17 @@ void ni_string_incr_len(ni_string s, ssize_t incr);
 ni_string ni_string_remove_free_space(ni_string s);
 size_t ni_string_alloc_size(ni_string s);
 void *ni_string_alloc_ptr(ni_string s);
+ni_string ni_string_defrag(ni_string s);
 
 /* Export the allocator used by ni_string to the program using ni_string.
  * Sometimes the program ni_string is linked to, may use a different set of
  * allocators, but may want to allocate or free things that ni_string will
  * respectively free or allocate. */
 void *ni_string_malloc(size_t size);
+void *ni_string_malloc_sized(size_t size);
 void *ni_string_realloc(void *ptr, size_t size);
 void ni_string_free(void *ptr);
+void *ni_string_realloc_sized(void *ptr, size_t oldsize, size_t size);
+void ni_string_free_sized(void *ptr, size_t size);
 
 #endif /* _NI_STRING_H_ */
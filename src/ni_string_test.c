@@ -9,7 +9,7 @@ int ni_string_test() {
         test_cond("Create a string and obtain the length",
             ni_string_len(x) == 3 && memcmp(x, "foo\0", 4) == 0)
 
-        ni_string_free(x);
+        ni_string_obj_free(x);
         x = ni_string_new_len("foo", 2);
         test_cond("Create a string with specified length",
             ni_string_len(x) == 2 && memcmp(x, "fo\0", 3) == 0)
@@ -27,12 +27,12 @@ int ni_string_test() {
             ni_string_len(x) == 33 &&
             memcmp(x, "xyzxxxxxxxxxxyyyyyyyyyykkkkkkkkkk\0", 33) == 0)
 
-        ni_string_free(x);
+        ni_string_obj_free(x);
         x = ni_string_cat_printf(ni_string_empty(), "%d", 123);
         test_cond("ni_string_cat_printf() seems working in the base case",
             ni_string_len(x) == 3 && memcmp(x, "123\0", 4) == 0)
 
-        ni_string_free(x);
+        ni_string_obj_free(x);
         x = ni_string_new("--");
         x = ni_string_cat_fmt(x, "Hello %s World %I,%I--", "Hi!", LLONG_MIN, LLONG_MAX);
         test_cond("ni_string_cat_fmt() seems working in the base case",
@@ -41,26 +41,26 @@ int ni_string_test() {
                 "9223372036854775807--", 60) == 0)
         printf("[%s]\n", x);
 
-        ni_string_free(x);
+        ni_string_obj_free(x);
         x = ni_string_new("--");
         x = ni_string_cat_fmt(x, "%u,%U--", UINT_MAX, ULLONG_MAX);
         test_cond("ni_string_cat_fmt() seems working with unsigned numbers",
             ni_string_len(x) == 35 &&
             memcmp(x, "--4294967295,18446744073709551615--", 35) == 0)
 
-        ni_string_free(x);
+        ni_string_obj_free(x);
         x = ni_string_new(" x ");
         ni_string_trim(x, " x");
         test_cond("ni_string_trim() works when all chars match",
             ni_string_len(x) == 0)
 
-        ni_string_free(x);
+        ni_string_obj_free(x);
         x = ni_string_new(" x ");
         ni_string_trim(x, " ");
         test_cond("ni_string_trim() works when a single char remains",
             ni_string_len(x) == 1 && x[0] == 'x')
 
-        ni_string_free(x);
+        ni_string_obj_free(x);
         x = ni_string_new("xxciaoyyy");
         ni_string_trim(x, "xy");
         test_cond("ni_string_trim() correctly trims characters",
@@ -71,56 +71,56 @@ int ni_string_test() {
         test_cond("ni_string_range(...,1,1)",
             ni_string_len(y) == 1 && memcmp(y, "i\0", 2) == 0)
 
-        ni_string_free(y);
+        ni_string_obj_free(y);
         y = ni_string_dup(x);
         ni_string_range(y, 1, -1);
         test_cond("ni_string_range(...,1,-1)",
             ni_string_len(y) == 3 && memcmp(y, "iao\0", 4) == 0)
 
-        ni_string_free(y);
+        ni_string_obj_free(y);
         y = ni_string_dup(x);
         ni_string_range(y, -2, -1);
         test_cond("ni_string_range(...,-2,-1)",
             ni_string_len(y) == 2 && memcmp(y, "ao\0", 3) == 0)
 
-        ni_string_free(y);
+        ni_string_obj_free(y);
         y = ni_string_dup(x);
         ni_string_range(y, 2, 1);
         test_cond("ni_string_range(...,2,1)",
             ni_string_len(y) == 0 && memcmp(y, "\0", 1) == 0)
 
-        ni_string_free(y);
+        ni_string_obj_free(y);
         y = ni_string_dup(x);
         ni_string_range(y, 1, 100);
         test_cond("ni_string_range(...,1,100)",
             ni_string_len(y) == 3 && memcmp(y, "iao\0", 4) == 0)
 
-        ni_string_free(y);
+        ni_string_obj_free(y);
         y = ni_string_dup(x);
         ni_string_range(y, 100, 100);
         test_cond("ni_string_range(...,100,100)",
             ni_string_len(y) == 0 && memcmp(y, "\0", 1) == 0)
 
-        ni_string_free(y);
-        ni_string_free(x);
+        ni_string_obj_free(y);
+        ni_string_obj_free(x);
         x = ni_string_new("foo");
         y = ni_string_new("foa");
         test_cond("ni_string_cmp(foo, foa)", ni_string_cmp(x, y) > 0)
 
-        ni_string_free(y);
-        ni_string_free(x);
+        ni_string_obj_free(y);
+        ni_string_obj_free(x);
         x = ni_string_new("bar");
         y = ni_string_new("bar");
         test_cond("ni_string_cmp(bar, bar)", ni_string_cmp(x, y) == 0)
 
-        ni_string_free(y);
-        ni_string_free(x);
+        ni_string_obj_free(y);
+        ni_string_obj_free(x);
         x = ni_string_new("aar");
         y = ni_string_new("bar");
         test_cond("ni_string_cmp(bar, bar)", ni_string_cmp(x, y) < 0)
 
-        ni_string_free(y);
-        ni_string_free(x);
+        ni_string_obj_free(y);
+        ni_string_obj_free(x);
         x = ni_string_new_len("\a\n\0foo\r", 7);
         y = ni_string_cat_repr(ni_string_empty(), x, ni_string_len(x));
         test_cond("ni_string_cat_repr(...data...)",
@@ -131,8 +131,8 @@ int ni_string_test() {
             char *p;
             int step = 10, j, i;
 
-            ni_string_free(x);
-            ni_string_free(y);
+            ni_string_obj_free(x);
+            ni_string_obj_free(y);
             x = ni_string_new("0");
             test_cond("ni_string_new() free/len buffers", ni_string_len(x) == 1 && ni_string_avail(x) == 0);
 
@@ -158,7 +158,7 @@ int ni_string_test() {
                 memcmp("0ABCDEFGHIJABCDEFGHIJABCDEFGHIJABCDEFGHIJABCDEFGHIJABCDEFGHIJABCDEFGHIJABCDEFGHIJABCDEFGHIJABCDEFGHIJ", x, 101) == 0);
             test_cond("ni_string_make_room_for() final length", ni_string_len(x) == 101);
 
-            ni_string_free(x);
+            ni_string_obj_free(x);
         }
     }
     test_report()
@@ -0,0 +1,88 @@
+/* ni_sync.c - Spinlock, seqlock and reader-writer lock
+ *
+ * Locks for the shared structures whose critical sections are too short to
+ * pay a pthread mutex, that costs a system call as soon as it is contended.
+ * Waiters spin with exponential backoff and give the CPU away once the
+ * backoff reached its maximum, so that they degrade gracefully when there
+ * are more threads than CPUs. The fast paths are inline in ni_sync.h.
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#include <sched.h>
+#include "ni_sync.h"
+
+/* Wait before looking at a lock again, doubling the wait every time. */
+void ni_spin_backoff(int *backoff) {
+    int j;
+
+    if (*backoff >= NI_SPIN_BACKOFF_MAX) {
+        sched_yield();
+        return;
+    }
+    for (j = 0; j < *backoff; j++) ni_cpu_relax();
+    *backoff <<= 1;
+}
+
+/* Called by ni_spin_lock() when the lock is taken: wait for the lock to
+ * look free before trying the exchange again. */
+void ni_spin_lock_slow(ni_spinlock *l) {
+    int backoff = 1;
+
+    do {
+        while (ni_sync_load_relaxed(&l->locked))
+            ni_spin_backoff(&backoff);
+    } while (ni_sync_xchg(&l->locked, 1) != 0);
+}
+
+/* Take the lock for reading unless a writer holds it or waits for it.
+ *
+ * Returns 1 if the lock was taken, 0 otherwise. */
+int ni_rwlock_tryrdlock(ni_rwlock *rw) {
+    int state;
+
+    while (ni_sync_load_relaxed(&rw->writers) == 0) {
+        state = ni_sync_load_relaxed(&rw->state);
+        if (state & NI_RWLOCK_WRITER) break;
+        if (ni_sync_cas(&rw->state, state, state + NI_RWLOCK_READER)) return 1;
+    }
+    return 0;
+}
+
+void ni_rwlock_rdlock(ni_rwlock *rw) {
+    int backoff = 1;
+
+    while (!ni_rwlock_tryrdlock(rw)) ni_spin_backoff(&backoff);
+}
+
+void ni_rwlock_rdunlock(ni_rwlock *rw) {
+    ni_sync_add(&rw->state, -NI_RWLOCK_READER);
+}
+
+/* Take the lock for writing if nobody holds it.
+ *
+ * Returns 1 if the lock was taken, 0 otherwise. */
+int ni_rwlock_trywrlock(ni_rwlock *rw) {
+    if (ni_sync_load_relaxed(&rw->state) != 0 ||
+        !ni_sync_cas(&rw->state, 0, NI_RWLOCK_WRITER)) return 0;
+    ni_sync_add(&rw->writers, 1);
+    return 1;
+}
+
+/* Take the lock for writing. The writer is announced first, so that no
+ * new reader gets in while it waits for the current ones to leave. */
+void ni_rwlock_wrlock(ni_rwlock *rw) {
+    int backoff = 1;
+
+    ni_sync_add(&rw->writers, 1);
+    while (ni_sync_load_relaxed(&rw->state) != 0 ||
+           !ni_sync_cas(&rw->state, 0, NI_RWLOCK_WRITER))
+        ni_spin_backoff(&backoff);
+}
+
+void ni_rwlock_wrunlock(ni_rwlock *rw) {
+    ni_sync_store(&rw->state, 0);
+    ni_sync_add(&rw->writers, -1);
+}
@@ -0,0 +1,157 @@
+/* ni_sync.h - Spinlock, seqlock and reader-writer lock
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#ifndef _NI_SYNC_H_
+#define _NI_SYNC_H_
+
+/* The locks of this file need an atomic exchange and compare-and-swap, so
+ * unlike the ni_atomic.h counters they have no mutex fallback: they are
+ * built on the __atomic builtins, or on the __sync ones for older GCC.
+ * Compare-and-swap is always a full barrier. */
+#if defined(__ATOMIC_ACQUIRE)
+#define ni_sync_load(ptr) __atomic_load_n(ptr,__ATOMIC_ACQUIRE)
+#define ni_sync_load_relaxed(ptr) __atomic_load_n(ptr,__ATOMIC_RELAXED)
+#define ni_sync_store(ptr,val) __atomic_store_n(ptr,val,__ATOMIC_RELEASE)
+#define ni_sync_store_relaxed(ptr,val) __atomic_store_n(ptr,val,__ATOMIC_RELAXED)
+#define ni_sync_xchg(ptr,val) __atomic_exchange_n(ptr,val,__ATOMIC_ACQUIRE)
+#define ni_sync_add(ptr,val) __atomic_add_fetch(ptr,val,__ATOMIC_RELEASE)
+#define ni_sync_fence_acquire() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define ni_sync_fence_release() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define ni_sync_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define ni_sync_load(ptr) __sync_add_and_fetch(ptr,0)
+#define ni_sync_load_relaxed(ptr) (*(volatile __typeof__(*(ptr))*)(ptr))
+#define ni_sync_store(ptr,val) do { \
+    __sync_synchronize(); *(volatile __typeof__(*(ptr))*)(ptr) = (val); \
+} while(0)
+#define ni_sync_store_relaxed(ptr,val) (*(volatile __typeof__(*(ptr))*)(ptr) = (val))
+#define ni_sync_xchg(ptr,val) __sync_lock_test_and_set(ptr,val)
+#define ni_sync_add(ptr,val) __sync_add_and_fetch(ptr,val)
+#define ni_sync_fence_acquire() __sync_synchronize()
+#define ni_sync_fence_release() __sync_synchronize()
+#define ni_sync_fence() __sync_synchronize()
+#endif
+#define ni_sync_cas(ptr,old,val) __sync_bool_compare_and_swap(ptr,old,val)
+
+/* Tell the CPU we are spinning: it saves power and frees the pipeline for
+ * the other hyper-thread of the core. */
+#if defined(__x86_64__) || defined(__i386__)
+#define ni_cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define ni_cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define ni_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* Waiters spin for 1, 2, 4, ... up to NI_SPIN_BACKOFF_MAX pause hints
+ * between two looks at the lock, then yield the CPU, since the holder may
+ * not be running at all when there are more threads than CPUs. */
+#define NI_SPIN_BACKOFF_MAX     1024
+
+/* Test-and-test-and-set spinlock. Waiters spin reading the lock, that does
+ * not steal its cache line from the holder, and only try to take it once
+ * they see it free. Meant for critical sections of a few instructions. */
+typedef struct ni_spinlock {
+    int locked;
+} ni_spinlock;
+
+#define NI_SPINLOCK_INIT { 0 }
+
+/* Sequence lock: readers never write to shared memory, they read the data
+ * and retry if a writer was active meanwhile. Good for snapshots of small
+ * read-mostly data like statistics. Readers must copy the data without
+ * dereferencing pointers in it, since it may change under them:
+ *
+ *  unsigned seq;
+ *  do {
+ *      seq = ni_seqlock_read_begin(&sl);
+ *      copy = stats;
+ *  } while (ni_seqlock_read_retry(&sl, seq));
+ */
+typedef struct ni_seqlock {
+    unsigned    seq;        /* Odd while a writer is active. */
+    ni_spinlock lock;       /* Serializes the writers. */
+} ni_seqlock;
+
+#define NI_SEQLOCK_INIT { 0, NI_SPINLOCK_INIT }
+
+/* Writer-preferring reader-writer lock: once a writer waits no new reader
+ * gets in, so a steady flow of readers can't starve the writers. */
+typedef struct ni_rwlock {
+    int state;              /* Readers << 1 | writer active. */
+    int writers;            /* Writers waiting or active. */
+} ni_rwlock;
+
+#define NI_RWLOCK_INIT { 0, 0 }
+#define NI_RWLOCK_WRITER 1
+#define NI_RWLOCK_READER 2
+
+void ni_spin_backoff(int *backoff);
+void ni_spin_lock_slow(ni_spinlock *l);
+
+static inline void ni_spin_init(ni_spinlock *l) {
+    l->locked = 0;
+}
+
+static inline int ni_spin_trylock(ni_spinlock *l) {
+    return ni_sync_load_relaxed(&l->locked) == 0 && ni_sync_xchg(&l->locked, 1) == 0;
+}
+
+static inline void ni_spin_lock(ni_spinlock *l) {
+    if (ni_sync_xchg(&l->locked, 1) != 0) ni_spin_lock_slow(l);
+}
+
+static inline void ni_spin_unlock(ni_spinlock *l) {
+    ni_sync_store(&l->locked, 0);
+}
+
+static inline void ni_seqlock_init(ni_seqlock *sl) {
+    sl->seq = 0;
+    ni_spin_init(&sl->lock);
+}
+
+/* Return the sequence to pass to ni_seqlock_read_retry(), waiting for the
+ * active writer if any. */
+static inline unsigned ni_seqlock_read_begin(ni_seqlock *sl) {
+    unsigned seq;
+    int backoff = 1;
+
+    while ((seq = ni_sync_load(&sl->seq)) & 1) ni_spin_backoff(&backoff);
+    return seq;
+}
+
+/* Return 1 if a writer changed the data since ni_seqlock_read_begin(). */
+static inline int ni_seqlock_read_retry(ni_seqlock *sl, unsigned seq) {
+    ni_sync_fence_acquire();
+    return ni_sync_load_relaxed(&sl->seq) != seq;
+}
+
+static inline void ni_seqlock_write_lock(ni_seqlock *sl) {
+    ni_spin_lock(&sl->lock);
+    ni_sync_store_relaxed(&sl->seq, sl->seq + 1);
+    ni_sync_fence_release();
+}
+
+static inline void ni_seqlock_write_unlock(ni_seqlock *sl) {
+    ni_sync_store(&sl->seq, sl->seq + 1);
+    ni_spin_unlock(&sl->lock);
+}
+
+static inline void ni_rwlock_init(ni_rwlock *rw) {
+    rw->state = 0;
+    rw->writers = 0;
+}
+
+/* Prototypes */
+int ni_rwlock_tryrdlock(ni_rwlock *rw);
+void ni_rwlock_rdlock(ni_rwlock *rw);
+void ni_rwlock_rdunlock(ni_rwlock *rw);
+int ni_rwlock_trywrlock(ni_rwlock *rw);
+void ni_rwlock_wrlock(ni_rwlock *rw);
+void ni_rwlock_wrunlock(ni_rwlock *rw);
+
+#endif /* _NI_SYNC_H_ */
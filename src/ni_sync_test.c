@@ -0,0 +1,273 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include "ni_test.h"
+
+#define NI_SYNC_TEST_THREADS        8
+#define NI_SYNC_TEST_OPS            100000
+#define NI_SYNC_BENCH_OPS           2000000
+#define NI_SYNC_BENCH_MAX_THREADS   64
+#define NI_SYNC_BENCH_WRITE_EVERY   100
+
+static ni_spinlock test_spin = NI_SPINLOCK_INIT;
+static ni_seqlock test_seq = NI_SEQLOCK_INIT;
+static ni_rwlock test_rw = NI_RWLOCK_INIT;
+static long test_counter = 0;
+static volatile int test_writing = 0;
+static int test_torn = 0;
+
+/* Data of the seqlock and RW lock tests: 'b' is always twice 'a' when the
+ * lock is not held for writing. */
+static struct {
+    long a;
+    long b;
+} test_pair = { 0, 0 };
+
+static void *ni_sync_test_spin_thread(void *arg) {
+    int j;
+    ((void) arg);
+
+    for (j = 0; j < NI_SYNC_TEST_OPS; j++) {
+        ni_spin_lock(&test_spin);
+        test_counter++;
+        ni_spin_unlock(&test_spin);
+    }
+    return NULL;
+}
+
+static void *ni_sync_test_seq_reader(void *arg) {
+    long a, b;
+    unsigned seq;
+    ((void) arg);
+
+    while (test_writing) {
+        do {
+            seq = ni_seqlock_read_begin(&test_seq);
+            a = ni_sync_load_relaxed(&test_pair.a);
+            b = ni_sync_load_relaxed(&test_pair.b);
+        } while (ni_seqlock_read_retry(&test_seq, seq));
+        if (b != a * 2) test_torn = 1;
+    }
+    return NULL;
+}
+
+static void *ni_sync_test_rw_thread(void *arg) {
+    int j, writer = *(int*)arg;
+
+    for (j = 0; j < NI_SYNC_TEST_OPS; j++) {
+        if (writer && j % 10 == 0) {
+            ni_rwlock_wrlock(&test_rw);
+            test_pair.a++;
+            test_pair.b = test_pair.a * 2;
+            ni_rwlock_wrunlock(&test_rw);
+        } else {
+            ni_rwlock_rdlock(&test_rw);
+            if (test_pair.b != test_pair.a * 2) test_torn = 1;
+            ni_rwlock_rdunlock(&test_rw);
+        }
+    }
+    return NULL;
+}
+
+static void *ni_sync_test_rw_writer(void *arg) {
+    ((void) arg);
+    ni_rwlock_wrlock(&test_rw);
+    ni_rwlock_wrunlock(&test_rw);
+    return NULL;
+}
+
+int ni_sync_test() {
+    pthread_t tids[NI_SYNC_TEST_THREADS];
+    int j;
+
+    {
+        for (j = 0; j < NI_SYNC_TEST_THREADS; j++)
+            pthread_create(&tids[j], NULL, ni_sync_test_spin_thread, NULL);
+        for (j = 0; j < NI_SYNC_TEST_THREADS; j++)
+            pthread_join(tids[j], NULL);
+        test_cond("Spinlocks serialize the increments",
+            test_counter == (long)NI_SYNC_TEST_THREADS * NI_SYNC_TEST_OPS)
+        ni_spin_lock(&test_spin);
+        test_cond("Spinlocks can't be taken twice", ni_spin_trylock(&test_spin) == 0)
+        ni_spin_unlock(&test_spin);
+        test_cond("Released spinlocks can be taken", ni_spin_trylock(&test_spin) == 1)
+        ni_spin_unlock(&test_spin);
+    }
+
+    {
+        test_writing = 1;
+        for (j = 0; j < NI_SYNC_TEST_THREADS - 1; j++)
+            pthread_create(&tids[j], NULL, ni_sync_test_seq_reader, NULL);
+        for (j = 0; j < NI_SYNC_TEST_OPS; j++) {
+            ni_seqlock_write_lock(&test_seq);
+            ni_sync_store_relaxed(&test_pair.a, test_pair.a + 1);
+            ni_sync_store_relaxed(&test_pair.b, test_pair.a * 2);
+            ni_seqlock_write_unlock(&test_seq);
+        }
+        test_writing = 0;
+        for (j = 0; j < NI_SYNC_TEST_THREADS - 1; j++)
+            pthread_join(tids[j], NULL);
+        test_cond("Seqlock readers never see a torn update",
+            test_torn == 0 && test_seq.seq == 2 * NI_SYNC_TEST_OPS)
+    }
+
+    {
+        int writer[NI_SYNC_TEST_THREADS];
+        long start = test_pair.a;
+
+        for (j = 0; j < NI_SYNC_TEST_THREADS; j++) {
+            writer[j] = j < 2;
+            pthread_create(&tids[j], NULL, ni_sync_test_rw_thread, &writer[j]);
+        }
+        for (j = 0; j < NI_SYNC_TEST_THREADS; j++)
+            pthread_join(tids[j], NULL);
+        test_cond("RW lock readers never see a torn update",
+            test_torn == 0 && test_pair.a - start == 2 * NI_SYNC_TEST_OPS / 10 &&
+            test_rw.state == 0 && test_rw.writers == 0)
+
+        ni_rwlock_rdlock(&test_rw);
+        test_cond("Readers share the RW lock", ni_rwlock_tryrdlock(&test_rw) == 1 &&
+            ni_rwlock_trywrlock(&test_rw) == 0)
+        ni_rwlock_rdunlock(&test_rw);
+        pthread_create(&tids[0], NULL, ni_sync_test_rw_writer, NULL);
+        while (ni_sync_load(&test_rw.writers) == 0) sched_yield();
+        test_cond("Waiting writers keep new readers out",
+            ni_rwlock_tryrdlock(&test_rw) == 0)
+        ni_rwlock_rdunlock(&test_rw);
+        pthread_join(tids[0], NULL);
+        test_cond("Writers get the RW lock once the readers leave",
+            test_rw.state == 0 && test_rw.writers == 0)
+    }
+    test_report()
+    return 0;
+}
+
+/* ------------------------------- Benchmark -------------------------------- */
+
+#define NI_SYNC_BENCH_MUTEX         0
+#define NI_SYNC_BENCH_SPIN          1
+#define NI_SYNC_BENCH_MUTEX_RM      2   /* Read-mostly, see below. */
+#define NI_SYNC_BENCH_RWLOCK_RM     3
+#define NI_SYNC_BENCH_SEQLOCK_RM    4
+#define NI_SYNC_BENCH_KINDS         5
+
+static const char *bench_names[NI_SYNC_BENCH_KINDS] = {
+    "mutex", "spinlock", "mutex/rm", "rwlock/rm", "seqlock/rm"
+};
+
+typedef struct ni_sync_bench_arg {
+    int     kind;
+    long    ops;
+} ni_sync_bench_arg;
+
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ni_spinlock bench_spin = NI_SPINLOCK_INIT;
+static ni_rwlock bench_rw = NI_RWLOCK_INIT;
+static ni_seqlock bench_seq = NI_SEQLOCK_INIT;
+static long bench_stats[4];
+
+static long long ni_sync_bench_ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/* The exclusive workloads increment a counter, the read-mostly ones read a
+ * snapshot of four counters and update them once every
+ * NI_SYNC_BENCH_WRITE_EVERY operations. */
+static void *ni_sync_bench_thread(void *privdata) {
+    ni_sync_bench_arg *arg = privdata;
+    long j, snap[4], sum = 0;
+    unsigned seq;
+    int k;
+
+    for (j = 0; j < arg->ops; j++) {
+        int write = j % NI_SYNC_BENCH_WRITE_EVERY == 0;
+
+        switch (arg->kind) {
+        case NI_SYNC_BENCH_MUTEX:
+            pthread_mutex_lock(&bench_mutex);
+            bench_stats[0]++;
+            pthread_mutex_unlock(&bench_mutex);
+            break;
+        case NI_SYNC_BENCH_SPIN:
+            ni_spin_lock(&bench_spin);
+            bench_stats[0]++;
+            ni_spin_unlock(&bench_spin);
+            break;
+        case NI_SYNC_BENCH_MUTEX_RM:
+            pthread_mutex_lock(&bench_mutex);
+            for (k = 0; k < 4; k++) {
+                if (write) bench_stats[k]++;
+                snap[k] = bench_stats[k];
+            }
+            pthread_mutex_unlock(&bench_mutex);
+            break;
+        case NI_SYNC_BENCH_RWLOCK_RM:
+            if (write) {
+                ni_rwlock_wrlock(&bench_rw);
+                for (k = 0; k < 4; k++) snap[k] = ++bench_stats[k];
+                ni_rwlock_wrunlock(&bench_rw);
+            } else {
+                ni_rwlock_rdlock(&bench_rw);
+                for (k = 0; k < 4; k++) snap[k] = bench_stats[k];
+                ni_rwlock_rdunlock(&bench_rw);
+            }
+            break;
+        case NI_SYNC_BENCH_SEQLOCK_RM:
+            if (write) {
+                ni_seqlock_write_lock(&bench_seq);
+                for (k = 0; k < 4; k++)
+                    ni_sync_store_relaxed(&bench_stats[k], bench_stats[k] + 1);
+                ni_seqlock_write_unlock(&bench_seq);
+            }
+            do {
+                seq = ni_seqlock_read_begin(&bench_seq);
+                for (k = 0; k < 4; k++) snap[k] = ni_sync_load_relaxed(&bench_stats[k]);
+            } while (ni_seqlock_read_retry(&bench_seq, seq));
+            break;
+        }
+        if (arg->kind >= NI_SYNC_BENCH_MUTEX_RM) sum += snap[0];
+    }
+    return (void*)sum;
+}
+
+/* Run NI_SYNC_BENCH_OPS operations (or argv[1]) split among 1 to
+ * NI_SYNC_BENCH_MAX_THREADS threads with every primitive, printing the
+ * millions of operations per second. */
+int ni_sync_bench(int argc, char **argv) {
+    pthread_t tids[NI_SYNC_BENCH_MAX_THREADS];
+    ni_sync_bench_arg args[NI_SYNC_BENCH_MAX_THREADS];
+    long ops = NI_SYNC_BENCH_OPS;
+    int nthreads, kind, j;
+
+    if (argc > 1) ops = atol(argv[1]);
+    printf("ni_sync benchmark, %ld operations, Mops/sec "
+        "(rm: read-mostly, one write every %d operations)\n",
+        ops, NI_SYNC_BENCH_WRITE_EVERY);
+    printf("%-8s", "threads");
+    for (kind = 0; kind < NI_SYNC_BENCH_KINDS; kind++)
+        printf(" %11s", bench_names[kind]);
+    printf("\n");
+    for (nthreads = 1; nthreads <= NI_SYNC_BENCH_MAX_THREADS; nthreads *= 2) {
+        printf("%-8d", nthreads);
+        for (kind = 0; kind < NI_SYNC_BENCH_KINDS; kind++) {
+            long long start = ni_sync_bench_ustime(), elapsed;
+
+            for (j = 0; j < nthreads; j++) {
+                args[j].kind = kind;
+                args[j].ops = ops / nthreads;
+                pthread_create(&tids[j], NULL, ni_sync_bench_thread, &args[j]);
+            }
+            for (j = 0; j < nthreads; j++)
+                pthread_join(tids[j], NULL);
+            elapsed = ni_sync_bench_ustime() - start;
+            if (elapsed == 0) elapsed = 1;
+            printf(" %11.2f", (double)ops / elapsed);
+        }
+        printf("\n");
+    }
+    return 0;
+}
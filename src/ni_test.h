@@ -3,7 +3,17 @@
 #include "nini.h"
 
 int ni_malloc_test(int argc, char **argv);
+int ni_malloc_bench(int argc, char **argv);
 int ni_list_test();
 int ni_string_test();
+int ni_arena_test();
+int ni_lazyfree_test();
+int ni_defrag_test();
+int ni_sync_test();
+int ni_sync_bench(int argc, char **argv);
+int ni_epoch_test();
+int ni_ilist_test();
+int ni_ulist_test();
+int ni_listpack_test();
 
 #endif /* _NI_TEST_H_ */
@@ -0,0 +1,335 @@
+/* ni_ulist.c - An unrolled doubly linked list
+ *
+ * A list of chunks holding up to NI_ULIST_CHUNK_VALUES values each, see
+ * ni_ulist.h. Pushing to a full chunk at the ends adds a new chunk, while
+ * inserting into a full chunk in the middle splits it in two halves.
+ * Deleting from a chunk less than half full merges it with a neighbour
+ * when they fit in a single chunk, so that a list that shrank does not
+ * keep many almost empty chunks. ni_ulist_compact() packs all the chunks.
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "ni_ulist.h"
+#include "ni_malloc.h"
+
+/* Create a new list.
+ *
+ * On error, NULL is returned. Otherwise the pointer to the new list. */
+ni_ulist *ni_ulist_create(void) {
+    ni_ulist *lst;
+    if ((lst = ni_malloc_sized_tagged(sizeof(*lst), NI_MEM_LIST)) == NULL)
+        return NULL;
+    lst->head = lst->tail = NULL;
+    lst->free = NULL;
+    lst->len = 0;
+    lst->chunks = 0;
+    return lst;
+}
+
+/* Allocate a chunk and link it after 'prev', or as head if 'prev' is NULL.
+ *
+ * On error, NULL is returned. Otherwise the new chunk. */
+static ni_ulist_chunk *ni_ulist_chunk_new(ni_ulist *lst, ni_ulist_chunk *prev) {
+    ni_ulist_chunk *chunk;
+
+    if ((chunk = ni_malloc_sized_tagged(sizeof(*chunk), NI_MEM_LIST)) == NULL)
+        return NULL;
+    chunk->count = 0;
+    chunk->prev = prev;
+    chunk->next = prev ? prev->next : lst->head;
+    if (chunk->next)
+        chunk->next->prev = chunk;
+    else
+        lst->tail = chunk;
+    if (prev)
+        prev->next = chunk;
+    else
+        lst->head = chunk;
+    lst->chunks++;
+    return chunk;
+}
+
+static void ni_ulist_chunk_free(ni_ulist *lst, ni_ulist_chunk *chunk) {
+    if (chunk->prev)
+        chunk->prev->next = chunk->next;
+    else
+        lst->head = chunk->next;
+    if (chunk->next)
+        chunk->next->prev = chunk->prev;
+    else
+        lst->tail = chunk->prev;
+    lst->chunks--;
+    ni_free_sized_tagged(chunk, sizeof(*chunk), NI_MEM_LIST);
+}
+
+/* Remove all the elements from the list without destroying the list itself. */
+void ni_ulist_empty(ni_ulist *lst) {
+    ni_ulist_chunk *chunk, *next;
+    int j;
+
+    for (chunk = lst->head; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        if (lst->free)
+            for (j = 0; j < chunk->count; j++) lst->free(chunk->values[j]);
+        ni_free_sized_tagged(chunk, sizeof(*chunk), NI_MEM_LIST);
+    }
+    lst->head = lst->tail = NULL;
+    lst->len = 0;
+    lst->chunks = 0;
+}
+
+/* Free the whole list.
+ *
+ * This function can't fail. */
+void ni_ulist_release(ni_ulist *lst) {
+    ni_ulist_empty(lst);
+    ni_free_sized_tagged(lst, sizeof(*lst), NI_MEM_LIST);
+}
+
+/* Add 'val' to the head of the list.
+ *
+ * On error, NULL is returned and no operation is performed.
+ * On success the 'lst' pointer you pass to the function is returned. */
+ni_ulist *ni_ulist_push_head(ni_ulist *lst, void *val) {
+    ni_ulist_chunk *chunk = lst->head;
+
+    if (chunk == NULL || chunk->count == NI_ULIST_CHUNK_VALUES) {
+        if ((chunk = ni_ulist_chunk_new(lst, NULL)) == NULL)
+            return NULL;
+    }
+    memmove(chunk->values + 1, chunk->values, sizeof(void*) * chunk->count);
+    chunk->values[0] = val;
+    chunk->count++;
+    lst->len++;
+    return lst;
+}
+
+/* Add 'val' to the tail of the list.
+ *
+ * On error, NULL is returned and no operation is performed.
+ * On success the 'lst' pointer you pass to the function is returned. */
+ni_ulist *ni_ulist_push_tail(ni_ulist *lst, void *val) {
+    ni_ulist_chunk *chunk = lst->tail;
+
+    if (chunk == NULL || chunk->count == NI_ULIST_CHUNK_VALUES) {
+        if ((chunk = ni_ulist_chunk_new(lst, lst->tail)) == NULL)
+            return NULL;
+    }
+    chunk->values[chunk->count++] = val;
+    lst->len++;
+    return lst;
+}
+
+/* Remove the head value of the list storing it in '*val'. The free method
+ * is not called, the value belongs to the caller now.
+ *
+ * Returns 1 if a value was removed, 0 if the list is empty. */
+int ni_ulist_pop_head(ni_ulist *lst, void **val) {
+    ni_ulist_chunk *chunk = lst->head;
+
+    if (chunk == NULL) return 0;
+    *val = chunk->values[0];
+    if (--chunk->count == 0)
+        ni_ulist_chunk_free(lst, chunk);
+    else
+        memmove(chunk->values, chunk->values + 1, sizeof(void*) * chunk->count);
+    lst->len--;
+    return 1;
+}
+
+/* Remove the tail value of the list, like ni_ulist_pop_head(). */
+int ni_ulist_pop_tail(ni_ulist *lst, void **val) {
+    ni_ulist_chunk *chunk = lst->tail;
+
+    if (chunk == NULL) return 0;
+    *val = chunk->values[--chunk->count];
+    if (chunk->count == 0)
+        ni_ulist_chunk_free(lst, chunk);
+    lst->len--;
+    return 1;
+}
+
+/* Return the chunk holding the value at the zero-based index 'idx',
+ * negative integers counting from the tail, setting '*pos' to its position
+ * in the chunk. The walk starts from the nearest end and skips a chunk at
+ * a time. If the index is out of range NULL is returned. */
+static ni_ulist_chunk *ni_ulist_locate(ni_ulist *lst, long idx, int *pos) {
+    ni_ulist_chunk *chunk;
+    unsigned long i;
+
+    if (idx < 0) idx += (long)lst->len;
+    if (idx < 0 || (unsigned long)idx >= lst->len) return NULL;
+    i = idx;
+    if (i < lst->len / 2) {
+        for (chunk = lst->head; i >= (unsigned long)chunk->count; chunk = chunk->next)
+            i -= chunk->count;
+    } else {
+        /* Count from the tail: 'i' becomes the distance from the end. */
+        i = lst->len - 1 - i;
+        for (chunk = lst->tail; i >= (unsigned long)chunk->count; chunk = chunk->prev)
+            i -= chunk->count;
+        i = chunk->count - 1 - i;
+    }
+    *pos = (int)i;
+    return chunk;
+}
+
+/* Return the address of the value at the zero-based index 'idx', negative
+ * integers counting from the tail like ni_list_index(), so that it can be
+ * read or replaced. If the index is out of range NULL is returned. */
+void **ni_ulist_index(ni_ulist *lst, long idx) {
+    ni_ulist_chunk *chunk;
+    int pos;
+
+    if ((chunk = ni_ulist_locate(lst, idx, &pos)) == NULL)
+        return NULL;
+    return &chunk->values[pos];
+}
+
+/* Insert 'val' so that it ends up at the index 'idx', shifting the value
+ * there and the following ones. 'idx' can be the length of the list to
+ * append, negative integers count from the tail.
+ *
+ * On error, NULL is returned and no operation is performed, that is the
+ * index is out of range or we are out of memory.
+ * On success the 'lst' pointer you pass to the function is returned. */
+ni_ulist *ni_ulist_insert(ni_ulist *lst, long idx, void *val) {
+    ni_ulist_chunk *chunk, *split;
+    int pos, half;
+
+    if (idx < 0) idx += (long)lst->len;
+    if (idx < 0 || (unsigned long)idx > lst->len) return NULL;
+    if (idx == 0) return ni_ulist_push_head(lst, val);
+    if ((unsigned long)idx == lst->len) return ni_ulist_push_tail(lst, val);
+    if ((chunk = ni_ulist_locate(lst, idx, &pos)) == NULL)
+        return NULL;
+    if (chunk->count == NI_ULIST_CHUNK_VALUES) {
+        /* Appending to the previous chunk is cheaper than a split. */
+        if (pos == 0 && chunk->prev && chunk->prev->count < NI_ULIST_CHUNK_VALUES) {
+            chunk = chunk->prev;
+            pos = chunk->count;
+        } else {
+            if ((split = ni_ulist_chunk_new(lst, chunk)) == NULL)
+                return NULL;
+            half = chunk->count / 2;
+            split->count = chunk->count - half;
+            memcpy(split->values, chunk->values + half, sizeof(void*) * split->count);
+            chunk->count = half;
+            if (pos > half) {
+                chunk = split;
+                pos -= half;
+            }
+        }
+    }
+    memmove(chunk->values + pos + 1, chunk->values + pos,
+            sizeof(void*) * (chunk->count - pos));
+    chunk->values[pos] = val;
+    chunk->count++;
+    lst->len++;
+    return lst;
+}
+
+/* Move all the values of 'next' at the end of 'chunk' and free 'next'. The
+ * caller checked that they fit. */
+static void ni_ulist_chunk_merge(ni_ulist *lst, ni_ulist_chunk *chunk, ni_ulist_chunk *next) {
+    memcpy(chunk->values + chunk->count, next->values, sizeof(void*) * next->count);
+    chunk->count += next->count;
+    ni_ulist_chunk_free(lst, next);
+}
+
+/* Delete the value at the index 'idx', negative integers counting from the
+ * tail, calling the free method on it.
+ *
+ * Returns 1 if the value was deleted, 0 if the index is out of range. */
+int ni_ulist_delete(ni_ulist *lst, long idx) {
+    ni_ulist_chunk *chunk;
+    int pos;
+
+    if ((chunk = ni_ulist_locate(lst, idx, &pos)) == NULL)
+        return 0;
+    if (lst->free)
+        lst->free(chunk->values[pos]);
+    chunk->count--;
+    memmove(chunk->values + pos, chunk->values + pos + 1,
+            sizeof(void*) * (chunk->count - pos));
+    lst->len--;
+    if (chunk->count == 0) {
+        ni_ulist_chunk_free(lst, chunk);
+    } else if (chunk->count < NI_ULIST_CHUNK_VALUES / 2) {
+        if (chunk->next &&
+            chunk->count + chunk->next->count <= NI_ULIST_CHUNK_VALUES)
+            ni_ulist_chunk_merge(lst, chunk, chunk->next);
+        else if (chunk->prev &&
+            chunk->prev->count + chunk->count <= NI_ULIST_CHUNK_VALUES)
+            ni_ulist_chunk_merge(lst, chunk->prev, chunk);
+    }
+    return 1;
+}
+
+/* Pack the values in as few chunks as possible, filling every chunk with
+ * the values of the following ones and freeing the chunks left empty. */
+void ni_ulist_compact(ni_ulist *lst) {
+    ni_ulist_chunk *chunk, *next;
+    int moved;
+
+    for (chunk = lst->head; chunk != NULL; chunk = chunk->next) {
+        while (chunk->count < NI_ULIST_CHUNK_VALUES && (next = chunk->next) != NULL) {
+            moved = NI_ULIST_CHUNK_VALUES - chunk->count;
+            if (moved >= next->count) {
+                ni_ulist_chunk_merge(lst, chunk, next);
+                continue;
+            }
+            memcpy(chunk->values + chunk->count, next->values, sizeof(void*) * moved);
+            chunk->count += moved;
+            next->count -= moved;
+            memmove(next->values, next->values + moved, sizeof(void*) * next->count);
+        }
+    }
+}
+
+/* Iterators live in the caller, usually on the stack. The list must not be
+ * modified while iterating. */
+void ni_ulist_rewind(ni_ulist *lst, ni_ulist_iter *iter) {
+    iter->chunk = lst->head;
+    iter->pos = 0;
+    iter->direction = UL_START_HEAD;
+}
+
+void ni_ulist_rewind_tail(ni_ulist *lst, ni_ulist_iter *iter) {
+    iter->chunk = lst->tail;
+    iter->pos = lst->tail ? lst->tail->count - 1 : 0;
+    iter->direction = UL_START_TAIL;
+}
+
+/* Store the next value of an iterator in '*val'.
+ *
+ * Returns 1 if a value was stored, 0 if there are no more values:
+ *
+ * ni_ulist_rewind(lst, &iter);
+ * while (ni_ulist_next(&iter, &val)) {
+ *     doSomethingWith(val);
+ * }
+ */
+int ni_ulist_next(ni_ulist_iter *iter, void **val) {
+    ni_ulist_chunk *chunk = iter->chunk;
+
+    if (chunk == NULL) return 0;
+    *val = chunk->values[iter->pos];
+    if (iter->direction == UL_START_HEAD) {
+        if (++iter->pos == chunk->count) {
+            iter->chunk = chunk->next;
+            iter->pos = 0;
+        }
+    } else {
+        if (--iter->pos < 0) {
+            iter->chunk = chunk->prev;
+            iter->pos = iter->chunk ? iter->chunk->count - 1 : 0;
+        }
+    }
+    return 1;
+}
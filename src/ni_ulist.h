@@ -0,0 +1,66 @@
+/* ni_ulist.h - An unrolled doubly linked list
+ *
+ * Copyright (c) 2020-2030, Lei Wang <wanglei_gmgc@163.com>
+ * All rights reserved.
+ *
+ */
+
+#ifndef _NI_ULIST_H_
+#define _NI_ULIST_H_
+
+/* Values per chunk: with the links and the count a chunk is 128 bytes, two
+ * cache lines, against the 24 bytes per value of an ni_list node. */
+#define NI_ULIST_CHUNK_VALUES   13
+
+/* The values are kept in chunks of up to NI_ULIST_CHUNK_VALUES values, in
+ * order and packed at the start of the chunk. Walking the list touches a
+ * chunk every NI_ULIST_CHUNK_VALUES values, and looking up an index skips
+ * whole chunks using their count. */
+typedef struct ni_ulist_chunk {
+    struct ni_ulist_chunk   *prev;
+    struct ni_ulist_chunk   *next;
+    int                     count;
+    void                    *values[NI_ULIST_CHUNK_VALUES];
+} ni_ulist_chunk;
+
+typedef struct ni_ulist_iter {
+    ni_ulist_chunk  *chunk;
+    int             pos;        /* Next value to return in 'chunk'. */
+    int             direction;
+} ni_ulist_iter;
+
+typedef struct ni_ulist {
+    ni_ulist_chunk  *head;
+    ni_ulist_chunk  *tail;
+    void            (*free)(void *ptr);
+    unsigned long   len;
+    unsigned long   chunks;
+} ni_ulist;
+
+/* Functions implemented as macros */
+#define ulstLen(l)              ((l)->len)
+#define ulstChunks(l)           ((l)->chunks)
+#define ulstSetFreeMethod(l, m) ((l)->free = (m))
+#define ulstGetFree(l)          ((l)->free)
+
+/* Prototypes */
+ni_ulist *ni_ulist_create(void);
+void ni_ulist_release(ni_ulist *lst);
+void ni_ulist_empty(ni_ulist *lst);
+ni_ulist *ni_ulist_push_head(ni_ulist *lst, void *val);
+ni_ulist *ni_ulist_push_tail(ni_ulist *lst, void *val);
+int ni_ulist_pop_head(ni_ulist *lst, void **val);
+int ni_ulist_pop_tail(ni_ulist *lst, void **val);
+ni_ulist *ni_ulist_insert(ni_ulist *lst, long idx, void *val);
+int ni_ulist_delete(ni_ulist *lst, long idx);
+void **ni_ulist_index(ni_ulist *lst, long idx);
+void ni_ulist_compact(ni_ulist *lst);
+void ni_ulist_rewind(ni_ulist *lst, ni_ulist_iter *iter);
+void ni_ulist_rewind_tail(ni_ulist *lst, ni_ulist_iter *iter);
+int ni_ulist_next(ni_ulist_iter *iter, void **val);
+
+/* Directions for iterators, the same of ni_list */
+#define UL_START_HEAD 0
+#define UL_START_TAIL 1
+
+#endif /* _NI_ULIST_H_ */
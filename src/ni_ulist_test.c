@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "ni_test.h"
+
+#define NI_ULIST_TEST_OPS       20000
+#define NI_ULIST_TEST_VALUES    1000000
+#define NI_ULIST_TEST_LOOKUPS   1000
+
+static long long ni_ulist_test_ustime(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static int ni_ulist_test_freed = 0;
+
+static void ni_ulist_test_free(void *ptr) {
+    (void)ptr;
+    ni_ulist_test_freed++;
+}
+
+/* Check 'lst' holds the 'len' values of 'ref', by index and by iterators in
+ * both directions, and that no chunk is empty or overfilled. */
+static int ni_ulist_test_check(ni_ulist *lst, long *ref, long len) {
+    ni_ulist_iter iter;
+    ni_ulist_chunk *chunk;
+    unsigned long chunks = 0, count = 0;
+    void *val;
+    long j;
+
+    if ((long)ulstLen(lst) != len) return 0;
+    for (chunk = lst->head; chunk != NULL; chunk = chunk->next) {
+        if (chunk->count <= 0 || chunk->count > NI_ULIST_CHUNK_VALUES) return 0;
+        if (chunk->next && chunk->next->prev != chunk) return 0;
+        count += chunk->count;
+        chunks++;
+    }
+    if (count != ulstLen(lst) || chunks != ulstChunks(lst)) return 0;
+    for (j = 0; j < len; j += 97)
+        if ((long)*ni_ulist_index(lst, j) != ref[j] ||
+            (long)*ni_ulist_index(lst, j - len) != ref[j]) return 0;
+    ni_ulist_rewind(lst, &iter);
+    for (j = 0; ni_ulist_next(&iter, &val); j++)
+        if (j >= len || (long)val != ref[j]) return 0;
+    if (j != len) return 0;
+    ni_ulist_rewind_tail(lst, &iter);
+    for (j = len - 1; ni_ulist_next(&iter, &val); j--)
+        if (j < 0 || (long)val != ref[j]) return 0;
+    return j == -1;
+}
+
+int ni_ulist_test() {
+    {
+        ni_ulist *lst = ni_ulist_create();
+        ni_ulist_chunk *chunk;
+        void *val;
+        long j;
+
+        for (j = 0; j < 20; j++) ni_ulist_push_tail(lst, (void*)j);
+        test_cond("Push tail fills the chunks", ulstLen(lst) == 20 &&
+            ulstChunks(lst) == 2 && lst->head->count == NI_ULIST_CHUNK_VALUES)
+        ni_ulist_insert(lst, 5, (void*)100);
+        test_cond("Insert into a full chunk splits it", ulstChunks(lst) == 3 &&
+            (long)*ni_ulist_index(lst, 5) == 100 && (long)*ni_ulist_index(lst, 6) == 5 &&
+            (long)*ni_ulist_index(lst, -1) == 19)
+        test_cond("Out of range indexes are refused",
+            ni_ulist_index(lst, 21) == NULL && ni_ulist_index(lst, -22) == NULL &&
+            ni_ulist_insert(lst, 22, NULL) == NULL && ni_ulist_insert(lst, -22, NULL) == NULL &&
+            ni_ulist_delete(lst, 21) == 0 && ni_ulist_delete(lst, -22) == 0 && ulstLen(lst) == 21)
+
+        ulstSetFreeMethod(lst, ni_ulist_test_free);
+        ni_ulist_test_freed = 0;
+        for (j = 0; j < 8; j++) ni_ulist_delete(lst, 1);
+        for (chunk = lst->head, j = 0; chunk != NULL; chunk = chunk->next)
+            if (chunk->count < NI_ULIST_CHUNK_VALUES / 2 && chunk->next &&
+                chunk->count + chunk->next->count <= NI_ULIST_CHUNK_VALUES) j++;
+        test_cond("Delete merges underfilled chunks", ni_ulist_test_freed == 8 &&
+            ulstLen(lst) == 13 && j == 0 && (long)*ni_ulist_index(lst, 1) == 8)
+
+        ni_ulist_compact(lst);
+        test_cond("Compact packs the values", ulstChunks(lst) == 1)
+        test_cond("Pop at both ends",
+            ni_ulist_pop_head(lst, &val) && (long)val == 0 &&
+            ni_ulist_pop_tail(lst, &val) && (long)val == 19 && ulstLen(lst) == 11)
+        while (ni_ulist_pop_tail(lst, &val));
+        test_cond("Popping every value frees every chunk",
+            ulstLen(lst) == 0 && ulstChunks(lst) == 0 && lst->head == NULL &&
+            lst->tail == NULL && ni_ulist_pop_head(lst, &val) == 0)
+        ni_ulist_release(lst);
+    }
+
+    /* Random operations checked against a plain array. */
+    {
+        ni_ulist *lst = ni_ulist_create();
+        long *ref = ni_malloc(sizeof(long) * NI_ULIST_TEST_OPS);
+        long len = 0, j, idx, ok = 1;
+        void *val;
+        int op;
+
+        srand(1234);
+        for (j = 0; j < NI_ULIST_TEST_OPS; j++) {
+            op = rand() % 10;
+            if (op < 5 || len == 0) {
+                idx = rand() % (len + 1);
+                ni_ulist_insert(lst, idx, (void*)j);
+                memmove(ref + idx + 1, ref + idx, sizeof(long) * (len - idx));
+                ref[idx] = j;
+                len++;
+            } else if (op < 7) {
+                idx = rand() % len;
+                ni_ulist_delete(lst, idx);
+                memmove(ref + idx, ref + idx + 1, sizeof(long) * (len - idx - 1));
+                len--;
+            } else if (op == 7) {
+                ok &= ni_ulist_pop_head(lst, &val) && (long)val == ref[0];
+                memmove(ref, ref + 1, sizeof(long) * --len);
+            } else if (op == 8) {
+                ok &= ni_ulist_pop_tail(lst, &val) && (long)val == ref[--len];
+            } else {
+                ni_ulist_push_head(lst, (void*)j);
+                memmove(ref + 1, ref, sizeof(long) * len++);
+                ref[0] = j;
+            }
+            if (j % 1000 == 0) ok &= ni_ulist_test_check(lst, ref, len);
+        }
+        test_cond("Random operations match an array",
+            ok && ni_ulist_test_check(lst, ref, len))
+        ni_ulist_compact(lst);
+        test_cond("Compact keeps the order and fills the chunks",
+            ni_ulist_test_check(lst, ref, len) &&
+            (long)ulstChunks(lst) == (len + NI_ULIST_CHUNK_VALUES - 1) / NI_ULIST_CHUNK_VALUES)
+        ni_ulist_release(lst);
+        ni_free(ref);
+    }
+
+    /* Memory and index lookups in the middle of long lists, against ni_list
+     * that walks a node per step. */
+    {
+        ni_list *lst;
+        ni_ulist *ulst;
+        size_t used, mem, umem;
+        long long start, elapsed, uelapsed;
+        long j, sum = 0, usum = 0;
+
+        used = ni_malloc_used_memory();
+        lst = ni_list_create();
+        for (j = 0; j < NI_ULIST_TEST_VALUES; j++) ni_list_add_node_tail(lst, (void*)j);
+        mem = ni_malloc_used_memory() - used;
+        start = ni_ulist_test_ustime();
+        for (j = 0; j < NI_ULIST_TEST_LOOKUPS; j++)
+            sum += (long)lstNodeVal(ni_list_index(lst, NI_ULIST_TEST_VALUES / 2 - j));
+        elapsed = ni_ulist_test_ustime() - start;
+        ni_list_release(lst);
+
+        used = ni_malloc_used_memory();
+        ulst = ni_ulist_create();
+        for (j = 0; j < NI_ULIST_TEST_VALUES; j++) ni_ulist_push_tail(ulst, (void*)j);
+        umem = ni_malloc_used_memory() - used;
+        start = ni_ulist_test_ustime();
+        for (j = 0; j < NI_ULIST_TEST_LOOKUPS; j++)
+            usum += (long)*ni_ulist_index(ulst, NI_ULIST_TEST_VALUES / 2 - j);
+        uelapsed = ni_ulist_test_ustime() - start;
+        ni_ulist_release(ulst);
+
+        printf("%d values: ni_list %zu bytes, ni_ulist %zu bytes\n",
+            NI_ULIST_TEST_VALUES, mem, umem);
+        printf("%d lookups in the middle: ni_list %lld us, ni_ulist %lld us\n",
+            NI_ULIST_TEST_LOOKUPS, elapsed, uelapsed);
+        test_cond("Unrolled and regular lists find the same values", sum == usum)
+        test_cond("Unrolled list uses less memory", umem < mem)
+    }
+    test_report()
+    return 0;
+}
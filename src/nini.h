@@ -2,8 +2,16 @@
 #define _NINI_H_
 
 #include "ni_malloc.h"
+#include "ni_arena.h"
 #include "ni_list.h"
+#include "ni_ilist.h"
+#include "ni_ulist.h"
+#include "ni_listpack.h"
 #include "ni_string.h"
+#include "ni_lazyfree.h"
+#include "ni_defrag.h"
+#include "ni_sync.h"
+#include "ni_epoch.h"
 #include "ni_testhelp.h"
 
 #endif /* _NINI_H_ */